@@ -0,0 +1,66 @@
+/* OPC UA protocol implementation
+ * (c) 2014 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "bench.hxx"
+
+#include <event2/event.h>
+
+#include <cstdlib>
+#include <new>
+
+size_t bench::allocations = 0;
+
+void* operator new(size_t size)
+{
+	++bench::allocations;
+
+	void* p = std::malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+static void* counting_malloc(size_t size)
+{
+	++bench::allocations;
+	return std::malloc(size);
+}
+
+static void* counting_realloc(void* p, size_t size)
+{
+	if (!p)
+		++bench::allocations;
+	return std::realloc(p, size);
+}
+
+void bench::init()
+{
+	event_set_mem_functions(counting_malloc, counting_realloc, std::free);
+}
+
+double bench::min_time()
+{
+	static double t = 0;
+
+	if (t == 0)
+	{
+		const char* env = std::getenv("BENCH_TIME");
+
+		t = env ? std::atof(env) : 0.5;
+		if (t <= 0)
+			t = 0.5;
+	}
+
+	return t;
+}
@@ -0,0 +1,70 @@
+/* OPC UA protocol implementation
+ * (c) 2014 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef OPCUA_BENCH_BENCH_HXX
+#define OPCUA_BENCH_BENCH_HXX 1
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <string>
+
+namespace bench
+{
+	// number of allocations made so far (both through operator new
+	// and libevent)
+	extern size_t allocations;
+
+	// install allocation counting for libevent; needs to be called
+	// before any libevent object is created
+	void init();
+
+	// minimal duration of a single benchmark in seconds,
+	// can be overriden via BENCH_TIME environment variable
+	double min_time();
+
+	// Call fn() repeatedly, doubling the iteration count until
+	// the run takes at least min_time(). Reports time and allocations
+	// per item, where each call of fn() processes the given number
+	// of items.
+	template <class F>
+	void run(const std::string& name, size_t items, F fn);
+
+	// benchmark implementation
+	template <class F>
+	void run(const std::string& name, size_t items, F fn)
+	{
+		typedef std::chrono::steady_clock clock;
+
+		// warm up caches and buffers
+		fn();
+
+		for (size_t iters = 1; ; iters *= 2)
+		{
+			size_t allocs = allocations;
+			clock::time_point start = clock::now();
+
+			for (size_t i = 0; i < iters; ++i)
+				fn();
+
+			std::chrono::duration<double> elapsed = clock::now() - start;
+			allocs = allocations - allocs;
+
+			if (elapsed.count() >= min_time())
+			{
+				double ops = static_cast<double>(iters) * items;
+
+				std::printf("%-40s %12.1f ns/op %10.2f allocs/op\n",
+						name.c_str(), elapsed.count() * 1E9 / ops,
+						allocs / ops);
+				break;
+			}
+		}
+	}
+};
+
+#endif /*OPCUA_BENCH_BENCH_HXX*/
@@ -0,0 +1,142 @@
+/* OPC UA protocol implementation
+ * (c) 2014 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "bench.hxx"
+
+#include <opcua/common/object.hxx>
+#include <opcua/common/struct.hxx>
+#include <opcua/common/types.hxx>
+#include <opcua/common/util.hxx>
+#include <opcua/tcp/types.hxx>
+
+#include <cstdint>
+#include <vector>
+
+// encode the value count times per op, then drain the buffer;
+// the value is passed to the serializer as As (e.g. Struct for messages)
+template <class T, class As = T>
+void bench_encode(const std::string& name, const T& val, size_t count = 1)
+{
+	opc_ua::MemorySerializationBuffer buf;
+	opc_ua::tcp::BinarySerializer srl;
+	const As& in = val;
+	std::vector<uint8_t> scratch(opc_ua::tcp::encoded_size(in) * count);
+
+	bench::run("encode " + name, count, [&] () {
+		for (size_t i = 0; i < count; ++i)
+			srl.serialize(buf, in);
+		buf.read(scratch.data(), scratch.size());
+	});
+}
+
+// fill the buffer with count encoded values per op, then decode them
+template <class T, class As = T>
+void bench_decode(const std::string& name, const T& val, size_t count = 1)
+{
+	opc_ua::MemorySerializationBuffer buf;
+	opc_ua::tcp::BinarySerializer srl;
+	std::vector<uint8_t> ser;
+	T out_val;
+	As& out = out_val;
+
+	for (size_t i = 0; i < count; ++i)
+		srl.serialize(buf, static_cast<const As&>(val));
+	ser.resize(buf.size());
+	buf.read(ser.data(), ser.size());
+
+	bench::run("decode " + name, count, [&] () {
+		buf.write(ser.data(), ser.size());
+		buf.pullup();
+		for (size_t i = 0; i < count; ++i)
+			srl.unserialize(buf, out);
+		buf.release();
+	});
+}
+
+template <class T, class As = T>
+void bench_codec(const std::string& name, const T& val, size_t count = 1)
+{
+	bench_encode<T, As>(name, val, count);
+	bench_decode<T, As>(name, val, count);
+}
+
+opc_ua::ReadRequest make_read_request(size_t n)
+{
+	opc_ua::ReadRequest rr;
+
+	rr.nodes_to_read.resize(n);
+	for (size_t i = 0; i < n; ++i)
+	{
+		rr.nodes_to_read[i].node_id = opc_ua::NodeId("I" + std::to_string(i), 1);
+		rr.nodes_to_read[i].attribute_id = static_cast<opc_ua::UInt32>(opc_ua::AttributeId::VALUE);
+	}
+	return rr;
+}
+
+opc_ua::ReadResponse make_read_response(size_t n)
+{
+	opc_ua::ReadResponse resp;
+
+	resp.results.resize(n);
+	for (auto& r : resp.results)
+	{
+		r.flags = static_cast<opc_ua::Byte>(opc_ua::DataValueFlags::VALUE_SPECIFIED)
+				| static_cast<opc_ua::Byte>(opc_ua::DataValueFlags::SERVER_TIMESTAMP_SPECIFIED);
+		r.value = opc_ua::Variant(opc_ua::UInt32(42));
+		r.server_timestamp = opc_ua::DateTime::now();
+	}
+	return resp;
+}
+
+// ReadRequest carrying another one in its additional header,
+// depth levels deep
+opc_ua::ReadRequest make_nested_request(size_t depth)
+{
+	opc_ua::ReadRequest rr = make_read_request(1);
+
+	if (depth > 0)
+		rr.request_header.additional_header.inner_object.reset(
+				new opc_ua::ReadRequest(make_nested_request(depth - 1)));
+	return rr;
+}
+
+int main()
+{
+	bench::init();
+
+	// primitives are processed in batches to amortize the draining
+	bench_codec("UInt32", opc_ua::UInt32(1000000000), 1000);
+	bench_codec("Double", opc_ua::Double(3.14), 1000);
+	bench_codec("String(8)", opc_ua::String("ABCDEFGH"), 1000);
+	bench_codec("DateTime", opc_ua::DateTime::now(), 1000);
+
+	bench_codec("NodeId(numeric)", opc_ua::NodeId(1025, 5), 1000);
+	bench_codec("NodeId(string)", opc_ua::NodeId("Q1", 1), 1000);
+	bench_codec("Variant(UInt32)", opc_ua::Variant(opc_ua::UInt32(42)), 1000);
+	bench_codec("Variant(String)", opc_ua::Variant(opc_ua::String("ABCDEFGH")), 1000);
+	bench_codec("DataValue", make_read_response(1).results[0], 1000);
+
+	// messages go through the generic Struct entry point
+	for (size_t n : {1, 100, 10000})
+	{
+		bench_codec<opc_ua::ReadRequest, opc_ua::Struct>(
+				"ReadRequest(" + std::to_string(n) + ")", make_read_request(n));
+		bench_codec<opc_ua::ReadResponse, opc_ua::Struct>(
+				"ReadResponse(" + std::to_string(n) + ")", make_read_response(n));
+	}
+
+	for (size_t depth : {1, 4, 16})
+	{
+		bench_codec<opc_ua::ReadRequest, opc_ua::Struct>(
+				"ExtensionObject(depth " + std::to_string(depth) + ")",
+				make_nested_request(depth));
+	}
+
+	return 0;
+}
@@ -0,0 +1,102 @@
+/* OPC UA protocol implementation
+ * (c) 2014 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "bench.hxx"
+
+#include <opcua/common/object.hxx>
+#include <opcua/common/random.hxx>
+#include <opcua/common/struct.hxx>
+#include <opcua/common/types.hxx>
+#include <opcua/tcp/server.hxx>
+
+#include <event2/event.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <memory>
+#include <stdexcept>
+
+// run the event loop and discard whatever the stream wrote
+// until nothing is left
+void drain(event_base* ev, int fd)
+{
+	char buf[65536];
+
+	while (1)
+	{
+		size_t total = 0;
+		ssize_t rd;
+
+		event_base_loop(ev, EVLOOP_NONBLOCK);
+		while ((rd = read(fd, buf, sizeof(buf))) > 0)
+			total += rd;
+		if (rd == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+			throw std::runtime_error("Reading from the socket pair failed");
+
+		if (total == 0)
+			break;
+	}
+}
+
+int main()
+{
+	bench::init();
+
+	bench::run("random_bytes(32)", 1, [] () {
+		unsigned char buf[32];
+		opc_ua::random_bytes(buf, sizeof(buf));
+	});
+	bench::run("GUID::random_guid()", 1, [] () {
+		opc_ua::GUID::random_guid();
+	});
+
+	event_base* ev = event_base_new();
+	opc_ua::AddressSpace as;
+	std::unique_ptr<opc_ua::tcp::Server> server_ptr(new opc_ua::tcp::Server(ev, as));
+	opc_ua::tcp::Server& server = *server_ptr;
+
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+		throw std::runtime_error("socketpair() failed");
+	evutil_make_socket_nonblocking(fds[0]);
+	evutil_make_socket_nonblocking(fds[1]);
+
+	{
+		// (the stream takes ownership of fds[0])
+		opc_ua::tcp::ServerTransportStream ts(server, ev, fds[0]);
+		opc_ua::tcp::ServerMessageStream ms(server, ts);
+
+		opc_ua::CreateSessionRequest csr(opc_ua::ApplicationType::CLIENT,
+				"opc.tcp://localhost:6001", "bench", opc_ua::random_nonce(), 60000);
+		opc_ua::ActivateSessionRequest asr;
+
+		// a full session lifetime, with the responses written
+		// to a local socket
+		bench::run("create, activate & close session", 1, [&] () {
+			opc_ua::CreateSessionResponse resp = server.create_session(csr);
+
+			asr.request_header.authentication_token = resp.authentication_token;
+			opc_ua::ActivateSessionResponse aresp;
+			std::shared_ptr<opc_ua::tcp::ServerSessionStream> ss
+				= server.activate_session(asr, ms, aresp);
+			ms.write_message(aresp, 1);
+
+			server.close_session(*ss);
+			server.detach_session(*ss, ms);
+			drain(ev, fds[1]);
+		});
+	}
+
+	close(fds[1]);
+	server_ptr.reset();
+	event_base_free(ev);
+	return 0;
+}
@@ -0,0 +1,95 @@
+/* OPC UA protocol implementation
+ * (c) 2014 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "bench.hxx"
+
+#include <opcua/common/object.hxx>
+#include <opcua/common/struct.hxx>
+#include <opcua/common/types.hxx>
+#include <opcua/tcp/server.hxx>
+
+#include <event2/event.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <memory>
+#include <stdexcept>
+
+// run the event loop and discard whatever the stream wrote
+// until nothing is left
+void drain(event_base* ev, int fd)
+{
+	char buf[65536];
+
+	while (1)
+	{
+		size_t total = 0;
+		ssize_t rd;
+
+		event_base_loop(ev, EVLOOP_NONBLOCK);
+		while ((rd = read(fd, buf, sizeof(buf))) > 0)
+			total += rd;
+		if (rd == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+			throw std::runtime_error("Reading from the socket pair failed");
+
+		if (total == 0)
+			break;
+	}
+}
+
+int main()
+{
+	bench::init();
+
+	event_base* ev = event_base_new();
+	opc_ua::AddressSpace as;
+	std::unique_ptr<opc_ua::tcp::Server> server_ptr(new opc_ua::tcp::Server(ev, as));
+	opc_ua::tcp::Server& server = *server_ptr;
+
+	for (size_t chunk_size : {8192, 65536})
+	{
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+			throw std::runtime_error("socketpair() failed");
+		evutil_make_socket_nonblocking(fds[0]);
+		evutil_make_socket_nonblocking(fds[1]);
+
+		// (the stream takes ownership of fds[0])
+		opc_ua::tcp::ServerTransportStream ts(server, ev, fds[0]);
+		ts.remote_limits.receive_buffer_size = chunk_size;
+		opc_ua::tcp::ServerMessageStream ms(server, ts);
+
+		for (size_t n : {1, 100, 10000})
+		{
+			opc_ua::ReadResponse resp;
+
+			resp.results.resize(n);
+			for (auto& r : resp.results)
+			{
+				r.flags = static_cast<opc_ua::Byte>(opc_ua::DataValueFlags::VALUE_SPECIFIED);
+				r.value = opc_ua::Variant(opc_ua::UInt32(42));
+			}
+
+			// includes writing the chunks to a local socket
+			bench::run("write_message(" + std::to_string(n)
+					+ ", chunk " + std::to_string(chunk_size) + ")", 1, [&] () {
+				ms.write_message(resp, 1);
+				drain(ev, fds[1]);
+			});
+		}
+
+		close(fds[1]);
+	}
+
+	server_ptr.reset();
+	event_base_free(ev);
+	return 0;
+}
@@ -46,6 +46,7 @@ struct timer_callback_data
 	event_base* evbase;
 	opc_ua::tcp::SessionStream& session_stream;
 	std::unique_ptr<event, event_deleter> timer_event;
+	opc_ua::tcp::Future<opc_ua::ReadResponse> read_result;
 };
 
 static void set_output_bits(opc_ua::tcp::SessionStream& s, std::bitset<8> bits)
@@ -78,13 +79,22 @@ static std::bitset<8> input_bits;
 static std::bitset<8> output_bits;
 static std::array<uint16_t, 2> analog_values;
 
-static void response_handler(std::unique_ptr<opc_ua::Response> msg, void* data)
+static void response_handler(timer_callback_data* cb_data)
 {
-	timer_callback_data* cb_data = static_cast<timer_callback_data*>(data);
-	opc_ua::ReadResponse* rsp = dynamic_cast<opc_ua::ReadResponse*>(msg.get());
+	opc_ua::ReadResponse* rsp = cb_data->read_result.get();
+	struct timeval timer_delay = {.tv_sec = 2, .tv_usec = 0};
 
 	int i = 0;
 
+	if (!rsp)
+	{
+		std::cerr << color_brown << "Read failed: 0x" << std::hex
+			<< cb_data->read_result.status() << std::dec
+			<< color_reset << std::endl;
+		event_add(cb_data->timer_event.get(), &timer_delay);
+		return;
+	}
+
 	if (!(line_counter++ % 20))
 	{
 		std::cerr << "\n"
@@ -158,7 +168,6 @@ static void response_handler(std::unique_ptr<opc_ua::Response> msg, void* data)
 	if (new_output_bits != output_bits)
 		set_output_bits(cb_data->session_stream, new_output_bits);
 
-	struct timeval timer_delay = {.tv_sec = 2, .tv_usec = 0};
 	event_add(cb_data->timer_event.get(), &timer_delay);
 }
 
@@ -190,7 +199,10 @@ static void timer_handler(int fd, short what, void* data)
 		rvr.nodes_to_read.back().attribute_id = static_cast<opc_ua::UInt32>(opc_ua::AttributeId::VALUE);
 	}
 
-	self.write_message(rvr, response_handler, data);
+	self.write_message(rvr, cb_data->read_result);
+	cb_data->read_result.then([cb_data] (opc_ua::tcp::Future<opc_ua::ReadResponse>&) {
+		response_handler(cb_data);
+	});
 }
 
 void on_started(std::unique_ptr<opc_ua::Response> msg, void* data)
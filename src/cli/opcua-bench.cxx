@@ -0,0 +1,593 @@
+/* OPC UA load generator
+ * (c) 2014 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <opcua/common/object.hxx>
+#include <opcua/common/struct.hxx>
+#include <opcua/common/types.hxx>
+#include <opcua/tcp/streams.hxx>
+
+#include <event2/event.h>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// nodes of virtual-server (and mt101-server)
+std::array<const char*, 10> read_nodes{{"I1", "I2", "I3", "I4", "I5", "I6", "I7", "I8", "AN1", "AN2"}};
+std::array<const char*, 8> write_nodes{{"Q1", "Q2", "Q3", "Q4", "Q5", "Q6", "Q7", "Q8"}};
+
+struct bench_config
+{
+	std::string host;
+	uint16_t port;
+	// connections, and sessions (each with its own secure
+	// channel) per connection
+	unsigned int connections;
+	unsigned int sessions;
+	// nodes read/written by every request
+	unsigned int request_size;
+	// share of write requests, in percent
+	unsigned int write_percent;
+	// requests per second, over all sessions (0 = closed loop)
+	unsigned int rate;
+	// requests outstanding per session in closed loop
+	unsigned int depth;
+	// test length, in seconds
+	unsigned int duration;
+
+	bench_config()
+		: host("127.0.0.1"), port(6001), connections(1), sessions(1),
+		request_size(1), write_percent(0), rate(0), depth(1),
+		duration(10)
+	{
+	}
+};
+
+static uint64_t now_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Log-linear latency histogram in the style of HdrHistogram: values
+// are grouped by their highest set bit, and every such range is split
+// into 64 equal sub-buckets, so the recorded values keep 2 significant
+// digits (< 1.6% error) over the whole 64-bit range with a fixed table.
+class Histogram
+{
+	static constexpr unsigned int sub_bits = 6;
+	static constexpr uint64_t sub_count = 1 << sub_bits;
+
+	std::vector<uint64_t> counts;
+	uint64_t total;
+	uint64_t min_value, max_value;
+	double sum;
+
+	static size_t index(uint64_t v);
+	// highest value falling into the bucket
+	static uint64_t value_at(size_t idx);
+
+public:
+	Histogram();
+
+	void record(uint64_t v);
+	void reset();
+
+	uint64_t count() const;
+	uint64_t min() const;
+	uint64_t max() const;
+	double mean() const;
+	// value that the given percentage of the records do not exceed
+	uint64_t percentile(double p) const;
+};
+
+constexpr unsigned int Histogram::sub_bits;
+constexpr uint64_t Histogram::sub_count;
+
+Histogram::Histogram()
+	: counts((64 - sub_bits + 1) * sub_count)
+{
+	reset();
+}
+
+size_t Histogram::index(uint64_t v)
+{
+	unsigned int shift = 0;
+
+	// (values below 2 * sub_count are stored exactly)
+	if (v >= 2 * sub_count)
+		shift = 63 - __builtin_clzll(v) - sub_bits;
+
+	return shift * sub_count + (v >> shift);
+}
+
+uint64_t Histogram::value_at(size_t idx)
+{
+	unsigned int shift = 0;
+
+	if (idx >= 2 * sub_count)
+		shift = idx / sub_count - 1;
+
+	uint64_t sub = idx - shift * sub_count;
+	return ((sub + 1) << shift) - 1;
+}
+
+void Histogram::record(uint64_t v)
+{
+	++counts[index(v)];
+	++total;
+	sum += v;
+	if (v < min_value)
+		min_value = v;
+	if (v > max_value)
+		max_value = v;
+}
+
+void Histogram::reset()
+{
+	std::fill(counts.begin(), counts.end(), 0);
+	total = 0;
+	min_value = UINT64_MAX;
+	max_value = 0;
+	sum = 0;
+}
+
+uint64_t Histogram::count() const
+{
+	return total;
+}
+
+uint64_t Histogram::min() const
+{
+	return total ? min_value : 0;
+}
+
+uint64_t Histogram::max() const
+{
+	return max_value;
+}
+
+double Histogram::mean() const
+{
+	return total ? sum / total : 0;
+}
+
+uint64_t Histogram::percentile(double p) const
+{
+	uint64_t rank = total * p / 100;
+	uint64_t seen = 0;
+
+	if (rank >= total)
+		return max_value;
+
+	for (size_t i = 0; i < counts.size(); ++i)
+	{
+		seen += counts[i];
+		if (seen > rank)
+			return std::min(value_at(i), max_value);
+	}
+
+	return max_value;
+}
+
+class Bench;
+
+// A session with its own secure channel, keeping requests in flight.
+struct BenchSession
+{
+	Bench& bench;
+	opc_ua::tcp::MessageStream ms;
+	opc_ua::tcp::SessionStream ss;
+
+	// pre-built requests
+	opc_ua::ReadRequest read_request;
+	opc_ua::WriteRequest write_request;
+
+	// per-request context: the time the request was due
+	struct pending
+	{
+		BenchSession* session;
+		uint64_t start;
+	};
+	std::vector<std::unique_ptr<pending>> pending_pool;
+	std::vector<pending*> free_pending;
+
+	bool established;
+	size_t outstanding;
+	unsigned int write_credit;
+
+	BenchSession(Bench& b, opc_ua::tcp::TransportStream& ts, unsigned int id);
+
+	// send a request due at the given time
+	void send(uint64_t start);
+
+	static void on_established(std::unique_ptr<opc_ua::Response> msg, void* data);
+	static void on_response(std::unique_ptr<opc_ua::Response> msg, void* data);
+};
+
+class Bench
+{
+	event_base* ev;
+	const bench_config& config;
+
+	std::vector<std::unique_ptr<opc_ua::tcp::TransportStream>> transports;
+	std::vector<std::unique_ptr<BenchSession>> sessions;
+	size_t established;
+
+	// open loop pacing (armed for the next request due)
+	event* pacer;
+	uint64_t sent;
+	size_t next_session;
+
+	event* reporter;
+	event* stopper;
+
+	uint64_t start_time;
+	uint64_t last_report;
+	uint64_t interval_count;
+
+	static void pace(evutil_socket_t fd, short what, void* data);
+	static void report(evutil_socket_t fd, short what, void* data);
+	static void stop(evutil_socket_t fd, short what, void* data);
+
+	void start();
+	// close the sessions once all requests completed
+	void finish();
+	void print_summary();
+
+public:
+	Histogram latency;
+	uint64_t completed;
+	uint64_t failed;
+	bool running;
+
+	Bench(event_base* ev, const bench_config& conf);
+	~Bench();
+
+	const bench_config& get_config() const
+	{
+		return config;
+	}
+
+	void session_established();
+	void request_completed(BenchSession& s, uint64_t start, bool ok);
+};
+
+BenchSession::BenchSession(Bench& b, opc_ua::tcp::TransportStream& ts, unsigned int id)
+	: bench(b), ms(ts), ss("opcua-bench-" + std::to_string(id)),
+	established(false), outstanding(0), write_credit(0)
+{
+	const bench_config& config = bench.get_config();
+
+	for (unsigned int i = 0; i < config.request_size; ++i)
+	{
+		read_request.nodes_to_read.emplace_back();
+		read_request.nodes_to_read.back().node_id = opc_ua::NodeId(
+				read_nodes[(id + i) % read_nodes.size()], 1);
+		read_request.nodes_to_read.back().attribute_id = static_cast<opc_ua::UInt32>(opc_ua::AttributeId::VALUE);
+
+		write_request.nodes_to_write.emplace_back();
+		write_request.nodes_to_write.back().node_id = opc_ua::NodeId(
+				write_nodes[(id + i) % write_nodes.size()], 1);
+		write_request.nodes_to_write.back().attribute_id = static_cast<opc_ua::UInt32>(opc_ua::AttributeId::VALUE);
+		write_request.nodes_to_write.back().value.flags = static_cast<opc_ua::Byte>(opc_ua::DataValueFlags::VALUE_SPECIFIED);
+		write_request.nodes_to_write.back().value.value = static_cast<opc_ua::Variant>(bool(i & 1));
+	}
+
+	// (the pacing or the depth decides how many requests go out)
+	ss.max_in_flight = 0;
+	// (no reconnects, no need to keep copies of the requests)
+	ss.resend_in_flight = false;
+	ss.attach(ms, "opc.tcp://" + config.host + ":" + std::to_string(config.port),
+			on_established, this);
+}
+
+void BenchSession::send(uint64_t start)
+{
+	pending* p;
+
+	if (free_pending.empty())
+	{
+		pending_pool.emplace_back(new pending{this, start});
+		p = pending_pool.back().get();
+	}
+	else
+	{
+		p = free_pending.back();
+		free_pending.pop_back();
+		p->start = start;
+	}
+
+	// spread the writes evenly
+	write_credit += bench.get_config().write_percent;
+
+	++outstanding;
+	if (write_credit >= 100)
+	{
+		write_credit -= 100;
+		ss.write_message(write_request, on_response, p);
+	}
+	else
+		ss.write_message(read_request, on_response, p);
+}
+
+void BenchSession::on_established(std::unique_ptr<opc_ua::Response> msg, void* data)
+{
+	BenchSession* self = static_cast<BenchSession*>(data);
+
+	self->established = true;
+	self->bench.session_established();
+}
+
+void BenchSession::on_response(std::unique_ptr<opc_ua::Response> msg, void* data)
+{
+	pending* p = static_cast<pending*>(data);
+	BenchSession* self = p->session;
+	uint64_t start = p->start;
+	bool ok = msg->response_header.service_result == opc_ua::status::Good
+		&& msg->get_node_id() != opc_ua::UInt32(opc_ua::ServiceFault::NODE_ID);
+
+	self->free_pending.push_back(p);
+	--self->outstanding;
+	self->bench.request_completed(*self, start, ok);
+}
+
+Bench::Bench(event_base* new_ev, const bench_config& conf)
+	: ev(new_ev), config(conf), established(0),
+	sent(0), next_session(0), start_time(0), last_report(0),
+	interval_count(0), completed(0), failed(0), running(false)
+{
+	pacer = evtimer_new(ev, pace, this);
+	reporter = event_new(ev, -1, EV_PERSIST, report, this);
+	stopper = evtimer_new(ev, stop, this);
+	if (!pacer || !reporter || !stopper)
+		throw std::runtime_error("Unable to create timers");
+
+	for (unsigned int c = 0; c < config.connections; ++c)
+	{
+		transports.emplace_back(new opc_ua::tcp::TransportStream(ev));
+
+		for (unsigned int i = 0; i < config.sessions; ++i)
+			sessions.emplace_back(new BenchSession(*this,
+						*transports.back(), sessions.size()));
+
+		transports.back()->connect_hostname(config.host.c_str(), config.port,
+				"opc.tcp://" + config.host + ":" + std::to_string(config.port));
+	}
+}
+
+Bench::~Bench()
+{
+	event_free(pacer);
+	event_free(reporter);
+	event_free(stopper);
+}
+
+void Bench::session_established()
+{
+	if (++established == sessions.size())
+	{
+		std::cerr << established << " sessions established over "
+			<< transports.size() << " connections" << std::endl;
+		start();
+	}
+}
+
+void Bench::start()
+{
+	struct timeval second = {1, 0};
+	struct timeval duration = {static_cast<time_t>(config.duration), 0};
+
+	running = true;
+	start_time = last_report = now_us();
+	event_add(reporter, &second);
+	event_add(stopper, &duration);
+
+	if (config.rate)
+		pace(-1, 0, this);
+	else
+	{
+		for (auto& s : sessions)
+		{
+			for (unsigned int i = 0; i < config.depth; ++i)
+				s->send(now_us());
+		}
+	}
+}
+
+void Bench::pace(evutil_socket_t fd, short what, void* data)
+{
+	Bench* self = static_cast<Bench*>(data);
+	uint64_t now = now_us();
+	// (the first one is due right at the start)
+	uint64_t due = (now - self->start_time) * self->config.rate / 1000000 + 1;
+
+	// latency counts from the time the request was due (so that
+	// a stalled server does not hide its own delays)
+	for (; self->sent < due; ++self->sent)
+	{
+		BenchSession& s = *self->sessions[self->next_session];
+
+		self->next_session = (self->next_session + 1) % self->sessions.size();
+		s.send(self->start_time + self->sent * 1000000 / self->config.rate);
+	}
+
+	// wake up when the next one is due
+	uint64_t next = self->start_time + self->sent * 1000000 / self->config.rate;
+	uint64_t wait = next > now ? next - now : 0;
+	struct timeval tv = {static_cast<time_t>(wait / 1000000),
+		static_cast<suseconds_t>(wait % 1000000)};
+	event_add(self->pacer, &tv);
+}
+
+void Bench::request_completed(BenchSession& s, uint64_t start, bool ok)
+{
+	latency.record(now_us() - start);
+	++completed;
+	++interval_count;
+	if (!ok)
+		++failed;
+
+	if (!running)
+		finish();
+	// closed loop: replace the request
+	else if (!config.rate)
+		s.send(now_us());
+}
+
+void Bench::report(evutil_socket_t fd, short what, void* data)
+{
+	Bench* self = static_cast<Bench*>(data);
+	uint64_t now = now_us();
+
+	std::cerr << std::fixed << std::setprecision(0)
+		<< std::setw(4) << (now - self->start_time + 500000) / 1000000 << " s: "
+		<< std::setw(8) << self->interval_count * 1e6 / (now - self->last_report)
+		<< " req/s, p99 " << self->latency.percentile(99) << " us" << std::endl;
+
+	self->interval_count = 0;
+	self->last_report = now;
+}
+
+void Bench::stop(evutil_socket_t fd, short what, void* data)
+{
+	Bench* self = static_cast<Bench*>(data);
+
+	self->running = false;
+	event_del(self->pacer);
+	event_del(self->reporter);
+	self->finish();
+}
+
+void Bench::finish()
+{
+	// wait for the requests sent during the test (they count too)
+	for (auto& s : sessions)
+	{
+		if (s->outstanding)
+			return;
+	}
+
+	print_summary();
+
+	for (auto& s : sessions)
+		s->ms.close();
+
+	// let the close requests go out
+	struct timeval delay = {0, 100000};
+	event_base_loopexit(ev, &delay);
+}
+
+void Bench::print_summary()
+{
+	// (up to the last response, so an overloaded server is not
+	// credited with the offered rate)
+	double elapsed = (now_us() - start_time) / 1e6;
+
+	std::cout << std::fixed << std::setprecision(1)
+		<< "requests:   " << completed << " in " << elapsed << " s ("
+		<< failed << " failed)\n"
+		<< "throughput: " << completed / elapsed << " req/s\n"
+		<< "latency (us):\n"
+		<< "  min    " << latency.min() << "\n"
+		<< "  mean   " << latency.mean() << "\n"
+		<< "  p50    " << latency.percentile(50) << "\n"
+		<< "  p90    " << latency.percentile(90) << "\n"
+		<< "  p99    " << latency.percentile(99) << "\n"
+		<< "  p99.9  " << latency.percentile(99.9) << "\n"
+		<< "  max    " << latency.max() << std::endl;
+}
+
+static void usage(const char* prog)
+{
+	std::cerr << "Usage: " << prog << " [options]\n"
+		"  -H HOST  server host (127.0.0.1)\n"
+		"  -p PORT  server port (6001)\n"
+		"  -c N     connections (1)\n"
+		"  -s M     sessions per connection (1)\n"
+		"  -n K     nodes per request (1)\n"
+		"  -w PCT   write requests, in percent (0)\n"
+		"  -r RATE  requests per second in total (0 = closed loop)\n"
+		"  -q D     requests in flight per session in closed loop (1)\n"
+		"  -d SECS  test duration (10)\n";
+}
+
+static unsigned int parse_number(const char* arg, unsigned int min, unsigned int max)
+{
+	char* end;
+	unsigned long v = strtoul(arg, &end, 10);
+
+	if (!*arg || *end || v < min || v > max)
+		throw std::runtime_error(std::string("Invalid number: ") + arg);
+	return v;
+}
+
+int main(int argc, char* argv[])
+{
+	bench_config config;
+	int opt;
+
+	try
+	{
+		while ((opt = getopt(argc, argv, "H:p:c:s:n:w:r:q:d:h")) != -1)
+		{
+			switch (opt)
+			{
+				case 'H': config.host = optarg; break;
+				case 'p': config.port = parse_number(optarg, 1, 65535); break;
+				case 'c': config.connections = parse_number(optarg, 1, 100000); break;
+				case 's': config.sessions = parse_number(optarg, 1, 1000); break;
+				case 'n': config.request_size = parse_number(optarg, 1, 100000); break;
+				case 'w': config.write_percent = parse_number(optarg, 0, 100); break;
+				case 'r': config.rate = parse_number(optarg, 0, 100000000); break;
+				case 'q': config.depth = parse_number(optarg, 1, 100000); break;
+				case 'd': config.duration = parse_number(optarg, 1, 86400); break;
+				default:
+					usage(argv[0]);
+					return 1;
+			}
+		}
+	}
+	catch (std::runtime_error& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	// set libevent up (the default coarse clock would make the pacing
+	// and latency measurements jitter by several ms)
+	event_config* evcfg = event_config_new();
+	assert(evcfg);
+	event_config_set_flag(evcfg, EVENT_BASE_FLAG_PRECISE_TIMER);
+	event_base* ev = event_base_new_with_config(evcfg);
+	event_config_free(evcfg);
+	assert(ev);
+
+	{
+		Bench b(ev, config);
+
+		// main loop
+		event_base_loop(ev, 0);
+	}
+
+	// cleanup
+	event_base_free(ev);
+	return 0;
+}
@@ -0,0 +1,202 @@
+/* OPC UA protocol implementation
+ * (c) 2014 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "random.hxx"
+
+#ifdef HAVE_GETRANDOM
+#	include <sys/random.h>
+#	include <cerrno>
+#else
+#	include <random>
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+static inline uint32_t rotl(uint32_t x, int n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+static inline void quarter_round(uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d)
+{
+	a += b; d ^= a; d = rotl(d, 16);
+	c += d; b ^= c; b = rotl(b, 12);
+	a += b; d ^= a; d = rotl(d, 8);
+	c += d; b ^= c; b = rotl(b, 7);
+}
+
+void opc_ua::chacha20_block(const uint32_t key[8], uint32_t counter,
+		const uint32_t nonce[3], unsigned char out[64])
+{
+	uint32_t in[16] = {
+		// "expand 32-byte k"
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+		key[0], key[1], key[2], key[3],
+		key[4], key[5], key[6], key[7],
+		counter, nonce[0], nonce[1], nonce[2],
+	};
+	uint32_t x[16];
+
+	std::copy(in, in + 16, x);
+	for (int i = 0; i < 10; ++i)
+	{
+		// column round
+		quarter_round(x[0], x[4], x[8], x[12]);
+		quarter_round(x[1], x[5], x[9], x[13]);
+		quarter_round(x[2], x[6], x[10], x[14]);
+		quarter_round(x[3], x[7], x[11], x[15]);
+		// diagonal round
+		quarter_round(x[0], x[5], x[10], x[15]);
+		quarter_round(x[1], x[6], x[11], x[12]);
+		quarter_round(x[2], x[7], x[8], x[13]);
+		quarter_round(x[3], x[4], x[9], x[14]);
+	}
+
+	for (int i = 0; i < 16; ++i)
+	{
+		uint32_t v = x[i] + in[i];
+
+		for (int j = 0; j < 4; ++j)
+			out[4 * i + j] = v >> (8 * j);
+	}
+}
+
+namespace
+{
+	// ChaCha20 keystream generator with fast key erasure: every
+	// refill produces a buffer of blocks, the first of which becomes
+	// the key & nonce for the next refill and is never handed out.
+	class ChaCha20Generator
+	{
+		static constexpr size_t buffer_blocks = 16;
+		// output produced between reseeds
+		static constexpr size_t reseed_interval = 0x100000;
+
+		uint32_t key[8];
+		uint32_t nonce[3];
+
+		unsigned char buf[64 * buffer_blocks];
+		size_t pos;
+		size_t until_reseed;
+
+		void refill();
+		// mix fresh system entropy into the key
+		void reseed();
+
+	public:
+		ChaCha20Generator();
+		~ChaCha20Generator();
+
+		void generate(void* out, size_t length);
+	};
+
+	constexpr size_t ChaCha20Generator::buffer_blocks;
+	constexpr size_t ChaCha20Generator::reseed_interval;
+};
+
+static void system_entropy(void* out, size_t length)
+{
+#ifdef HAVE_GETRANDOM
+	unsigned char* p = static_cast<unsigned char*>(out);
+
+	while (length > 0)
+	{
+		ssize_t rd = getrandom(p, length, 0);
+
+		if (rd == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("Unable to obtain system entropy");
+		}
+
+		p += rd;
+		length -= rd;
+	}
+#else
+	std::random_device rnd;
+	unsigned char* p = static_cast<unsigned char*>(out);
+
+	for (size_t i = 0; i < length; ++i)
+		p[i] = rnd();
+#endif
+}
+
+ChaCha20Generator::ChaCha20Generator()
+	: key(), nonce(), pos(sizeof(buf)), until_reseed(0)
+{
+}
+
+ChaCha20Generator::~ChaCha20Generator()
+{
+	// do not leave the state in the freed memory
+	volatile unsigned char* p = reinterpret_cast<unsigned char*>(this);
+	for (size_t i = 0; i < sizeof(*this); ++i)
+		p[i] = 0;
+}
+
+void ChaCha20Generator::reseed()
+{
+	uint32_t fresh[11];
+
+	system_entropy(fresh, sizeof(fresh));
+	for (int i = 0; i < 8; ++i)
+		key[i] ^= fresh[i];
+	for (int i = 0; i < 3; ++i)
+		nonce[i] ^= fresh[8 + i];
+
+	until_reseed = reseed_interval;
+}
+
+void ChaCha20Generator::refill()
+{
+	for (size_t i = 0; i < buffer_blocks; ++i)
+		opc_ua::chacha20_block(key, i, nonce, buf + 64 * i);
+
+	// rekey from the first block, then wipe it
+	std::memcpy(key, buf, sizeof(key));
+	std::memcpy(nonce, buf + sizeof(key), sizeof(nonce));
+	std::memset(buf, 0, 64);
+	pos = 64;
+}
+
+void ChaCha20Generator::generate(void* out, size_t length)
+{
+	unsigned char* p = static_cast<unsigned char*>(out);
+
+	while (length > 0)
+	{
+		if (pos == sizeof(buf))
+		{
+			if (until_reseed == 0)
+				reseed();
+			refill();
+		}
+
+		size_t part = std::min(length, sizeof(buf) - pos);
+
+		std::memcpy(p, buf + pos, part);
+		// the output must not stay in the buffer either
+		std::memset(buf + pos, 0, part);
+		pos += part;
+		p += part;
+		length -= part;
+		until_reseed -= std::min(until_reseed, part);
+	}
+}
+
+void opc_ua::random_bytes(void* out, size_t length)
+{
+	// one per thread, so that the reactors do not contend
+	static thread_local ChaCha20Generator gen;
+
+	gen.generate(out, length);
+}
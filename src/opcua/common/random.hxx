@@ -0,0 +1,30 @@
+/* OPC UA protocol implementation
+ * (c) 2014 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef OPCUA_COMMON_RANDOM_HXX
+#define OPCUA_COMMON_RANDOM_HXX 1
+
+#include <cstddef>
+#include <cstdint>
+
+namespace opc_ua
+{
+	// Fill the buffer with cryptographically secure random bytes.
+	// They are taken from a ChaCha20 keystream of a generator private
+	// to the calling thread, so no system call or lock is needed in
+	// the common case. The generator is seeded from the system entropy
+	// source (getrandom()), rekeyed from its own output after every
+	// buffer-full (so that past output can not be recovered from its
+	// state) and mixed with fresh entropy every megabyte.
+	void random_bytes(void* out, size_t length);
+
+	// ChaCha20 block function (RFC 7539), exposed for testing
+	void chacha20_block(const uint32_t key[8], uint32_t counter,
+			const uint32_t nonce[3], unsigned char out[64]);
+};
+
+#endif /*OPCUA_COMMON_RANDOM_HXX*/
@@ -0,0 +1,166 @@
+/* OPC UA protocol implementation
+ * (c) 2014 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef OPCUA_COMMON_SLAB_HXX
+#define OPCUA_COMMON_SLAB_HXX 1
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace opc_ua
+{
+	// Container of objects constructed in place, in fixed-size blocks
+	// of slots. An object is identified by its slot number, which stays
+	// valid (as does its address) until it is erased. Insertion and
+	// removal are O(1): freed slots are kept in a free list and reused
+	// most-recent first; blocks are never released.
+	template <class T, size_t BlockSize = 64>
+	class Slab
+	{
+		struct Slot
+		{
+			typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+			bool used;
+		};
+
+		std::vector<std::unique_ptr<Slot[]>> blocks;
+		std::vector<size_t> free_ids;
+		size_t count;
+
+		Slot& slot(size_t id);
+		const Slot& slot(size_t id) const;
+
+	public:
+		Slab();
+		~Slab();
+
+		Slab(const Slab&) = delete;
+		Slab& operator=(const Slab&) = delete;
+
+		// construct a new object, return its id
+		template <class... Args>
+		size_t emplace(Args&&... args);
+		// destroy the object
+		void erase(size_t id);
+		void clear();
+
+		bool contains(size_t id) const;
+		T& operator[](size_t id);
+
+		// number of objects
+		size_t size() const;
+		// call f(id, object) for every object, in id order
+		// (the objects must not be added or removed meanwhile)
+		template <class F>
+		void for_each(F f);
+	};
+
+	template <class T, size_t BlockSize>
+	typename Slab<T, BlockSize>::Slot& Slab<T, BlockSize>::slot(size_t id)
+	{
+		return blocks[id / BlockSize][id % BlockSize];
+	}
+
+	template <class T, size_t BlockSize>
+	const typename Slab<T, BlockSize>::Slot& Slab<T, BlockSize>::slot(size_t id) const
+	{
+		return blocks[id / BlockSize][id % BlockSize];
+	}
+
+	template <class T, size_t BlockSize>
+	Slab<T, BlockSize>::Slab()
+		: count(0)
+	{
+	}
+
+	template <class T, size_t BlockSize>
+	Slab<T, BlockSize>::~Slab()
+	{
+		clear();
+	}
+
+	template <class T, size_t BlockSize>
+	template <class... Args>
+	size_t Slab<T, BlockSize>::emplace(Args&&... args)
+	{
+		if (free_ids.empty())
+		{
+			size_t first = blocks.size() * BlockSize;
+
+			// (value-initialized, i.e. all unused)
+			blocks.emplace_back(new Slot[BlockSize]());
+			// the lowest ids go first
+			for (size_t i = BlockSize; i > 0; --i)
+				free_ids.push_back(first + i - 1);
+		}
+
+		size_t id = free_ids.back();
+		Slot& s = slot(id);
+
+		new (&s.storage) T(std::forward<Args>(args)...);
+		s.used = true;
+		free_ids.pop_back();
+		++count;
+		return id;
+	}
+
+	template <class T, size_t BlockSize>
+	void Slab<T, BlockSize>::erase(size_t id)
+	{
+		Slot& s = slot(id);
+
+		reinterpret_cast<T*>(&s.storage)->~T();
+		s.used = false;
+		free_ids.push_back(id);
+		--count;
+	}
+
+	template <class T, size_t BlockSize>
+	void Slab<T, BlockSize>::clear()
+	{
+		for (size_t id = 0; count > 0 && id < blocks.size() * BlockSize; ++id)
+		{
+			if (slot(id).used)
+				erase(id);
+		}
+	}
+
+	template <class T, size_t BlockSize>
+	bool Slab<T, BlockSize>::contains(size_t id) const
+	{
+		return id < blocks.size() * BlockSize && slot(id).used;
+	}
+
+	template <class T, size_t BlockSize>
+	T& Slab<T, BlockSize>::operator[](size_t id)
+	{
+		return *reinterpret_cast<T*>(&slot(id).storage);
+	}
+
+	template <class T, size_t BlockSize>
+	size_t Slab<T, BlockSize>::size() const
+	{
+		return count;
+	}
+
+	template <class T, size_t BlockSize>
+	template <class F>
+	void Slab<T, BlockSize>::for_each(F f)
+	{
+		for (size_t id = 0; id < blocks.size() * BlockSize; ++id)
+		{
+			if (slot(id).used)
+				f(id, (*this)[id]);
+		}
+	}
+};
+
+#endif /*OPCUA_COMMON_SLAB_HXX*/
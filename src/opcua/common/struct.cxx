@@ -47,6 +47,7 @@ const opc_ua::StructConstructorMap opc_ua::struct_constructors{
 	M<RelativePathElement>(),
 	M<RequestHeader>(),
 	M<ResponseHeader>(),
+	M<ServiceFault>(),
 	M<SignatureData>(),
 	M<SignedSoftwareCertificate>(),
 	M<TranslateBrowsePathsToNodeIdsRequest>(),
@@ -66,24 +67,12 @@ opc_ua::RequestHeader::RequestHeader()
 
 void opc_ua::RequestHeader::serialize(WritableSerializationBuffer& ctx, Serializer& s) const
 {
-	s.serialize(ctx, authentication_token);
-	s.serialize(ctx, timestamp);
-	s.serialize(ctx, request_handle);
-	s.serialize(ctx, return_diagnostics);
-	s.serialize(ctx, audit_entry_id);
-	s.serialize(ctx, timeout_hint);
-	s.serialize(ctx, additional_header);
+	serialize_fields(ctx, s);
 }
 
 void opc_ua::RequestHeader::unserialize(ReadableSerializationBuffer& ctx, Serializer& s)
 {
-	s.unserialize(ctx, authentication_token);
-	s.unserialize(ctx, timestamp);
-	s.unserialize(ctx, request_handle);
-	s.unserialize(ctx, return_diagnostics);
-	s.unserialize(ctx, audit_entry_id);
-	s.unserialize(ctx, timeout_hint);
-	s.unserialize(ctx, additional_header);
+	unserialize_fields(ctx, s);
 }
 
 opc_ua::DiagnosticInfo::DiagnosticInfo()
@@ -93,12 +82,12 @@ opc_ua::DiagnosticInfo::DiagnosticInfo()
 
 void opc_ua::DiagnosticInfo::serialize(WritableSerializationBuffer& ctx, Serializer& s) const
 {
-	s.serialize(ctx, flags);
+	serialize_fields(ctx, s);
 }
 
 void opc_ua::DiagnosticInfo::unserialize(ReadableSerializationBuffer& ctx, Serializer& s)
 {
-	s.unserialize(ctx, flags);
+	unserialize_fields(ctx, s);
 }
 
 opc_ua::ResponseHeader::ResponseHeader()
@@ -109,22 +98,26 @@ opc_ua::ResponseHeader::ResponseHeader()
 
 void opc_ua::ResponseHeader::serialize(WritableSerializationBuffer& ctx, Serializer& s) const
 {
-	s.serialize(ctx, timestamp);
-	s.serialize(ctx, request_handle);
-	s.serialize(ctx, service_result);
-	s.serialize(ctx, service_diagnostics);
-	s.serialize(ctx, ArraySerialization<String>(string_table));
-	s.serialize(ctx, additional_header);
+	serialize_fields(ctx, s);
 }
 
 void opc_ua::ResponseHeader::unserialize(ReadableSerializationBuffer& ctx, Serializer& s)
 {
-	s.unserialize(ctx, timestamp);
-	s.unserialize(ctx, request_handle);
-	s.unserialize(ctx, service_result);
-	s.unserialize(ctx, service_diagnostics);
-	s.unserialize(ctx, ArrayUnserialization<String>(string_table));
-	s.unserialize(ctx, additional_header);
+	unserialize_fields(ctx, s);
+}
+
+opc_ua::ServiceFault::ServiceFault()
+{
+}
+
+void opc_ua::ServiceFault::serialize(WritableSerializationBuffer& ctx, Serializer& s) const
+{
+	s.serialize(ctx, response_header);
+}
+
+void opc_ua::ServiceFault::unserialize(ReadableSerializationBuffer& ctx, Serializer& s)
+{
+	s.unserialize(ctx, response_header);
 }
 
 opc_ua::OpenSecureChannelRequest::OpenSecureChannelRequest(SecurityTokenRequestType req_type, MessageSecurityMode req_mode, ByteString req_nonce, UInt32 req_lifetime)
@@ -521,14 +514,12 @@ opc_ua::QualifiedName::QualifiedName(CharArray new_name, UInt16 ns_index)
 
 void opc_ua::QualifiedName::serialize(WritableSerializationBuffer& ctx, Serializer& s) const
 {
-	s.serialize(ctx, namespace_index);
-	s.serialize(ctx, name);
+	serialize_fields(ctx, s);
 }
 
 void opc_ua::QualifiedName::unserialize(ReadableSerializationBuffer& ctx, Serializer& s)
 {
-	s.unserialize(ctx, namespace_index);
-	s.unserialize(ctx, name);
+	unserialize_fields(ctx, s);
 }
 
 opc_ua::RelativePathElement::RelativePathElement(NodeId ref_type, Boolean is_inv, Boolean inc_subtypes, QualifiedName target)
@@ -608,18 +599,12 @@ opc_ua::ReadValueId::ReadValueId()
 
 void opc_ua::ReadValueId::serialize(WritableSerializationBuffer& ctx, Serializer& s) const
 {
-	s.serialize(ctx, node_id);
-	s.serialize(ctx, attribute_id);
-	s.serialize(ctx, index_range);
-	s.serialize(ctx, data_encoding);
+	serialize_fields(ctx, s);
 }
 
 void opc_ua::ReadValueId::unserialize(ReadableSerializationBuffer& ctx, Serializer& s)
 {
-	s.unserialize(ctx, node_id);
-	s.unserialize(ctx, attribute_id);
-	s.unserialize(ctx, index_range);
-	s.unserialize(ctx, data_encoding);
+	unserialize_fields(ctx, s);
 }
 
 opc_ua::ReadRequest::ReadRequest()
@@ -629,22 +614,12 @@ opc_ua::ReadRequest::ReadRequest()
 
 void opc_ua::ReadRequest::serialize(WritableSerializationBuffer& ctx, Serializer& s) const
 {
-	s.serialize(ctx, request_header);
-	s.serialize(ctx, max_age);
-	s.serialize(ctx, static_cast<UInt32>(timestamps_to_return));
-	s.serialize(ctx, ArraySerialization<ReadValueId>(nodes_to_read));
+	serialize_fields(ctx, s);
 }
 
 void opc_ua::ReadRequest::unserialize(ReadableSerializationBuffer& ctx, Serializer& s)
 {
-	UInt32 timestamps_to_return_i;
-
-	s.unserialize(ctx, request_header);
-	s.unserialize(ctx, max_age);
-	s.unserialize(ctx, timestamps_to_return_i);
-	s.unserialize(ctx, ArrayUnserialization<ReadValueId>(nodes_to_read));
-
-	timestamps_to_return = static_cast<TimestampsToReturn>(timestamps_to_return_i);
+	unserialize_fields(ctx, s);
 }
 
 opc_ua::DataValue::DataValue()
@@ -654,36 +629,12 @@ opc_ua::DataValue::DataValue()
 
 void opc_ua::DataValue::serialize(WritableSerializationBuffer& ctx, Serializer& s) const
 {
-	s.serialize(ctx, flags);
-	if (flags & static_cast<Byte>(DataValueFlags::VALUE_SPECIFIED))
-		s.serialize(ctx, value);
-	if (flags & static_cast<Byte>(DataValueFlags::STATUS_CODE_SPECIFIED))
-		s.serialize(ctx, status_code);
-	if (flags & static_cast<Byte>(DataValueFlags::SOURCE_TIMESTAMP_SPECIFIED))
-		s.serialize(ctx, source_timestamp);
-	if (flags & static_cast<Byte>(DataValueFlags::SOURCE_PICOSECONDS_SPECIFIED))
-		s.serialize(ctx, source_picoseconds);
-	if (flags & static_cast<Byte>(DataValueFlags::SERVER_TIMESTAMP_SPECIFIED))
-		s.serialize(ctx, server_timestamp);
-	if (flags & static_cast<Byte>(DataValueFlags::SERVER_PICOSECONDS_SPECIFIED))
-		s.serialize(ctx, server_picoseconds);
+	serialize_fields(ctx, s);
 }
 
 void opc_ua::DataValue::unserialize(ReadableSerializationBuffer& ctx, Serializer& s)
 {
-	s.unserialize(ctx, flags);
-	if (flags & static_cast<Byte>(DataValueFlags::VALUE_SPECIFIED))
-		s.unserialize(ctx, value);
-	if (flags & static_cast<Byte>(DataValueFlags::STATUS_CODE_SPECIFIED))
-		s.unserialize(ctx, status_code);
-	if (flags & static_cast<Byte>(DataValueFlags::SOURCE_TIMESTAMP_SPECIFIED))
-		s.unserialize(ctx, source_timestamp);
-	if (flags & static_cast<Byte>(DataValueFlags::SOURCE_PICOSECONDS_SPECIFIED))
-		s.unserialize(ctx, source_picoseconds);
-	if (flags & static_cast<Byte>(DataValueFlags::SERVER_TIMESTAMP_SPECIFIED))
-		s.unserialize(ctx, server_timestamp);
-	if (flags & static_cast<Byte>(DataValueFlags::SERVER_PICOSECONDS_SPECIFIED))
-		s.unserialize(ctx, server_picoseconds);
+	unserialize_fields(ctx, s);
 }
 
 opc_ua::ReadResponse::ReadResponse()
@@ -693,16 +644,12 @@ opc_ua::ReadResponse::ReadResponse()
 
 void opc_ua::ReadResponse::serialize(WritableSerializationBuffer& ctx, Serializer& s) const
 {
-	s.serialize(ctx, response_header);
-	s.serialize(ctx, ArraySerialization<DataValue>(results));
-	s.serialize(ctx, ArraySerialization<DiagnosticInfo>(diagnostic_infos));
+	serialize_fields(ctx, s);
 }
 
 void opc_ua::ReadResponse::unserialize(ReadableSerializationBuffer& ctx, Serializer& s)
 {
-	s.unserialize(ctx, response_header);
-	s.unserialize(ctx, ArrayUnserialization<DataValue>(results));
-	s.unserialize(ctx, ArrayUnserialization<DiagnosticInfo>(diagnostic_infos));
+	unserialize_fields(ctx, s);
 }
 
 opc_ua::UserIdentityToken::UserIdentityToken(String new_policy_id)
@@ -732,18 +679,12 @@ opc_ua::WriteValue::WriteValue()
 
 void opc_ua::WriteValue::serialize(WritableSerializationBuffer& ctx, Serializer& s) const
 {
-	s.serialize(ctx, node_id);
-	s.serialize(ctx, attribute_id);
-	s.serialize(ctx, index_range);
-	s.serialize(ctx, value);
+	serialize_fields(ctx, s);
 }
 
 void opc_ua::WriteValue::unserialize(ReadableSerializationBuffer& ctx, Serializer& s)
 {
-	s.unserialize(ctx, node_id);
-	s.unserialize(ctx, attribute_id);
-	s.unserialize(ctx, index_range);
-	s.unserialize(ctx, value);
+	unserialize_fields(ctx, s);
 }
 
 opc_ua::WriteRequest::WriteRequest()
@@ -753,14 +694,12 @@ opc_ua::WriteRequest::WriteRequest()
 
 void opc_ua::WriteRequest::serialize(WritableSerializationBuffer& ctx, Serializer& s) const
 {
-	s.serialize(ctx, request_header);
-	s.serialize(ctx, ArraySerialization<WriteValue>(nodes_to_write));
+	serialize_fields(ctx, s);
 }
 
 void opc_ua::WriteRequest::unserialize(ReadableSerializationBuffer& ctx, Serializer& s)
 {
-	s.unserialize(ctx, request_header);
-	s.unserialize(ctx, ArrayUnserialization<WriteValue>(nodes_to_write));
+	unserialize_fields(ctx, s);
 }
 
 opc_ua::WriteResponse::WriteResponse()
@@ -770,14 +709,10 @@ opc_ua::WriteResponse::WriteResponse()
 
 void opc_ua::WriteResponse::serialize(WritableSerializationBuffer& ctx, Serializer& s) const
 {
-	s.serialize(ctx, response_header);
-	s.serialize(ctx, ArraySerialization<StatusCode>(results));
-	s.serialize(ctx, ArraySerialization<DiagnosticInfo>(diagnostic_infos));
+	serialize_fields(ctx, s);
 }
 
 void opc_ua::WriteResponse::unserialize(ReadableSerializationBuffer& ctx, Serializer& s)
 {
-	s.unserialize(ctx, response_header);
-	s.unserialize(ctx, ArrayUnserialization<StatusCode>(results));
-	s.unserialize(ctx, ArrayUnserialization<DiagnosticInfo>(diagnostic_infos));
+	unserialize_fields(ctx, s);
 }
@@ -38,16 +38,48 @@ namespace opc_ua
 		virtual void serialize(WritableSerializationBuffer& ctx, Serializer& s) const;
 		virtual void unserialize(ReadableSerializationBuffer& ctx, Serializer& s);
 		virtual UInt32 get_node_id() const { return NODE_ID; }
+
+		// field lists for static dispatch
+		template <class S>
+		void serialize_fields(WritableSerializationBuffer& ctx, S& s) const;
+		template <class S>
+		void unserialize_fields(ReadableSerializationBuffer& ctx, S& s);
 	};
 
+	// Requests name the response type they get answered with
+	// as response_type.
 	struct Request : Message
 	{
 		RequestHeader request_header;
 	};
 
+	struct OpenSecureChannelResponse;
+	struct CloseSecureChannelResponse;
+	struct CreateSessionResponse;
+	struct ActivateSessionResponse;
+	struct CloseSessionResponse;
+	struct ReadResponse;
+	struct WriteResponse;
+
 	// opaque 32-bit status code
 	typedef UInt32 StatusCode;
 
+	// status codes used by the implementation
+	namespace status
+	{
+		constexpr StatusCode Good = 0;
+		constexpr StatusCode Bad_CommunicationError = 0x80050000;
+		constexpr StatusCode Bad_EncodingError = 0x80060000;
+		constexpr StatusCode Bad_UnknownResponse = 0x80090000;
+		constexpr StatusCode Bad_Timeout = 0x800A0000;
+		constexpr StatusCode Bad_SessionIdInvalid = 0x80250000;
+		constexpr StatusCode Bad_NodeIdUnknown = 0x80340000;
+		constexpr StatusCode Bad_AttributeIdInvalid = 0x80350000;
+		constexpr StatusCode Bad_ResponseTooLarge = 0x80B90000;
+		constexpr StatusCode Bad_TcpMessageTooLarge = 0x80800000;
+		constexpr StatusCode Bad_TcpInternalError = 0x80820000;
+	};
+
 	struct DiagnosticInfo : Struct
 	{
 		static constexpr UInt32 NODE_ID = 25;
@@ -62,6 +94,12 @@ namespace opc_ua
 		virtual void serialize(WritableSerializationBuffer& ctx, Serializer& s) const;
 		virtual void unserialize(ReadableSerializationBuffer& ctx, Serializer& s);
 		virtual UInt32 get_node_id() const { return NODE_ID; }
+
+		// field lists for static dispatch
+		template <class S>
+		void serialize_fields(WritableSerializationBuffer& ctx, S& s) const;
+		template <class S>
+		void unserialize_fields(ReadableSerializationBuffer& ctx, S& s);
 	};
 
 	struct ResponseHeader : Struct
@@ -81,6 +119,12 @@ namespace opc_ua
 		virtual void serialize(WritableSerializationBuffer& ctx, Serializer& s) const;
 		virtual void unserialize(ReadableSerializationBuffer& ctx, Serializer& s);
 		virtual UInt32 get_node_id() const { return NODE_ID; }
+
+		// field lists for static dispatch
+		template <class S>
+		void serialize_fields(WritableSerializationBuffer& ctx, S& s) const;
+		template <class S>
+		void unserialize_fields(ReadableSerializationBuffer& ctx, S& s);
 	};
 
 	struct Response : Message
@@ -88,6 +132,19 @@ namespace opc_ua
 		ResponseHeader response_header;
 	};
 
+	// generic response to a failed request (status in the header)
+	struct ServiceFault : Response
+	{
+		static constexpr UInt32 NODE_ID = 395;
+
+		ServiceFault();
+
+		// metadata
+		virtual void serialize(WritableSerializationBuffer& ctx, Serializer& s) const;
+		virtual void unserialize(ReadableSerializationBuffer& ctx, Serializer& s);
+		virtual UInt32 get_node_id() const { return NODE_ID; }
+	};
+
 	enum class SecurityTokenRequestType
 	{
 		ISSUE = 0,
@@ -105,6 +162,7 @@ namespace opc_ua
 	struct OpenSecureChannelRequest : Request
 	{
 		static constexpr UInt32 NODE_ID = 444;
+		typedef OpenSecureChannelResponse response_type;
 
 		UInt32 client_protocol_version;
 		SecurityTokenRequestType request_type;
@@ -155,6 +213,7 @@ namespace opc_ua
 	struct CloseSecureChannelRequest : Request
 	{
 		static constexpr UInt32 NODE_ID = 450;
+		typedef CloseSecureChannelResponse response_type;
 
 		CloseSecureChannelRequest();
 
@@ -207,6 +266,7 @@ namespace opc_ua
 	struct CreateSessionRequest : Request
 	{
 		static constexpr UInt32 NODE_ID = 459;
+		typedef CreateSessionResponse response_type;
 
 		ApplicationDescription client_description;
 		String server_uri;
@@ -327,6 +387,7 @@ namespace opc_ua
 	struct ActivateSessionRequest : Request
 	{
 		static constexpr UInt32 NODE_ID = 465;
+		typedef ActivateSessionResponse response_type;
 
 		SignatureData client_signature;
 		Array<SignedSoftwareCertificate> client_software_certificates;
@@ -361,6 +422,7 @@ namespace opc_ua
 	struct CloseSessionRequest : Request
 	{
 		static constexpr UInt32 NODE_ID = 471;
+		typedef CloseSessionResponse response_type;
 
 		Boolean delete_subscriptions;
 
@@ -397,6 +459,12 @@ namespace opc_ua
 		virtual void serialize(WritableSerializationBuffer& ctx, Serializer& s) const;
 		virtual void unserialize(ReadableSerializationBuffer& ctx, Serializer& s);
 		virtual UInt32 get_node_id() const { return NODE_ID; }
+
+		// field lists for static dispatch
+		template <class S>
+		void serialize_fields(WritableSerializationBuffer& ctx, S& s) const;
+		template <class S>
+		void unserialize_fields(ReadableSerializationBuffer& ctx, S& s);
 	};
 
 	struct RelativePathElement : Struct
@@ -482,11 +550,18 @@ namespace opc_ua
 		virtual void serialize(WritableSerializationBuffer& ctx, Serializer& s) const;
 		virtual void unserialize(ReadableSerializationBuffer& ctx, Serializer& s);
 		virtual UInt32 get_node_id() const { return NODE_ID; }
+
+		// field lists for static dispatch
+		template <class S>
+		void serialize_fields(WritableSerializationBuffer& ctx, S& s) const;
+		template <class S>
+		void unserialize_fields(ReadableSerializationBuffer& ctx, S& s);
 	};
 
 	struct ReadRequest : Request
 	{
 		static constexpr UInt32 NODE_ID = 629;
+		typedef ReadResponse response_type;
 
 		Double max_age;
 		TimestampsToReturn timestamps_to_return;
@@ -498,6 +573,12 @@ namespace opc_ua
 		virtual void serialize(WritableSerializationBuffer& ctx, Serializer& s) const;
 		virtual void unserialize(ReadableSerializationBuffer& ctx, Serializer& s);
 		virtual UInt32 get_node_id() const { return NODE_ID; }
+
+		// field lists for static dispatch
+		template <class S>
+		void serialize_fields(WritableSerializationBuffer& ctx, S& s) const;
+		template <class S>
+		void unserialize_fields(ReadableSerializationBuffer& ctx, S& s);
 	};
 
 	enum class DataValueFlags
@@ -528,8 +609,18 @@ namespace opc_ua
 		virtual void serialize(WritableSerializationBuffer& ctx, Serializer& s) const;
 		virtual void unserialize(ReadableSerializationBuffer& ctx, Serializer& s);
 		virtual UInt32 get_node_id() const { return NODE_ID; }
+
+		// field lists for static dispatch
+		template <class S>
+		void serialize_fields(WritableSerializationBuffer& ctx, S& s) const;
+		template <class S>
+		void unserialize_fields(ReadableSerializationBuffer& ctx, S& s);
 	};
 
+	// (result arrays move the values when growing)
+	static_assert(std::is_nothrow_move_constructible<DataValue>::value,
+			"DataValue move must not throw");
+
 	struct ReadResponse : Response
 	{
 		static constexpr UInt32 NODE_ID = 632;
@@ -543,6 +634,12 @@ namespace opc_ua
 		virtual void serialize(WritableSerializationBuffer& ctx, Serializer& s) const;
 		virtual void unserialize(ReadableSerializationBuffer& ctx, Serializer& s);
 		virtual UInt32 get_node_id() const { return NODE_ID; }
+
+		// field lists for static dispatch
+		template <class S>
+		void serialize_fields(WritableSerializationBuffer& ctx, S& s) const;
+		template <class S>
+		void unserialize_fields(ReadableSerializationBuffer& ctx, S& s);
 	};
 
 	struct UserIdentityToken : Struct
@@ -583,11 +680,18 @@ namespace opc_ua
 		virtual void serialize(WritableSerializationBuffer& ctx, Serializer& s) const;
 		virtual void unserialize(ReadableSerializationBuffer& ctx, Serializer& s);
 		virtual UInt32 get_node_id() const { return NODE_ID; }
+
+		// field lists for static dispatch
+		template <class S>
+		void serialize_fields(WritableSerializationBuffer& ctx, S& s) const;
+		template <class S>
+		void unserialize_fields(ReadableSerializationBuffer& ctx, S& s);
 	};
 
 	struct WriteRequest : Request
 	{
 		static constexpr UInt32 NODE_ID = 671;
+		typedef WriteResponse response_type;
 
 		Array<WriteValue> nodes_to_write;
 
@@ -597,6 +701,12 @@ namespace opc_ua
 		virtual void serialize(WritableSerializationBuffer& ctx, Serializer& s) const;
 		virtual void unserialize(ReadableSerializationBuffer& ctx, Serializer& s);
 		virtual UInt32 get_node_id() const { return NODE_ID; }
+
+		// field lists for static dispatch
+		template <class S>
+		void serialize_fields(WritableSerializationBuffer& ctx, S& s) const;
+		template <class S>
+		void unserialize_fields(ReadableSerializationBuffer& ctx, S& s);
 	};
 
 	struct WriteResponse : Response
@@ -612,7 +722,238 @@ namespace opc_ua
 		virtual void serialize(WritableSerializationBuffer& ctx, Serializer& s) const;
 		virtual void unserialize(ReadableSerializationBuffer& ctx, Serializer& s);
 		virtual UInt32 get_node_id() const { return NODE_ID; }
+
+		// field lists for static dispatch
+		template <class S>
+		void serialize_fields(WritableSerializationBuffer& ctx, S& s) const;
+		template <class S>
+		void unserialize_fields(ReadableSerializationBuffer& ctx, S& s);
 	};
+	// field list implementation
+	template <class S>
+	void RequestHeader::serialize_fields(WritableSerializationBuffer& ctx, S& s) const
+	{
+		s.serialize(ctx, authentication_token);
+		s.serialize(ctx, timestamp);
+		s.serialize(ctx, request_handle);
+		s.serialize(ctx, return_diagnostics);
+		s.serialize(ctx, audit_entry_id);
+		s.serialize(ctx, timeout_hint);
+		s.serialize(ctx, additional_header);
+	}
+
+	template <class S>
+	void RequestHeader::unserialize_fields(ReadableSerializationBuffer& ctx, S& s)
+	{
+		s.unserialize(ctx, authentication_token);
+		s.unserialize(ctx, timestamp);
+		s.unserialize(ctx, request_handle);
+		s.unserialize(ctx, return_diagnostics);
+		s.unserialize(ctx, audit_entry_id);
+		s.unserialize(ctx, timeout_hint);
+		s.unserialize(ctx, additional_header);
+	}
+
+	template <class S>
+	void DiagnosticInfo::serialize_fields(WritableSerializationBuffer& ctx, S& s) const
+	{
+		s.serialize(ctx, flags);
+	}
+
+	template <class S>
+	void DiagnosticInfo::unserialize_fields(ReadableSerializationBuffer& ctx, S& s)
+	{
+		s.unserialize(ctx, flags);
+	}
+
+	template <class S>
+	void ResponseHeader::serialize_fields(WritableSerializationBuffer& ctx, S& s) const
+	{
+		s.serialize(ctx, timestamp);
+		s.serialize(ctx, request_handle);
+		s.serialize(ctx, service_result);
+		s.serialize(ctx, service_diagnostics);
+		s.serialize(ctx, ArraySerialization<String>(string_table));
+		s.serialize(ctx, additional_header);
+	}
+
+	template <class S>
+	void ResponseHeader::unserialize_fields(ReadableSerializationBuffer& ctx, S& s)
+	{
+		s.unserialize(ctx, timestamp);
+		s.unserialize(ctx, request_handle);
+		s.unserialize(ctx, service_result);
+		s.unserialize(ctx, service_diagnostics);
+		s.unserialize(ctx, ArrayUnserialization<String>(string_table));
+		s.unserialize(ctx, additional_header);
+	}
+
+	template <class S>
+	void QualifiedName::serialize_fields(WritableSerializationBuffer& ctx, S& s) const
+	{
+		s.serialize(ctx, namespace_index);
+		s.serialize(ctx, name);
+	}
+
+	template <class S>
+	void QualifiedName::unserialize_fields(ReadableSerializationBuffer& ctx, S& s)
+	{
+		s.unserialize(ctx, namespace_index);
+		s.unserialize(ctx, name);
+	}
+
+	template <class S>
+	void ReadValueId::serialize_fields(WritableSerializationBuffer& ctx, S& s) const
+	{
+		s.serialize(ctx, node_id);
+		s.serialize(ctx, attribute_id);
+		s.serialize(ctx, index_range);
+		s.serialize(ctx, data_encoding);
+	}
+
+	template <class S>
+	void ReadValueId::unserialize_fields(ReadableSerializationBuffer& ctx, S& s)
+	{
+		s.unserialize(ctx, node_id);
+		s.unserialize(ctx, attribute_id);
+		s.unserialize(ctx, index_range);
+		s.unserialize(ctx, data_encoding);
+	}
+
+	template <class S>
+	void ReadRequest::serialize_fields(WritableSerializationBuffer& ctx, S& s) const
+	{
+		s.serialize(ctx, request_header);
+		s.serialize(ctx, max_age);
+		s.serialize(ctx, static_cast<UInt32>(timestamps_to_return));
+		s.serialize(ctx, ArraySerialization<ReadValueId>(nodes_to_read));
+	}
+
+	template <class S>
+	void ReadRequest::unserialize_fields(ReadableSerializationBuffer& ctx, S& s)
+	{
+		UInt32 timestamps_to_return_i;
+
+		s.unserialize(ctx, request_header);
+		s.unserialize(ctx, max_age);
+		s.unserialize(ctx, timestamps_to_return_i);
+		s.unserialize(ctx, ArrayUnserialization<ReadValueId>(nodes_to_read));
+
+		timestamps_to_return = static_cast<TimestampsToReturn>(timestamps_to_return_i);
+	}
+
+	template <class S>
+	void DataValue::serialize_fields(WritableSerializationBuffer& ctx, S& s) const
+	{
+		s.serialize(ctx, flags);
+		if (flags & static_cast<Byte>(DataValueFlags::VALUE_SPECIFIED))
+			s.serialize(ctx, value);
+		if (flags & static_cast<Byte>(DataValueFlags::STATUS_CODE_SPECIFIED))
+			s.serialize(ctx, status_code);
+		if (flags & static_cast<Byte>(DataValueFlags::SOURCE_TIMESTAMP_SPECIFIED))
+			s.serialize(ctx, source_timestamp);
+		if (flags & static_cast<Byte>(DataValueFlags::SOURCE_PICOSECONDS_SPECIFIED))
+			s.serialize(ctx, source_picoseconds);
+		if (flags & static_cast<Byte>(DataValueFlags::SERVER_TIMESTAMP_SPECIFIED))
+			s.serialize(ctx, server_timestamp);
+		if (flags & static_cast<Byte>(DataValueFlags::SERVER_PICOSECONDS_SPECIFIED))
+			s.serialize(ctx, server_picoseconds);
+	}
+
+	template <class S>
+	void DataValue::unserialize_fields(ReadableSerializationBuffer& ctx, S& s)
+	{
+		s.unserialize(ctx, flags);
+		// (the object may be reused, so reset the absent fields)
+		if (flags & static_cast<Byte>(DataValueFlags::VALUE_SPECIFIED))
+			s.unserialize(ctx, value);
+		else
+			value.reset();
+		if (flags & static_cast<Byte>(DataValueFlags::STATUS_CODE_SPECIFIED))
+			s.unserialize(ctx, status_code);
+		else
+			status_code = 0;
+		if (flags & static_cast<Byte>(DataValueFlags::SOURCE_TIMESTAMP_SPECIFIED))
+			s.unserialize(ctx, source_timestamp);
+		else
+			source_timestamp = DateTime();
+		if (flags & static_cast<Byte>(DataValueFlags::SOURCE_PICOSECONDS_SPECIFIED))
+			s.unserialize(ctx, source_picoseconds);
+		else
+			source_picoseconds = 0;
+		if (flags & static_cast<Byte>(DataValueFlags::SERVER_TIMESTAMP_SPECIFIED))
+			s.unserialize(ctx, server_timestamp);
+		else
+			server_timestamp = DateTime();
+		if (flags & static_cast<Byte>(DataValueFlags::SERVER_PICOSECONDS_SPECIFIED))
+			s.unserialize(ctx, server_picoseconds);
+		else
+			server_picoseconds = 0;
+	}
+
+	template <class S>
+	void ReadResponse::serialize_fields(WritableSerializationBuffer& ctx, S& s) const
+	{
+		s.serialize(ctx, response_header);
+		s.serialize(ctx, ArraySerialization<DataValue>(results));
+		s.serialize(ctx, ArraySerialization<DiagnosticInfo>(diagnostic_infos));
+	}
+
+	template <class S>
+	void ReadResponse::unserialize_fields(ReadableSerializationBuffer& ctx, S& s)
+	{
+		s.unserialize(ctx, response_header);
+		s.unserialize(ctx, ArrayUnserialization<DataValue>(results));
+		s.unserialize(ctx, ArrayUnserialization<DiagnosticInfo>(diagnostic_infos));
+	}
+
+	template <class S>
+	void WriteValue::serialize_fields(WritableSerializationBuffer& ctx, S& s) const
+	{
+		s.serialize(ctx, node_id);
+		s.serialize(ctx, attribute_id);
+		s.serialize(ctx, index_range);
+		s.serialize(ctx, value);
+	}
+
+	template <class S>
+	void WriteValue::unserialize_fields(ReadableSerializationBuffer& ctx, S& s)
+	{
+		s.unserialize(ctx, node_id);
+		s.unserialize(ctx, attribute_id);
+		s.unserialize(ctx, index_range);
+		s.unserialize(ctx, value);
+	}
+
+	template <class S>
+	void WriteRequest::serialize_fields(WritableSerializationBuffer& ctx, S& s) const
+	{
+		s.serialize(ctx, request_header);
+		s.serialize(ctx, ArraySerialization<WriteValue>(nodes_to_write));
+	}
+
+	template <class S>
+	void WriteRequest::unserialize_fields(ReadableSerializationBuffer& ctx, S& s)
+	{
+		s.unserialize(ctx, request_header);
+		s.unserialize(ctx, ArrayUnserialization<WriteValue>(nodes_to_write));
+	}
+
+	template <class S>
+	void WriteResponse::serialize_fields(WritableSerializationBuffer& ctx, S& s) const
+	{
+		s.serialize(ctx, response_header);
+		s.serialize(ctx, ArraySerialization<StatusCode>(results));
+		s.serialize(ctx, ArraySerialization<DiagnosticInfo>(diagnostic_infos));
+	}
+
+	template <class S>
+	void WriteResponse::unserialize_fields(ReadableSerializationBuffer& ctx, S& s)
+	{
+		s.unserialize(ctx, response_header);
+		s.unserialize(ctx, ArrayUnserialization<StatusCode>(results));
+		s.unserialize(ctx, ArrayUnserialization<DiagnosticInfo>(diagnostic_infos));
+	}
 };
 
 #endif /*OPCUA_COMMON_STRUCT_HXX*/
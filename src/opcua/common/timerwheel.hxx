@@ -0,0 +1,154 @@
+/* OPC UA protocol implementation
+ * (c) 2014 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef OPCUA_COMMON_TIMERWHEEL_HXX
+#define OPCUA_COMMON_TIMERWHEEL_HXX 1
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace opc_ua
+{
+	// Hashed timer wheel. Timers are kept in the slot of their expiry
+	// tick (modulo the wheel size), so adding one is O(1) and advancing
+	// the time only looks at the slots passed. Timers further away than
+	// a full revolution stay in their slot until their round comes.
+	// Cancelling a timer scans its slot, so the owner may instead leave
+	// it to expire and check whether the value is still relevant (and
+	// re-add it with a later expiry if it was extended meanwhile).
+	template <class T>
+	class TimerWheel
+	{
+		struct Entry
+		{
+			uint64_t expiry;
+			T value;
+		};
+
+		std::vector<std::vector<Entry>> slots;
+		// last tick processed
+		uint64_t current;
+		size_t count;
+
+		// swap-remove an entry (the order within a slot is irrelevant)
+		static void remove(std::vector<Entry>& slot, size_t i);
+
+	public:
+		TimerWheel(size_t slot_count, uint64_t start_tick);
+
+		// add a timer expiring at the given tick (or the next one,
+		// if it has passed already), return the tick used
+		uint64_t add(uint64_t expiry, const T& value);
+		// remove a pending timer added with the given (returned)
+		// expiry, return false if there is none
+		bool cancel(uint64_t expiry, const T& value);
+		// move the time forward, calling expired(value) for all
+		// timers due (the callback can add new timers)
+		template <class F>
+		void advance(uint64_t tick, F expired);
+
+		// number of timers pending
+		size_t size() const;
+		bool empty() const;
+	};
+
+	template <class T>
+	TimerWheel<T>::TimerWheel(size_t slot_count, uint64_t start_tick)
+		: slots(slot_count), current(start_tick), count(0)
+	{
+	}
+
+	template <class T>
+	uint64_t TimerWheel<T>::add(uint64_t expiry, const T& value)
+	{
+		if (expiry <= current)
+			expiry = current + 1;
+
+		slots[expiry % slots.size()].push_back(Entry{expiry, value});
+		++count;
+		return expiry;
+	}
+
+	template <class T>
+	bool TimerWheel<T>::cancel(uint64_t expiry, const T& value)
+	{
+		std::vector<Entry>& slot = slots[expiry % slots.size()];
+
+		for (size_t i = 0; i < slot.size(); ++i)
+		{
+			if (slot[i].expiry == expiry && slot[i].value == value)
+			{
+				remove(slot, i);
+				--count;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	template <class T>
+	void TimerWheel<T>::remove(std::vector<Entry>& slot, size_t i)
+	{
+		// (avoiding a self-move of the last one)
+		if (i != slot.size() - 1)
+			slot[i] = std::move(slot.back());
+		slot.pop_back();
+	}
+
+	template <class T>
+	template <class F>
+	void TimerWheel<T>::advance(uint64_t tick, F expired)
+	{
+		std::vector<T> due;
+
+		if (tick <= current)
+			return;
+
+		// after a long pause, a single revolution covers all slots
+		uint64_t last = std::min<uint64_t>(tick, current + slots.size());
+		for (uint64_t t = current + 1; t <= last; ++t)
+		{
+			std::vector<Entry>& slot = slots[t % slots.size()];
+
+			for (size_t i = 0; i < slot.size(); )
+			{
+				if (slot[i].expiry <= tick)
+				{
+					due.push_back(std::move(slot[i].value));
+					remove(slot, i);
+				}
+				else
+					++i;
+			}
+		}
+
+		current = tick;
+		count -= due.size();
+
+		// (called last so that the timers can be re-added)
+		for (T& v : due)
+			expired(v);
+	}
+
+	template <class T>
+	size_t TimerWheel<T>::size() const
+	{
+		return count;
+	}
+
+	template <class T>
+	bool TimerWheel<T>::empty() const
+	{
+		return count == 0;
+	}
+};
+
+#endif /*OPCUA_COMMON_TIMERWHEEL_HXX*/
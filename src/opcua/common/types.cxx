@@ -9,8 +9,14 @@
 
 #include "types.hxx"
 
+#include <opcua/common/random.hxx>
+
+#include <algorithm>
 #include <cassert>
-#include <random>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <utility>
 
 opc_ua::DateTime::DateTime()
 	: ts({ .tv_sec = 0, .tv_nsec = 0})
@@ -45,17 +51,21 @@ opc_ua::GUID::GUID()
 {
 }
 
+opc_ua::GUID::GUID(std::initializer_list<Byte> bytes)
+{
+	if (bytes.size() != guid.size())
+		throw std::invalid_argument("GUID must be initialized with 16 bytes");
+
+	std::copy(bytes.begin(), bytes.end(), guid.begin());
+}
+
 opc_ua::GUID opc_ua::GUID::random_guid()
 {
 	// based on RFC4122, sect. 4.4
 
-	std::random_device rnd;
-	std::uniform_int_distribution<Byte> dist;
-
 	GUID out;
 	// fill in with random bytes
-	for (auto& i : out.guid)
-		i = dist(rnd);
+	random_bytes(out.guid.data(), out.guid.size());
 
 	// clear variant and version bitfields
 	out.guid[8] &= ~0xc0;
@@ -87,19 +97,106 @@ opc_ua::NodeId::NodeId(const GUID& node_id, UInt16 node_ns)
 {
 }
 
-opc_ua::NodeId::NodeId(const CharArray& node_id, UInt16 node_ns)
-	: type(NodeIdType::STRING), ns(node_ns), as_chararray(node_id)
+opc_ua::NodeId::NodeId(CharArray node_id, UInt16 node_ns)
+	: type(NodeIdType::STRING), ns(node_ns), as_chararray(std::move(node_id))
 {
 }
 
-opc_ua::NodeId::NodeId(const ByteString& node_id, UInt16 node_ns, int unused)
-	: type(NodeIdType::BYTE_STRING), ns(node_ns), as_bytestring(node_id)
+opc_ua::NodeId::NodeId(ByteString node_id, UInt16 node_ns, int unused)
+	: type(NodeIdType::BYTE_STRING), ns(node_ns), as_bytestring(std::move(node_id))
 {
 }
 
+opc_ua::NodeId::NodeId(const NodeId& other)
+	: type(other.type), ns(other.ns)
+{
+	switch (type)
+	{
+		case NodeIdType::NUMERIC:
+			as_int = other.as_int;
+			break;
+		case NodeIdType::GUID:
+			as_guid = other.as_guid;
+			break;
+		case NodeIdType::STRING:
+			new (&as_chararray) CharArray(other.as_chararray);
+			break;
+		case NodeIdType::BYTE_STRING:
+			new (&as_bytestring) ByteString(other.as_bytestring);
+			break;
+		default:
+			assert(not_reached);
+	}
+}
+
+opc_ua::NodeId::NodeId(NodeId&& other) noexcept
+	: type(other.type), ns(other.ns)
+{
+	switch (type)
+	{
+		case NodeIdType::NUMERIC:
+			as_int = other.as_int;
+			break;
+		case NodeIdType::GUID:
+			as_guid = other.as_guid;
+			break;
+		case NodeIdType::STRING:
+			new (&as_chararray) CharArray(std::move(other.as_chararray));
+			break;
+		case NodeIdType::BYTE_STRING:
+			new (&as_bytestring) ByteString(std::move(other.as_bytestring));
+			break;
+		default:
+			assert(not_reached);
+	}
+}
+
+opc_ua::NodeId::~NodeId()
+{
+	if (type == NodeIdType::STRING)
+		as_chararray.~CharArray();
+	else if (type == NodeIdType::BYTE_STRING)
+		as_bytestring.~ByteString();
+}
+
+opc_ua::NodeId& opc_ua::NodeId::operator=(const NodeId& other)
+{
+	if (&other == this)
+		return *this;
+
+	// reuse the string storage if possible
+	if (type == other.type && type == NodeIdType::STRING)
+		as_chararray = other.as_chararray;
+	else if (type == other.type && type == NodeIdType::BYTE_STRING)
+		as_bytestring = other.as_bytestring;
+	else
+	{
+		// copy first, so that *this stays intact if that throws
+		// (moving does not)
+		NodeId copy(other);
+
+		this->~NodeId();
+		new (this) NodeId(std::move(copy));
+		return *this;
+	}
+
+	ns = other.ns;
+	return *this;
+}
+
+opc_ua::NodeId& opc_ua::NodeId::operator=(NodeId&& other) noexcept
+{
+	if (&other == this)
+		return *this;
+
+	this->~NodeId();
+	new (this) NodeId(std::move(other));
+	return *this;
+}
+
 bool opc_ua::NodeId::operator==(const NodeId& other) const
 {
-	if (type != other.type)
+	if (type != other.type || ns != other.ns)
 		return false;
 
 	switch (type)
@@ -124,14 +221,10 @@ bool opc_ua::NodeId::operator!=(const NodeId& other) const
 
 opc_ua::ByteString opc_ua::random_nonce()
 {
-	std::random_device rnd;
-	std::uniform_int_distribution<opc_ua::Byte> dist;
+	ByteString ret(32, '\0');
 
-	ByteString ret;
-	for (int i = 0; i < 32; ++i)
-		ret.push_back(dist(rnd));
-
-	return std::move(ret);
+	random_bytes(&ret[0], ret.size());
+	return ret;
 }
 
 opc_ua::ExtensionObject::ExtensionObject(std::unique_ptr<Struct> obj)
@@ -199,6 +292,123 @@ opc_ua::Variant::Variant(const ByteString& s, int unused)
 {
 }
 
+opc_ua::Variant::Variant(const Variant& other)
+	: variant_type(VariantType::NONE)
+{
+	*this = other;
+}
+
+opc_ua::Variant::Variant(Variant&& other) noexcept
+	: variant_type(VariantType::NONE)
+{
+	*this = std::move(other);
+}
+
+opc_ua::Variant::~Variant()
+{
+	reset();
+}
+
+opc_ua::Variant& opc_ua::Variant::operator=(const Variant& other)
+{
+	if (&other == this)
+		return *this;
+
+	reset(other.variant_type);
+
+	switch (variant_type)
+	{
+		case VariantType::NONE:
+			break;
+		case VariantType::BOOLEAN:
+			as_boolean = other.as_boolean;
+			break;
+		case VariantType::BYTE:
+			as_byte = other.as_byte;
+			break;
+		case VariantType::UINT16:
+			as_uint16 = other.as_uint16;
+			break;
+		case VariantType::INT32:
+			as_int32 = other.as_int32;
+			break;
+		case VariantType::UINT32:
+			as_uint32 = other.as_uint32;
+			break;
+		case VariantType::INT64:
+			as_int64 = other.as_int64;
+			break;
+		case VariantType::DOUBLE:
+			as_double = other.as_double;
+			break;
+		case VariantType::STRING:
+			as_string = other.as_string;
+			break;
+		case VariantType::DATETIME:
+			as_datetime = other.as_datetime;
+			break;
+		case VariantType::GUID:
+			as_guid = other.as_guid;
+			break;
+		case VariantType::BYTESTRING:
+			as_bytestring = other.as_bytestring;
+			break;
+		default:
+			assert(not_reached);
+	}
+
+	return *this;
+}
+
+opc_ua::Variant& opc_ua::Variant::operator=(Variant&& other) noexcept
+{
+	if (&other == this)
+		return *this;
+
+	if (other.variant_type == VariantType::STRING)
+	{
+		reset(other.variant_type);
+		as_string = std::move(other.as_string);
+	}
+	else if (other.variant_type == VariantType::BYTESTRING)
+	{
+		reset(other.variant_type);
+		as_bytestring = std::move(other.as_bytestring);
+	}
+	else
+	{
+		// no resources to steal
+		*this = other;
+	}
+
+	return *this;
+}
+
+void opc_ua::Variant::reset(VariantType new_type)
+{
+	// keep the string (and its storage) when the type does not change
+	if (new_type == variant_type)
+	{
+		if (variant_type == VariantType::STRING)
+			as_string.clear();
+		else if (variant_type == VariantType::BYTESTRING)
+			as_bytestring.clear();
+		return;
+	}
+
+	if (variant_type == VariantType::STRING)
+		as_string.~String();
+	else if (variant_type == VariantType::BYTESTRING)
+		as_bytestring.~ByteString();
+
+	if (new_type == VariantType::STRING)
+		new (&as_string) String();
+	else if (new_type == VariantType::BYTESTRING)
+		new (&as_bytestring) ByteString();
+
+	variant_type = new_type;
+}
+
 bool opc_ua::Variant::operator==(const Variant& other) const
 {
 	if (variant_type != other.variant_type)
@@ -240,53 +450,48 @@ bool opc_ua::Variant::operator!=(const Variant& other) const
 	return !(*this == other);
 }
 
-size_t std::hash<opc_ua::GUID>::operator()(const opc_ua::GUID& g) const
+// SplitMix64 finalizer, every input bit affects every output bit
+static inline uint64_t hash_mix(uint64_t x)
 {
-	std::hash<opc_ua::UInt32> int_hash;
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
 
-	size_t r;
+size_t std::hash<opc_ua::GUID>::operator()(const opc_ua::GUID& g) const
+{
+	uint64_t hi, lo;
 
-	r = int_hash(g.guid[0] << 24 | g.guid[1] << 16 | g.guid[2] << 8 | g.guid[3]);
-	r <<= 1;
-	r ^= int_hash(g.guid[4] << 24 | g.guid[5] << 16 | g.guid[6] << 8 | g.guid[7]);
-	r <<= 1;
-	r ^= int_hash(g.guid[8] << 24 | g.guid[9] << 16 | g.guid[10] << 8 | g.guid[11]);
-	r <<= 1;
-	r ^= int_hash(g.guid[12] << 24 | g.guid[13] << 16 | g.guid[14] << 8 | g.guid[15]);
+	std::memcpy(&hi, &g.guid[0], sizeof(hi));
+	std::memcpy(&lo, &g.guid[8], sizeof(lo));
 
-	return r;
+	return hash_mix(hash_mix(hi) ^ lo);
 }
 
 size_t std::hash<opc_ua::NodeId>::operator()(const opc_ua::NodeId& id) const
 {
-	std::hash<opc_ua::UInt32> int_hash;
-	std::hash<opc_ua::UInt16> int16_hash;
-	std::hash<opc_ua::ByteString> bs_hash;
-	std::hash<opc_ua::GUID> guid_hash;
-	std::hash<opc_ua::CharArray> str_hash;
-
-	size_t r = int_hash(static_cast<opc_ua::UInt32>(id.type));
-	r <<= 1;
-	r ^= int16_hash(id.ns);
-	r <<= 1;
+	uint64_t r = static_cast<uint64_t>(id.type) << 16 | id.ns;
 
 	switch (id.type)
 	{
 		case opc_ua::NodeIdType::NUMERIC:
-			r ^= int_hash(id.as_int);
-			break;
-		case opc_ua::NodeIdType::BYTE_STRING:
-			r ^= bs_hash(id.as_bytestring);
-			break;
+			// fits in a single word
+			return hash_mix(r << 32 | id.as_int);
 		case opc_ua::NodeIdType::GUID:
-			r ^= guid_hash(id.as_guid);
+			r ^= std::hash<opc_ua::GUID>()(id.as_guid);
 			break;
 		case opc_ua::NodeIdType::STRING:
-			r ^= str_hash(id.as_bytestring);
+			r ^= std::hash<opc_ua::CharArray>()(id.as_chararray);
+			break;
+		case opc_ua::NodeIdType::BYTE_STRING:
+			r ^= std::hash<opc_ua::ByteString>()(id.as_bytestring);
 			break;
 		default:
 			throw std::runtime_error("Unsupported NodeId type");
 	}
 
-	return r;
+	return hash_mix(r);
 }
@@ -11,8 +11,10 @@
 #include <array>
 #include <cstdint>
 #include <ctime>
+#include <initializer_list>
 #include <memory>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include <opcua/common/util.hxx>
@@ -68,6 +70,7 @@ namespace opc_ua
 		std::array<Byte, 16> guid;
 
 		GUID();
+		GUID(std::initializer_list<Byte> bytes);
 
 		static GUID random_guid();
 
@@ -79,31 +82,46 @@ namespace opc_ua
 	{
 		NodeIdType type;
 		UInt16 ns;
+		// only the member matching type is alive
 		union {
 			UInt32 as_int;
 			GUID as_guid;
+			ByteString as_bytestring;
+			CharArray as_chararray;
 		};
-		ByteString as_bytestring;
-		CharArray as_chararray;
 
 		// Numeric NodeId
 		NodeId(UInt32 node_id = 0, UInt16 node_ns = 0);
 		// GUID NodeId
 		NodeId(const GUID& node_id, UInt16 node_ns);
 		// String NodeId
-		NodeId(const CharArray& node_id, UInt16 node_ns);
+		NodeId(CharArray node_id, UInt16 node_ns);
 		// ByteString NodeId
-		NodeId(const ByteString& node_id, UInt16 node_ns, int unused);
+		NodeId(ByteString node_id, UInt16 node_ns, int unused);
+
+		NodeId(const NodeId& other);
+		NodeId(NodeId&& other) noexcept;
+		~NodeId();
+
+		NodeId& operator=(const NodeId& other);
+		NodeId& operator=(NodeId&& other) noexcept;
 
 		bool operator==(const NodeId& other) const;
 		bool operator!=(const NodeId& other) const;
 	};
 
+	// (so that growing vectors move the elements rather than copy them)
+	static_assert(std::is_nothrow_move_constructible<NodeId>::value,
+			"NodeId move must not throw");
+
 	struct Serializer;
 
 	// An abstract structure needing serialization function.
 	struct Struct
 	{
+		// (structs are owned and deleted through base pointers)
+		virtual ~Struct() {}
+
 		virtual void serialize(WritableSerializationBuffer& ctx, Serializer& s) const = 0;
 		virtual void unserialize(ReadableSerializationBuffer& ctx, Serializer& s) = 0;
 		virtual UInt32 get_node_id() const = 0;
@@ -144,8 +162,11 @@ namespace opc_ua
 
 	struct Variant
 	{
+		// (use reset() to change the type)
 		VariantType variant_type;
 
+		// only the member matching variant_type is alive; strings
+		// are stored in place, so short ones do not allocate
 		union
 		{
 			Boolean as_boolean;
@@ -157,11 +178,10 @@ namespace opc_ua
 			Double as_double;
 			DateTime as_datetime;
 			GUID as_guid;
+			String as_string;
+			ByteString as_bytestring;
 		};
 
-		String as_string;
-		ByteString as_bytestring;
-
 		Variant();
 		Variant(Boolean b);
 		Variant(Byte b);
@@ -175,10 +195,58 @@ namespace opc_ua
 		Variant(const GUID& g);
 		Variant(const ByteString& s, int unused);
 
+		Variant(const Variant& other);
+		Variant(Variant&& other) noexcept;
+		~Variant();
+
+		Variant& operator=(const Variant& other);
+		Variant& operator=(Variant&& other) noexcept;
+
+		// change the type, destroying the old value; string types
+		// get an empty string, other values are left uninitialized
+		void reset(VariantType new_type = VariantType::NONE);
+
 		bool operator==(const Variant& other) const;
 		bool operator!=(const Variant& other) const;
 	};
 
+	static_assert(std::is_nothrow_move_constructible<Variant>::value,
+			"Variant move must not throw");
+
+	// array element types whose in-memory layout matches the wire
+	// encoding, allowing arrays of them to be copied as a whole
+	template <class T>
+	struct is_block_serializable : std::false_type {};
+	template <>
+	struct is_block_serializable<Byte> : std::true_type {};
+	template <>
+	struct is_block_serializable<UInt16> : std::true_type {};
+	template <>
+	struct is_block_serializable<UInt32> : std::true_type {};
+	template <>
+	struct is_block_serializable<Int32> : std::true_type {};
+	template <>
+	struct is_block_serializable<Int64> : std::true_type {};
+	template <>
+	struct is_block_serializable<Double> : std::true_type {};
+
+	// smallest possible encoding of a value, in bytes; array lengths
+	// are checked against it before any storage is allocated
+	// (structs conservatively take one byte)
+	template <class T>
+	struct min_encoded_size : std::integral_constant<size_t,
+			is_block_serializable<T>::value ? sizeof(T) : 1> {};
+	template <>
+	struct min_encoded_size<String> : std::integral_constant<size_t, 4> {};
+	template <>
+	struct min_encoded_size<DateTime> : std::integral_constant<size_t, 8> {};
+	template <>
+	struct min_encoded_size<GUID> : std::integral_constant<size_t, 16> {};
+	template <>
+	struct min_encoded_size<NodeId> : std::integral_constant<size_t, 2> {};
+	template <>
+	struct min_encoded_size<ExtensionObject> : std::integral_constant<size_t, 3> {};
+
 	class AbstractArraySerialization
 	{
 	public:
@@ -191,8 +259,12 @@ namespace opc_ua
 	{
 		const Array<T>& _array;
 
+		void serialize_all(WritableSerializationBuffer& ctx, Serializer& s, std::true_type) const;
+		void serialize_all(WritableSerializationBuffer& ctx, Serializer& s, std::false_type) const;
+
 	public:
 		ArraySerialization(const Array<T>& array);
+		const Array<T>& array() const;
 		virtual size_t size() const;
 		virtual void serialize_all(WritableSerializationBuffer& ctx, Serializer& s) const;
 	};
@@ -201,6 +273,9 @@ namespace opc_ua
 	{
 	public:
 		virtual void clear() const = 0;
+		// (see min_encoded_size)
+		virtual size_t min_element_size() const = 0;
+		// (frees the storage if it throws)
 		virtual void unserialize_n(ReadableSerializationBuffer& ctx, Serializer& s, size_t count) const = 0;
 	};
 
@@ -209,9 +284,14 @@ namespace opc_ua
 	{
 		Array<T>& _array;
 
+		void unserialize_n(ReadableSerializationBuffer& ctx, Serializer& s, size_t count, std::true_type) const;
+		void unserialize_n(ReadableSerializationBuffer& ctx, Serializer& s, size_t count, std::false_type) const;
+
 	public:
 		ArrayUnserialization(Array<T>& array);
+		Array<T>& array() const;
 		virtual void clear() const;
+		virtual size_t min_element_size() const;
 		virtual void unserialize_n(ReadableSerializationBuffer& ctx, Serializer& s, size_t count) const;
 	};
 
@@ -235,6 +315,14 @@ namespace opc_ua
 		virtual void serialize(WritableSerializationBuffer& ctx, const Variant& v) = 0;
 		virtual void serialize(WritableSerializationBuffer& ctx, const AbstractArraySerialization& a) = 0;
 
+		// contiguous arrays of block-serializable types
+		virtual void serialize_n(WritableSerializationBuffer& ctx, const Byte* v, size_t count) = 0;
+		virtual void serialize_n(WritableSerializationBuffer& ctx, const UInt16* v, size_t count) = 0;
+		virtual void serialize_n(WritableSerializationBuffer& ctx, const UInt32* v, size_t count) = 0;
+		virtual void serialize_n(WritableSerializationBuffer& ctx, const Int32* v, size_t count) = 0;
+		virtual void serialize_n(WritableSerializationBuffer& ctx, const Int64* v, size_t count) = 0;
+		virtual void serialize_n(WritableSerializationBuffer& ctx, const Double* v, size_t count) = 0;
+
 		virtual void unserialize(ReadableSerializationBuffer& ctx, Boolean& b) = 0;
 		virtual void unserialize(ReadableSerializationBuffer& ctx, Byte& i) = 0;
 		virtual void unserialize(ReadableSerializationBuffer& ctx, UInt16& i) = 0;
@@ -251,6 +339,13 @@ namespace opc_ua
 		virtual void unserialize(ReadableSerializationBuffer& ctx, ExtensionObject& s) = 0;
 		virtual void unserialize(ReadableSerializationBuffer& ctx, Variant& v) = 0;
 		virtual void unserialize(ReadableSerializationBuffer& ctx, const AbstractArrayUnserialization& a) = 0;
+
+		virtual void unserialize_n(ReadableSerializationBuffer& ctx, Byte* v, size_t count) = 0;
+		virtual void unserialize_n(ReadableSerializationBuffer& ctx, UInt16* v, size_t count) = 0;
+		virtual void unserialize_n(ReadableSerializationBuffer& ctx, UInt32* v, size_t count) = 0;
+		virtual void unserialize_n(ReadableSerializationBuffer& ctx, Int32* v, size_t count) = 0;
+		virtual void unserialize_n(ReadableSerializationBuffer& ctx, Int64* v, size_t count) = 0;
+		virtual void unserialize_n(ReadableSerializationBuffer& ctx, Double* v, size_t count) = 0;
 	};
 
 	// serializer implementation
@@ -260,6 +355,12 @@ namespace opc_ua
 	{
 	}
 
+	template <class T>
+	const Array<T>& ArraySerialization<T>::array() const
+	{
+		return _array;
+	}
+
 	template <class T>
 	size_t ArraySerialization<T>::size() const
 	{
@@ -268,6 +369,20 @@ namespace opc_ua
 
 	template <class T>
 	void ArraySerialization<T>::serialize_all(WritableSerializationBuffer& ctx, Serializer& s) const
+	{
+		serialize_all(ctx, s, is_block_serializable<T>());
+	}
+
+	template <class T>
+	void ArraySerialization<T>::serialize_all(WritableSerializationBuffer& ctx, Serializer& s, std::true_type) const
+	{
+		// (data() of an empty vector may be null)
+		if (!_array.empty())
+			s.serialize_n(ctx, _array.data(), _array.size());
+	}
+
+	template <class T>
+	void ArraySerialization<T>::serialize_all(WritableSerializationBuffer& ctx, Serializer& s, std::false_type) const
 	{
 		for (const T& i : _array)
 			s.serialize(ctx, i);
@@ -280,15 +395,51 @@ namespace opc_ua
 	{
 	}
 
+	template <class T>
+	Array<T>& ArrayUnserialization<T>::array() const
+	{
+		return _array;
+	}
+
 	template <class T>
 	void ArrayUnserialization<T>::clear() const
 	{
 		_array.clear();
 	}
 
+	template <class T>
+	size_t ArrayUnserialization<T>::min_element_size() const
+	{
+		return min_encoded_size<T>::value;
+	}
+
 	template <class T>
 	void ArrayUnserialization<T>::unserialize_n(ReadableSerializationBuffer& ctx, Serializer& s, size_t count) const
 	{
+		try
+		{
+			unserialize_n(ctx, s, count, is_block_serializable<T>());
+		}
+		catch (...)
+		{
+			// do not keep a huge array around for the next decode
+			Array<T>().swap(_array);
+			throw;
+		}
+	}
+
+	template <class T>
+	void ArrayUnserialization<T>::unserialize_n(ReadableSerializationBuffer& ctx, Serializer& s, size_t count, std::true_type) const
+	{
+		_array.resize(count);
+
+		s.unserialize_n(ctx, _array.data(), count);
+	}
+
+	template <class T>
+	void ArrayUnserialization<T>::unserialize_n(ReadableSerializationBuffer& ctx, Serializer& s, size_t count, std::false_type) const
+	{
+		// existing elements are decoded over, reusing their storage
 		_array.resize(count);
 
 		for (T& i : _array)
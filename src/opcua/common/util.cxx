@@ -9,18 +9,40 @@
 
 #include "util.hxx"
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
 #include <stdexcept>
 
 opc_ua::SerializationBuffer::SerializationBuffer(evbuffer* new_buf)
-	: buf(new_buf)
+	: buf(new_buf), window(nullptr), window_pos(0), window_len(0),
+	extent(), extent_used(0)
 {
 	assert(new_buf);
 }
 
 size_t opc_ua::SerializationBuffer::size() const
 {
-	return evbuffer_get_length(buf);
+	// (the window covers all data, unless it is limited)
+	if (window)
+		return window_len - window_pos;
+	return evbuffer_get_length(buf) + extent_used;
+}
+
+void opc_ua::SerializationBuffer::commit_extent()
+{
+	// (an unused reservation can be simply dropped)
+	if (extent_used > 0)
+	{
+		extent.iov_len = extent_used;
+		if (evbuffer_commit_space(buf, &extent, 1) == -1)
+			throw std::runtime_error("Failure committing to buffer");
+	}
+
+	extent.iov_base = nullptr;
+	extent.iov_len = 0;
+	extent_used = 0;
 }
 
 opc_ua::ReadableSerializationBuffer::ReadableSerializationBuffer(evbuffer* new_buf)
@@ -28,39 +50,223 @@ opc_ua::ReadableSerializationBuffer::ReadableSerializationBuffer(evbuffer* new_b
 {
 }
 
-void opc_ua::ReadableSerializationBuffer::read(void* data, size_t length)
+void opc_ua::ReadableSerializationBuffer::read_buffer(void* data, size_t length)
 {
+	// the window covers all data in the buffer
+	if (window)
+		throw std::runtime_error("Short read when draining the buffer");
+
+	commit_extent();
 	ssize_t rd = evbuffer_remove(buf, data, length);
 
 	if (rd < length)
 		throw std::runtime_error("Short read when draining the buffer");
 }
 
+void opc_ua::ReadableSerializationBuffer::skip(size_t length)
+{
+	if (window)
+	{
+		if (length > window_len - window_pos)
+			throw std::runtime_error("Short read when draining the buffer");
+		window_pos += length;
+		return;
+	}
+
+	commit_extent();
+	if (length > evbuffer_get_length(buf) || evbuffer_drain(buf, length) == -1)
+		throw std::runtime_error("Short read when draining the buffer");
+}
+
+void opc_ua::ReadableSerializationBuffer::pullup()
+{
+	release();
+	commit_extent();
+
+	window_len = evbuffer_get_length(buf);
+	if (window_len == 0)
+		return;
+
+	window = evbuffer_pullup(buf, -1);
+	if (!window)
+		throw std::runtime_error("Failure linearizing the buffer");
+}
+
+void opc_ua::ReadableSerializationBuffer::release()
+{
+	if (window && evbuffer_drain(buf, window_pos) == -1)
+		throw std::runtime_error("Failure draining the buffer");
+
+	window = nullptr;
+	window_pos = 0;
+	window_len = 0;
+}
+
+bool opc_ua::ReadableSerializationBuffer::windowed() const
+{
+	return window;
+}
+
+size_t opc_ua::ReadableSerializationBuffer::limit(size_t length)
+{
+	size_t end = window_len;
+
+	assert(window);
+	if (length > window_len - window_pos)
+		throw std::runtime_error("Short read when draining the buffer");
+
+	window_len = window_pos + length;
+	return end;
+}
+
+void opc_ua::ReadableSerializationBuffer::unlimit(size_t end)
+{
+	window_pos = window_len;
+	window_len = end;
+}
+
 opc_ua::WritableSerializationBuffer::WritableSerializationBuffer(evbuffer* new_buf)
 	: SerializationBuffer(new_buf)
 {
 }
 
-void opc_ua::WritableSerializationBuffer::write(const void* data, size_t length)
+void opc_ua::WritableSerializationBuffer::write_buffer(const void* data, size_t length)
 {
-	if (evbuffer_add(buf, data, length) == -1)
-		throw std::runtime_error("Failure appending to buffer");
+	// appending could move the data under an open window
+	assert(!window);
+
+	commit_extent();
+
+	if (length >= write_slab_size)
+	{
+		if (evbuffer_add(buf, data, length) == -1)
+			throw std::runtime_error("Failure appending to buffer");
+		return;
+	}
+
+	if (evbuffer_reserve_space(buf, write_slab_size, &extent, 1) != 1)
+		throw std::runtime_error("Failure reserving space in buffer");
+
+	std::memcpy(extent.iov_base, data, length);
+	extent_used = length;
+}
+
+void opc_ua::WritableSerializationBuffer::reserve(size_t length)
+{
+	assert(!window);
+
+	if (length <= extent.iov_len - extent_used)
+		return;
+
+	commit_extent();
+	if (evbuffer_reserve_space(buf, length > write_slab_size ? length : write_slab_size, &extent, 1) != 1)
+		throw std::runtime_error("Failure reserving space in buffer");
+}
+
+void opc_ua::WritableSerializationBuffer::commit()
+{
+	commit_extent();
+}
+
+size_t opc_ua::WritableSerializationBuffer::mark() const
+{
+	return evbuffer_get_length(buf) + extent_used;
+}
+
+void opc_ua::WritableSerializationBuffer::patch(size_t pos, const void* data, size_t length)
+{
+	const unsigned char* src = static_cast<const unsigned char*>(data);
+	size_t committed = evbuffer_get_length(buf);
+
+	assert(pos + length <= committed + extent_used);
+
+	// the part committed to the evbuffer already (possibly spanning
+	// a few chains)
+	while (length > 0 && pos < committed)
+	{
+		evbuffer_ptr ptr;
+		evbuffer_iovec vec;
+
+		if (evbuffer_ptr_set(buf, &ptr, pos, EVBUFFER_PTR_SET) == -1
+				|| evbuffer_peek(buf, length, &ptr, &vec, 1) < 1)
+			throw std::runtime_error("Failure patching the buffer");
+
+		size_t n = std::min(length, std::min(vec.iov_len, committed - pos));
+		std::memcpy(vec.iov_base, src, n);
+		src += n;
+		pos += n;
+		length -= n;
+	}
+
+	// the part still in the reserved extent
+	if (length > 0)
+		std::memcpy(static_cast<unsigned char*>(extent.iov_base) + (pos - committed),
+				src, length);
+}
+
+bool opc_ua::WritableSerializationBuffer::patchable() const
+{
+	return true;
 }
 
 void opc_ua::WritableSerializationBuffer::move(ReadableSerializationBuffer& other)
 {
+	other.release();
+	other.commit_extent();
+	commit_extent();
+
 	if (evbuffer_add_buffer(buf, other.buf) == -1)
 		throw std::runtime_error("Failure moving buffers");
 }
 
 void opc_ua::WritableSerializationBuffer::move(ReadableSerializationBuffer& other, size_t length)
 {
+	if (other.window)
+	{
+		// copy straight out of the window, it will be drained
+		// on release
+		if (length > other.window_len - other.window_pos)
+			throw std::runtime_error("Failure moving data from the buffer");
+
+		write(other.window + other.window_pos, length);
+		other.window_pos += length;
+		return;
+	}
+
+	other.commit_extent();
+	commit_extent();
+
 	ssize_t rd = evbuffer_remove_buffer(other.buf, buf, length);
 
 	if (rd == -1)
 		throw std::runtime_error("Failure moving data from the buffer");
 }
 
+void opc_ua::WritableSerializationBuffer::copy(ReadableSerializationBuffer& other, size_t pos, size_t length)
+{
+	other.release();
+	other.commit_extent();
+
+	if (pos + length > evbuffer_get_length(other.buf))
+		throw std::runtime_error("Failure copying data from the buffer");
+
+	// (possibly spanning a few chains)
+	while (length > 0)
+	{
+		evbuffer_ptr ptr;
+		evbuffer_iovec vec;
+
+		if (evbuffer_ptr_set(other.buf, &ptr, pos, EVBUFFER_PTR_SET) == -1
+				|| evbuffer_peek(other.buf, length, &ptr, &vec, 1) < 1)
+			throw std::runtime_error("Failure copying data from the buffer");
+
+		size_t n = std::min(length, vec.iov_len);
+		write(vec.iov_base, n);
+		pos += n;
+		length -= n;
+	}
+}
+
 opc_ua::MemorySerializationBuffer::MemorySerializationBuffer()
 	: SerializationBuffer(evbuffer_new()),
 	ReadableSerializationBuffer(nullptr),
@@ -75,3 +281,29 @@ opc_ua::MemorySerializationBuffer::~MemorySerializationBuffer()
 {
 	evbuffer_free(buf);
 }
+
+int opc_ua::write_out(bufferevent* bev)
+{
+	evbuffer* out = bufferevent_get_output(bev);
+	int ret;
+
+	// the bufferevent keeps its output frozen for draining outside
+	// its own write callback, evbuffer_write() fails otherwise
+	evbuffer_unfreeze(out, 1);
+	ret = evbuffer_write(out, bufferevent_getfd(bev));
+	int err = errno;
+	evbuffer_freeze(out, 1);
+
+	// report failures to the event callback like the bufferevent does
+	// for its own writes (deferred, as the caller is still using it)
+	if (ret < 0 && err != EAGAIN && err != EWOULDBLOCK && err != EINTR)
+		bufferevent_trigger_event(bev, BEV_EVENT_WRITING | BEV_EVENT_ERROR,
+				BEV_TRIG_DEFER_CALLBACKS);
+	return ret;
+}
+
+uint64_t opc_ua::clock_ms()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -8,7 +8,11 @@
 #ifndef OPCUA_COMMON_UTIL_HXX
 #define OPCUA_COMMON_UTIL_HXX 1
 
+#include <cstdint>
+#include <cstring>
+
 #include <event2/buffer.h>
+#include <event2/bufferevent.h>
 
 namespace opc_ua
 {
@@ -21,8 +25,24 @@ namespace opc_ua
 	protected:
 		evbuffer* buf;
 
+		// contiguous read window over the beginning of buf
+		// (see ReadableSerializationBuffer::pullup())
+		const unsigned char* window;
+		// amount of data consumed from the window (but still present
+		// in buf) and the total window length
+		size_t window_pos;
+		size_t window_len;
+
+		// space reserved at the end of buf that writes are collected
+		// in before being committed (see WritableSerializationBuffer)
+		evbuffer_iovec extent;
+		size_t extent_used;
+
 		SerializationBuffer(evbuffer* new_buf);
 
+		// commit the data collected in the reserved extent to buf
+		void commit_extent();
+
 	public:
 		// get length of data stored in the buffer
 		size_t size() const;
@@ -33,26 +53,78 @@ namespace opc_ua
 	{
 		friend class WritableSerializationBuffer;
 
+		// read path used when no window is open or it is too short
+		void read_buffer(void* data, size_t length);
+
 	public:
 		ReadableSerializationBuffer(evbuffer* new_buf);
 
 		// read data from the buffer
 		void read(void* data, size_t length);
+		// drop data from the beginning of the buffer unread
+		void skip(size_t length);
+
+		// Pull all data currently in the buffer into a single
+		// contiguous region and serve further reads from it. The data
+		// consumed is drained from the buffer in one go by release()
+		// (or when it is moved to another buffer). No data must be
+		// written to the buffer while the window is open.
+		void pullup();
+		// drain the data consumed through the window and go back
+		// to reading from the evbuffer directly
+		void release();
+
+		// Nested bodies can be decoded in place from the window:
+		// limit() restricts the reads to the next length bytes and
+		// returns the previous window end, unlimit() skips what is
+		// left of them and restores it. Only possible with a window
+		// open (see windowed()).
+		bool windowed() const;
+		size_t limit(size_t length);
+		void unlimit(size_t end);
 	};
 
 	// Serialization buffer that is associated with a writable stream.
+	// Small writes are collected in space reserved in the evbuffer
+	// and committed in large slabs. The pending data is committed
+	// before any other operation on the evbuffer; commit() needs to be
+	// called explicitly only before passing the evbuffer to libevent.
 	class WritableSerializationBuffer : public virtual SerializationBuffer
 	{
+		// write path used when the reserved extent is too short
+		// (subclasses can take over the handling of a full extent)
+		virtual void write_buffer(const void* data, size_t length);
+
 	public:
+		// minimal amount of space reserved for buffered writes,
+		// larger writes are passed to the evbuffer directly
+		static constexpr size_t write_slab_size = 4096;
+
 		WritableSerializationBuffer(evbuffer* new_buf);
 
 		// append new block of data to the buffer
 		void write(const void* data, size_t length);
+		// reserve contiguous space for the next length bytes written
+		void reserve(size_t length);
+		// commit buffered writes to the underlying evbuffer
+		void commit();
+
+		// Back-patching of values written ahead of the data they
+		// describe (e.g. lengths). mark() gives the position of the next
+		// byte written, patch() overwrites the data at that position
+		// once it is known. Supported only if patchable() is true,
+		// i.e. the data is not sent out before the write is complete.
+		size_t mark() const;
+		void patch(size_t pos, const void* data, size_t length);
+		virtual bool patchable() const;
 
 		// move data from another buffer into this one
 		void move(ReadableSerializationBuffer& other);
 		// move part of data from another buffer into this one
 		void move(ReadableSerializationBuffer& other, size_t length);
+		// copy part of data from another buffer (starting at pos)
+		// into this one, leaving it in place
+		void copy(ReadableSerializationBuffer& other, size_t pos, size_t length);
 	};
 
 	// Serializes buffer that uses private memory storage for underlying
@@ -65,6 +137,40 @@ namespace opc_ua
 		MemorySerializationBuffer();
 		~MemorySerializationBuffer();
 	};
+
+	// Write the data queued in the output of a socket bufferevent out
+	// right away, rather than when the event loop finds the socket
+	// writable. Returns the amount written, or -1 on error; errors
+	// are passed to the event callback of the bufferevent from the
+	// event loop (BEV_EVENT_WRITING | BEV_EVENT_ERROR).
+	int write_out(bufferevent* bev);
+
+	// Monotonic time (for timeouts), in ms.
+	uint64_t clock_ms();
+
+	// inline fast paths
+	inline void ReadableSerializationBuffer::read(void* data, size_t length)
+	{
+		if (window && length <= window_len - window_pos)
+		{
+			std::memcpy(data, window + window_pos, length);
+			window_pos += length;
+		}
+		else
+			read_buffer(data, length);
+	}
+
+	inline void WritableSerializationBuffer::write(const void* data, size_t length)
+	{
+		if (length <= extent.iov_len - extent_used)
+		{
+			std::memcpy(static_cast<unsigned char*>(extent.iov_base) + extent_used,
+					data, length);
+			extent_used += length;
+		}
+		else
+			write_buffer(data, length);
+	}
 };
 
 #endif /*OPCUA_COMMON_UTIL_HXX*/
@@ -0,0 +1,39 @@
+/* OPC UA protocol implementation
+ * (c) 2014 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "future.hxx"
+
+opc_ua::tcp::FutureGroup::FutureGroup()
+	: pending(0)
+{
+}
+
+void opc_ua::tcp::FutureGroup::completed()
+{
+	if (--pending == 0 && continuation)
+	{
+		std::function<void()> f = std::move(continuation);
+
+		continuation = nullptr;
+		f();
+	}
+}
+
+size_t opc_ua::tcp::FutureGroup::size() const
+{
+	return pending;
+}
+
+void opc_ua::tcp::FutureGroup::then(std::function<void()> f)
+{
+	if (pending == 0)
+		f();
+	else
+		continuation = std::move(f);
+}
@@ -0,0 +1,188 @@
+/* OPC UA protocol implementation
+ * (c) 2014 Michał Górny
+ * Licensed under the terms of the 2-clause BSD license
+ */
+
+#pragma once
+
+#ifndef OPCUA_TCP_FUTURE_HXX
+#define OPCUA_TCP_FUTURE_HXX 1
+
+#include <opcua/common/struct.hxx>
+
+#include <functional>
+#include <memory>
+
+namespace opc_ua
+{
+	namespace tcp
+	{
+		class FutureGroup;
+		class SessionStream;
+
+		// Result of a request sent with SessionStream::write_message(),
+		// completed from the event loop. The future is owned by the
+		// caller and has to stay in place until it completes: with
+		// the response, a timeout fault or, at the latest, a fault when
+		// the SessionStream is destroyed (requests without a timeout
+		// can otherwise wait forever). It can be reused for another
+		// request afterwards. Continuations and groups are attached
+		// after sending the request, and are released on completion.
+		template <class T>
+		class Future
+		{
+		public:
+			typedef std::function<void(Future&)> continuation_type;
+
+		private:
+			std::unique_ptr<T> response;
+			StatusCode result;
+			bool done;
+
+			continuation_type continuation;
+			FutureGroup* group;
+
+			// request_callback_type for SessionStream
+			static void complete(std::unique_ptr<Response> msg, void* data);
+			// prepare for a new request
+			void reset();
+
+			friend class FutureGroup;
+			friend class SessionStream;
+
+		public:
+			Future();
+
+			Future(const Future&) = delete;
+			Future& operator=(const Future&) = delete;
+
+			// Was the response (or fault) received yet?
+			bool is_ready() const;
+			// Service result of the response, or the fault status.
+			StatusCode status() const;
+			// The response, or nullptr if the request failed.
+			T* get();
+			// Take the response over.
+			std::unique_ptr<T> take();
+
+			// Call f(*this) on completion (or immediately, if ready).
+			void then(continuation_type f);
+		};
+
+		// Join point for a number of futures: the continuation is called
+		// once all the futures added have completed.
+		class FutureGroup
+		{
+			size_t pending;
+			std::function<void()> continuation;
+
+			template <class T>
+			friend class Future;
+
+			void completed();
+
+		public:
+			FutureGroup();
+
+			FutureGroup(const FutureGroup&) = delete;
+			FutureGroup& operator=(const FutureGroup&) = delete;
+
+			// Wait for the future too (ignored if it is ready).
+			template <class T>
+			void add(Future<T>& f);
+			// Number of futures not completed yet.
+			size_t size() const;
+
+			// Call f() once all futures complete (or immediately,
+			// if they have already).
+			void then(std::function<void()> f);
+		};
+
+		template <class T>
+		Future<T>::Future()
+			: result(status::Good), done(false), group(nullptr)
+		{
+		}
+
+		template <class T>
+		void Future<T>::reset()
+		{
+			response.reset();
+			result = status::Good;
+			done = false;
+		}
+
+		template <class T>
+		void Future<T>::complete(std::unique_ptr<Response> msg, void* data)
+		{
+			Future* self = static_cast<Future*>(data);
+
+			self->result = msg->response_header.service_result;
+			// faults (and unexpected responses) leave no response
+			if (msg->get_node_id() == UInt32(T::NODE_ID))
+				self->response.reset(static_cast<T*>(msg.release()));
+			else if (msg->get_node_id() != UInt32(ServiceFault::NODE_ID)
+					|| self->result == status::Good)
+				self->result = status::Bad_UnknownResponse;
+			self->done = true;
+
+			// (both can be reset by the continuation, if it reuses
+			// the future, and the group may be gone once its own
+			// continuation runs)
+			continuation_type f = std::move(self->continuation);
+			FutureGroup* g = self->group;
+			self->continuation = nullptr;
+			self->group = nullptr;
+
+			if (f)
+				f(*self);
+			if (g)
+				g->completed();
+		}
+
+		template <class T>
+		bool Future<T>::is_ready() const
+		{
+			return done;
+		}
+
+		template <class T>
+		StatusCode Future<T>::status() const
+		{
+			return result;
+		}
+
+		template <class T>
+		T* Future<T>::get()
+		{
+			return response.get();
+		}
+
+		template <class T>
+		std::unique_ptr<T> Future<T>::take()
+		{
+			return std::move(response);
+		}
+
+		template <class T>
+		void Future<T>::then(continuation_type f)
+		{
+			if (done)
+				f(*this);
+			else
+				continuation = std::move(f);
+		}
+
+		template <class T>
+		void FutureGroup::add(Future<T>& f)
+		{
+			if (f.done)
+				return;
+
+			f.group = this;
+			++pending;
+		}
+	};
+};
+
+#endif /*OPCUA_TCP_FUTURE_HXX*/
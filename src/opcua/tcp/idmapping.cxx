@@ -20,6 +20,7 @@ const opc_ua::tcp::NodeIdMappingType opc_ua::tcp::id_mapping{
 	{SignedSoftwareCertificate::NODE_ID, 346},
 	{RequestHeader::NODE_ID, 391},
 	{ResponseHeader::NODE_ID, 394},
+	{ServiceFault::NODE_ID, 397},
 	{ChannelSecurityToken::NODE_ID, 443},
 	{OpenSecureChannelRequest::NODE_ID, 446},
 	{OpenSecureChannelResponse::NODE_ID, 449},
@@ -9,28 +9,48 @@
 
 #include "server.hxx"
 
+#include <opcua/common/random.hxx>
 #include <opcua/tcp/idmapping.hxx>
 
+#include <event2/thread.h>
+
+#include <algorithm>
 #include <cassert>
-#include <random>
+#include <cstring>
+#include <stdexcept>
+#include <tuple>
 
 // TODO?
 const opc_ua::UInt32 opc_ua::tcp::server_namespace_index = 1;
 
-opc_ua::UInt32 opc_ua::tcp::ServerMessageStream::sequence_number = 0;
-opc_ua::UInt32 opc_ua::tcp::ServerMessageStream::next_request_id = 0;
-opc_ua::UInt32 opc_ua::tcp::ServerTransportStream::next_secure_channel_id = 1;
+std::atomic<opc_ua::UInt32> opc_ua::tcp::ServerTransportStream::next_secure_channel_id(1);
+
+// session timeout granularity (ms) & wheel size (~4 min per turn)
+static const uint64_t session_tick = 1000;
+static const size_t session_wheel_slots = 256;
+
+static uint64_t session_tick_at(uint64_t t)
+{
+	// round up, so that the session is expired by then
+	return (t + session_tick - 1) / session_tick;
+}
 
 opc_ua::tcp::ServerTransportStream::ServerTransportStream(Server& serv, event_base* ev, evutil_socket_t sock)
 	: server(serv),
 	bev(bufferevent_socket_new(ev, sock, BEV_OPT_CLOSE_ON_FREE)),
 	in_ctx(bufferevent_get_input(bev)),
 	out_ctx(bufferevent_get_output(bev)),
-	connected(false), got_header(false)
+	connected(false), got_header(false), read_paused(false),
+	pending_response(nullptr),
+	remote_limits(libevent_protocol_info),
+	local_limits(libevent_protocol_info),
+	connection_id(no_connection_id)
 {
 	assert(bev);
 
-	bufferevent_setcb(bev, read_handler, 0, event_handler, this);
+	bufferevent_setcb(bev, read_handler, write_handler, event_handler, this);
+	// get write_handler() called once the backlog drains to the low mark
+	bufferevent_setwatermark(bev, EV_WRITE, serv.config.output_low_watermark, 0);
 	bufferevent_enable(bev, EV_READ);
 }
 
@@ -39,152 +59,466 @@ opc_ua::tcp::ServerTransportStream::~ServerTransportStream()
 	bufferevent_free(bev);
 }
 
+event_base* opc_ua::tcp::ServerTransportStream::base() const
+{
+	return bufferevent_get_base(bev);
+}
+
+size_t opc_ua::tcp::ServerTransportStream::output_backlog() const
+{
+	return evbuffer_get_length(bufferevent_get_output(bev));
+}
+
 void opc_ua::tcp::Server::handle_connection(evconnlistener* listener,
 					evutil_socket_t sock, sockaddr* addr, int socklen, void* data)
 {
-	Server* self = static_cast<Server*>(data);
+	Reactor* r = static_cast<Reactor*>(data);
 
-	self->connections.emplace_front(*self, evconnlistener_get_base(self->listener), sock);
+	size_t id = r->connections.emplace(r->server, r->base, sock);
+	r->connections[id].connection_id = id;
 }
 
-opc_ua::tcp::Server::Server(event_base* ev, AddressSpace& as)
-	: address_space(as)
+opc_ua::tcp::ServerConfig::ServerConfig()
+	: cached_clock(true), listen_addresses{"0.0.0.0:6001"},
+	worker_threads(0), flush_threshold(65536),
+	output_high_watermark(0x400000), output_low_watermark(0x100000),
+	chunks_per_turn(4),
+	min_session_timeout(10000), max_session_timeout(3600000),
+	max_cached_request_size(65536),
+	max_array_length(BinarySerializer::default_max_array_length)
 {
-	sockaddr_in addr = sockaddr_in();
+}
 
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(6001);
-	addr.sin_addr = {INADDR_ANY};
+opc_ua::tcp::Server::Reactor::Reactor(Server& serv, event_base* ev, bool own_base)
+	: server(serv), base(ev), owns_base(own_base), scheduler(nullptr)
+{
+	if (!base)
+		throw std::runtime_error("Unable to create event base");
 
-	listener = evconnlistener_new_bind(ev,
-			handle_connection, this,
-			LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
-			reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+	scheduler = evtimer_new(base, run_scheduled, this);
+	if (!scheduler)
+	{
+		if (owns_base)
+			event_base_free(base);
+		throw std::runtime_error("Unable to create scheduler event");
+	}
+}
 
-	assert(listener);
+opc_ua::tcp::Server::Reactor::~Reactor()
+{
+	// connections use the base, so they need to go first
+	connections.clear();
+	event_free(scheduler);
+	for (evconnlistener* l : listeners)
+		evconnlistener_free(l);
+	if (owns_base)
+		event_base_free(base);
 }
 
-opc_ua::CreateSessionResponse opc_ua::tcp::Server::create_session(const CreateSessionRequest& csr)
+void opc_ua::tcp::Server::Reactor::run_scheduled(evutil_socket_t fd, short what, void* data)
 {
-	CreateSessionResponse resp;
-	sessions.emplace_front(*this, csr, resp);
-	return resp;
+	Reactor* r = static_cast<Reactor*>(data);
+
+	// one turn for every connection queued so far, the ones queued
+	// meanwhile (or not done yet) wait for the next round
+	for (size_t n = r->run_queue.size(); n > 0 && !r->run_queue.empty(); --n)
+	{
+		ServerTransportStream* s = r->run_queue.front();
+		r->run_queue.pop_front();
+
+		// s may be gone once run_turn() returns false
+		if (s->run_turn())
+			r->run_queue.push_back(s);
+	}
+
+	// the zero timeout gets the pending I/O processed first
+	if (!r->run_queue.empty())
+	{
+		timeval tv = {0, 0};
+		evtimer_add(r->scheduler, &tv);
+	}
+}
+
+void opc_ua::tcp::Server::Reactor::listen(const std::string& address)
+{
+	sockaddr_storage addr;
+	int addr_len = sizeof(addr);
+
+	if (evutil_parse_sockaddr_port(address.c_str(),
+				reinterpret_cast<sockaddr*>(&addr), &addr_len))
+		throw std::runtime_error("Invalid listen address: " + address);
+
+	unsigned int flags = LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE;
+	// let IPv4 & IPv6 wildcard listeners coexist
+	if (addr.ss_family == AF_INET6)
+		flags |= LEV_OPT_BIND_IPV6ONLY;
+	// the kernel distributes connections between the listeners
+	// bound to the same address by all reactors
+	if (server.config.worker_threads > 0)
+		flags |= LEV_OPT_REUSEABLE_PORT;
+
+	evconnlistener* l = evconnlistener_new_bind(base,
+			handle_connection, this, flags, -1,
+			reinterpret_cast<sockaddr*>(&addr), addr_len);
+	if (!l)
+		throw std::runtime_error("Unable to listen on " + address);
+
+	listeners.push_back(l);
+}
+
+opc_ua::tcp::Server::Server(event_base* ev, AddressSpace& as, const ServerConfig& cfg)
+	: session_timers(session_wheel_slots, clock_ms() / session_tick),
+	session_timer(event_new(ev, -1, EV_PERSIST, expire_sessions, this)),
+	address_space(as), config(cfg)
+{
+	if (!session_timer)
+		throw std::runtime_error("Unable to create session timer");
+
+	// (added once, the workers never touch the main event loop)
+	timeval tv = {session_tick / 1000, 0};
+	if (evtimer_add(session_timer, &tv) == -1)
+	{
+		event_free(session_timer);
+		throw std::runtime_error("Unable to start session timer");
+	}
+
+	// worker bases need locking to be stopped from the destructor
+	if (config.worker_threads > 0 && evthread_use_pthreads())
+		throw std::runtime_error("Unable to enable libevent threading support");
+
+	reactors.emplace_front(*this, ev, false);
+	for (unsigned int i = 0; i < config.worker_threads; ++i)
+		reactors.emplace_front(*this, event_base_new(), true);
+
+	for (Reactor& r : reactors)
+	{
+		for (const std::string& addr : config.listen_addresses)
+			r.listen(addr);
+	}
+
+	// start the workers once the reactor list is complete
+	for (Reactor& r : reactors)
+	{
+		if (r.owns_base)
+			r.thread = std::thread(event_base_loop, r.base, EVLOOP_NO_EXIT_ON_EMPTY);
+	}
 }
 
-opc_ua::tcp::ServerSessionStream& opc_ua::tcp::Server::activate_session(const ActivateSessionRequest& asr, ServerMessageStream& ms, UInt32 request_id)
+opc_ua::tcp::Server::~Server()
 {
-	for (auto& s : sessions)
+	for (Reactor& r : reactors)
 	{
-		// TODO: we should actually match using signatures...
-		if (asr.request_header.authentication_token == s.authentication_token)
+		if (r.thread.joinable())
 		{
-			s.attach(ms, asr, request_id);
-			return s;
+			event_base_loopbreak(r.base);
+			r.thread.join();
 		}
 	}
 
-	throw std::runtime_error("Attempt to activate non-existing session");
+	event_free(session_timer);
+}
+
+void opc_ua::tcp::Server::expire_sessions(evutil_socket_t fd, short what, void* data)
+{
+	Server* serv = static_cast<Server*>(data);
+	std::lock_guard<std::mutex> lock(serv->sessions_mutex);
+	uint64_t now = clock_ms();
+
+	serv->session_timers.advance(now / session_tick, [serv, now] (const NodeId& token) {
+		auto it = serv->sessions.find(token);
+
+		// closed meanwhile
+		if (it == serv->sessions.end())
+			return;
+
+		// touched meanwhile, check again later
+		uint64_t expiry = it->second->expiry();
+		if (expiry > now)
+		{
+			serv->session_timers.add(session_tick_at(expiry), token);
+			return;
+		}
+
+		it->second->close();
+		serv->sessions.erase(it);
+	});
+}
+
+opc_ua::CreateSessionResponse opc_ua::tcp::Server::create_session(const CreateSessionRequest& csr)
+{
+	CreateSessionResponse resp;
+	std::shared_ptr<ServerSessionStream> ss
+		= std::make_shared<ServerSessionStream>(*this, csr, resp);
+
+	std::lock_guard<std::mutex> lock(sessions_mutex);
+	sessions.emplace(ss->authentication_token, ss);
+	session_timers.add(session_tick_at(ss->expiry()), ss->authentication_token);
+	return resp;
+}
+
+std::shared_ptr<opc_ua::tcp::ServerSessionStream> opc_ua::tcp::Server::activate_session(const ActivateSessionRequest& asr, ServerMessageStream& ms, ActivateSessionResponse& resp)
+{
+	std::lock_guard<std::mutex> lock(sessions_mutex);
+	// TODO: we should actually match using signatures...
+	auto it = sessions.find(asr.request_header.authentication_token);
+
+	if (it == sessions.end())
+		return nullptr;
+
+	it->second->attach(ms, asr, resp);
+	return it->second;
+}
+
+void opc_ua::tcp::Server::detach_session(ServerSessionStream& ss, ServerMessageStream& ms)
+{
+	std::lock_guard<std::mutex> lock(sessions_mutex);
+	ss.detach(ms);
+}
+
+void opc_ua::tcp::Server::close_session(ServerSessionStream& ss)
+{
+	std::lock_guard<std::mutex> lock(sessions_mutex);
+	// (the timer is dropped when it fires)
+	ss.close();
+	sessions.erase(ss.authentication_token);
+}
+
+opc_ua::DateTime opc_ua::tcp::Server::now(event_base* ev) const
+{
+	if (!config.cached_clock)
+		return DateTime::now();
+
+	timeval tv;
+	if (event_base_gettimeofday_cached(ev, &tv) == -1)
+		return DateTime::now();
+
+	timespec ts;
+	ts.tv_sec = tv.tv_sec;
+	ts.tv_nsec = tv.tv_usec * 1000;
+	return DateTime(ts);
+}
+
+opc_ua::tcp::Server::Reactor* opc_ua::tcp::Server::find_reactor(event_base* ev)
+{
+	for (Reactor& r : reactors)
+	{
+		if (r.base == ev)
+			return &r;
+	}
+	return nullptr;
 }
 
 void opc_ua::tcp::Server::handle_disconnect(ServerTransportStream* s)
 {
-	connections.remove_if([s] (const ServerTransportStream& ls) {return &ls == s;});
+	Reactor* r = find_reactor(s->base());
+
+	if (r)
+	{
+		r->run_queue.erase(std::remove(r->run_queue.begin(), r->run_queue.end(), s),
+				r->run_queue.end());
+		// (streams created outside the listeners are not registered)
+		size_t id = s->connection_id;
+		if (r->connections.contains(id) && &r->connections[id] == s)
+			r->connections.erase(id);
+	}
 }
 
-void opc_ua::tcp::ServerTransportStream::read_handler(bufferevent* bev, void* ctx)
+bool opc_ua::tcp::Server::schedule(ServerTransportStream* s)
 {
-	BinarySerializer srl;
-	ServerTransportStream* s = static_cast<ServerTransportStream*>(ctx);
+	Reactor* r = find_reactor(s->base());
+
+	if (!r)
+		return false;
 
-	if (!s->got_header)
+	r->run_queue.push_back(s);
+	if (!evtimer_pending(r->scheduler, nullptr))
 	{
-		// wait for complete header
-		if (s->in_ctx.size() < s->h.serialized_length)
-			return;
+		timeval tv = {0, 0};
+		evtimer_add(r->scheduler, &tv);
+	}
+	return true;
+}
 
-		srl.unserialize(s->in_ctx, s->h);
-		s->got_header = true;
+void opc_ua::tcp::ServerTransportStream::read_handler(bufferevent* bev, void* ctx)
+{
+	ServerTransportStream* s = static_cast<ServerTransportStream*>(ctx);
 
-		// pass-through in case we got the message body too
+	try
+	{
+		process_input(s);
+	}
+	catch (TransportError& e)
+	{
+		s->close_with_error(e.status, e.what());
 	}
+	catch (std::exception& e)
+	{
+		s->close_with_error(status::Bad_TcpInternalError, e.what());
+	}
+}
 
-	// wait for complete body
-	if (s->in_ctx.size() < s->h.message_size - s->h.serialized_length)
-		return;
+void opc_ua::tcp::ServerTransportStream::close_with_error(StatusCode error, const String& reason)
+{
+	MemorySerializationBuffer out_buf;
+	BinarySerializer srl;
+	ErrorMessage err = {
+		.error = error,
+		.reason = reason,
+	};
+	srl.serialize(out_buf, err);
+	write_message(MessageType::ERR, MessageIsFinal::FINAL, out_buf);
+
+	// the connection goes away right now, so try to get the error
+	// through before that
+	write_out(bev);
+	server.handle_disconnect(this);
+}
 
-	MemorySerializationBuffer buf;
-	buf.move(s->in_ctx, s->h.message_size - s->h.serialized_length);
+void opc_ua::tcp::ServerTransportStream::process_input(ServerTransportStream* s)
+{
+	BinarySerializer srl;
 
-	// process the message
-	switch (s->h.message_type)
+	// process every complete frame buffered so far, anything written
+	// meanwhile goes out together once the socket becomes writable
+	// (unless the backlog grows too large, then the remaining frames
+	// wait for write_handler(); or a response is continued from
+	// the scheduler, then they wait for it to complete)
+	while (!s->read_paused && !s->pending_response)
 	{
-		case MessageType::HEL:
+		if (!s->got_header)
 		{
-			HelloMessage hel;
-			srl.unserialize(buf, hel);
-			s->remote_limits = hel.protocol_info;
+			// wait for complete header
+			if (s->in_ctx.size() < s->h.serialized_length)
+				break;
 
-			MemorySerializationBuffer out_buf;
-			AcknowledgeMessage ack;
-			ack.protocol_info = libevent_protocol_info;
-			srl.serialize(out_buf, ack);
-			s->write_message(MessageType::ACK, MessageIsFinal::FINAL, out_buf);
+			srl.unserialize(s->in_ctx, s->h);
+			s->got_header = true;
 
-			s->connected = true;
-			break;
-		}
+			// refuse oversized chunks before buffering their body
+			if (s->h.message_size > s->local_limits.receive_buffer_size)
+				throw TransportError(status::Bad_TcpMessageTooLarge, "Chunk size limit exceeded");
+			if (s->h.message_size < s->h.serialized_length)
+				throw TransportError(status::Bad_CommunicationError, "Invalid message size");
 
-		// XXX: can client send it?
-		case MessageType::ERR:
-		{
-			ErrorMessage err;
-			srl.unserialize(buf, err);
+			// pass-through in case we got the message body too
+		}
 
-			throw std::runtime_error("ERR message received");
+		// wait for complete body
+		if (s->in_ctx.size() < s->h.message_size - s->h.serialized_length)
 			break;
-		}
 
-		case MessageType::OPN:
+		MemorySerializationBuffer buf;
+		buf.move(s->in_ctx, s->h.message_size - s->h.serialized_length);
+		// decode the whole message from a contiguous region
+		buf.pullup();
+
+		// process the message
+		switch (s->h.message_type)
 		{
-			UInt32 secure_channel_id;
-			srl.unserialize(buf, secure_channel_id);
+			case MessageType::HEL:
+			{
+				HelloMessage hel;
+				srl.unserialize(buf, hel);
+
+				const ProtocolInfo& hel_limits = hel.protocol_info;
+				if (hel_limits.receive_buffer_size < 8192 || hel_limits.send_buffer_size < 8192)
+					throw TransportError(status::Bad_CommunicationError, "Buffer size below the 8192 byte minimum");
+
+				MemorySerializationBuffer out_buf;
+				AcknowledgeMessage ack;
+				ack.protocol_info = libevent_protocol_info;
+				// chunks can not be larger than the sender can send
+				// or the receiver can receive
+				ack.protocol_info.receive_buffer_size = std::min(
+						ack.protocol_info.receive_buffer_size, hel_limits.send_buffer_size);
+				ack.protocol_info.send_buffer_size = std::min(
+						ack.protocol_info.send_buffer_size, hel_limits.receive_buffer_size);
+				s->local_limits = ack.protocol_info;
+				s->remote_limits = hel_limits;
+				s->remote_limits.receive_buffer_size = ack.protocol_info.send_buffer_size;
+				srl.serialize(out_buf, ack);
+				s->write_message(MessageType::ACK, MessageIsFinal::FINAL, out_buf);
+
+				s->connected = true;
+				break;
+			}
 
-			secure_channel_id = next_secure_channel_id++;
-			s->secure_channels.emplace(secure_channel_id,
-					std::move(ServerMessageStream{s->server, *s}));
-			s->secure_channels.at(secure_channel_id).process_secure_channel_request(buf, secure_channel_id);
-			break;
-		}
+			// XXX: can client send it?
+			case MessageType::ERR:
+			{
+				ErrorMessage err;
+				srl.unserialize(buf, err);
 
-		case MessageType::CLO:
-		case MessageType::MSG:
-		{
-			UInt32 secure_channel_id;
-			srl.unserialize(buf, secure_channel_id);
+				throw std::runtime_error("ERR message received");
+				break;
+			}
 
-			s->secure_channels.at(secure_channel_id).handle_message(s->h, buf);
-			break;
+			case MessageType::OPN:
+			{
+				UInt32 secure_channel_id;
+				srl.unserialize(buf, secure_channel_id);
+
+				secure_channel_id = next_secure_channel_id++;
+				s->secure_channels.emplace(std::piecewise_construct,
+						std::forward_as_tuple(secure_channel_id),
+						std::forward_as_tuple(s->server, *s));
+				s->secure_channels.at(secure_channel_id).process_secure_channel_request(buf, secure_channel_id);
+				break;
+			}
+
+			case MessageType::CLO:
+			case MessageType::MSG:
+			{
+				UInt32 secure_channel_id;
+				srl.unserialize(buf, secure_channel_id);
+
+				s->secure_channels.at(secure_channel_id).handle_message(s->h, buf);
+
+				// (no response, the client closes the connection
+				// next; any session stays for reactivation)
+				if (s->h.message_type == MessageType::CLO
+						&& s->h.is_final == MessageIsFinal::FINAL)
+					s->secure_channels.erase(secure_channel_id);
+				break;
+			}
+
+			default:
+				assert(not_reached);
 		}
 
-		default:
-			assert(not_reached);
+		if (buf.size() != 0)
+			throw std::runtime_error("Part of message not unserialized");
+
+		// prepare for the next message
+		s->got_header = false;
 	}
+}
 
-	if (buf.size() != 0)
-		throw std::runtime_error("Part of message not unserialized");
+void opc_ua::tcp::ServerTransportStream::write_handler(bufferevent* bev, void* ctx)
+{
+	ServerTransportStream* s = static_cast<ServerTransportStream*>(ctx);
 
-	// prepare for the next message
-	s->got_header = false;
+	if (s->read_paused)
+	{
+		s->read_paused = false;
+		bufferevent_enable(bev, EV_READ);
+		// continue the pending response first, process the frames
+		// that were already received otherwise
+		if (s->pending_response)
+			s->schedule();
+		if (!s->pending_response)
+			read_handler(bev, ctx);
+	}
 }
 
 void opc_ua::tcp::ServerTransportStream::event_handler(bufferevent* bev, short what, void* ctx)
 {
 	ServerTransportStream* s = static_cast<ServerTransportStream*>(ctx);
 
-	if (what & BEV_EVENT_EOF)
+	// a connection reset is handled like an orderly close (throwing
+	// here would unwind through the event loop of the whole reactor)
+	if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
 		s->server.handle_disconnect(s);
-	if (what & BEV_EVENT_ERROR)
-		throw std::runtime_error("Server transport stream error");
 }
 
 void opc_ua::tcp::ServerTransportStream::write_message(MessageType msg_type, MessageIsFinal is_final, ReadableSerializationBuffer& msg, UInt32 channel_id)
@@ -221,26 +555,303 @@ void opc_ua::tcp::ServerTransportStream::write_message(MessageType msg_type, Mes
 	}
 
 	out_ctx.move(msg);
+	out_ctx.commit();
+
+	output_appended();
+}
+
+void opc_ua::tcp::ServerTransportStream::output_appended()
+{
+	// the bufferevent writes everything queued at once (using writev())
+	// when the event loop finds the socket writable; write out large
+	// backlogs early rather than letting a single burst pile up
+	if (server.config.flush_threshold && output_backlog() >= server.config.flush_threshold)
+		write_out(bev);
+
+	// stop taking new requests from a client that does not keep up
+	// with the responses
+	if (server.config.output_high_watermark && !read_paused
+			&& output_backlog() > server.config.output_high_watermark)
+	{
+		read_paused = true;
+		bufferevent_disable(bev, EV_READ);
+	}
+}
+
+void opc_ua::tcp::ServerTransportStream::schedule()
+{
+	// a stream outside of the server reactors completes
+	// the response right away
+	if (!server.schedule(this))
+	{
+		while (!pending_response->continue_read())
+			;
+		pending_response = nullptr;
+	}
+}
+
+void opc_ua::tcp::ServerTransportStream::defer_response(ServerMessageStream& ms)
+{
+	pending_response = &ms;
+	// a client that does not keep up gets scheduled from
+	// write_handler() once its backlog drains
+	if (!read_paused)
+		schedule();
+}
+
+bool opc_ua::tcp::ServerTransportStream::run_turn()
+{
+	// wait for write_handler()
+	if (read_paused)
+		return false;
+
+	try
+	{
+		if (!pending_response->continue_read())
+			return !read_paused;
+	}
+	catch (std::exception& e)
+	{
+		// (the message was aborted already)
+		pending_response = nullptr;
+		close_with_error(status::Bad_TcpInternalError, e.what());
+		return false;
+	}
+
+	// continue with the frames received meanwhile (this may
+	// close the connection)
+	pending_response = nullptr;
+	read_handler(bev, this);
+	return false;
+}
+
+opc_ua::tcp::ServerChunkWriter::ServerChunkWriter(ServerTransportStream& new_ts)
+	: SerializationBuffer(evbuffer_new()),
+	WritableSerializationBuffer(nullptr),
+// Note: nullptr is not used because of the virtual inheritance,
+// see MemorySerializationBuffer.
+	ts(new_ts), sequence_number(nullptr)
+{
+}
+
+opc_ua::tcp::ServerChunkWriter::~ServerChunkWriter()
+{
+	evbuffer_free(buf);
+}
+
+void opc_ua::tcp::ServerChunkWriter::begin(MessageType type,
+		UInt32 secure_channel_id, const std::vector<Byte>& sech,
+		UInt32& seq_number, UInt32 req_id)
+{
+	const ProtocolInfo& limits = ts.remote_limits;
+
+	msg_type = type;
+	channel_id = secure_channel_id;
+	security_header = sech;
+	sequence_number = &seq_number;
+	request_id = req_id;
+
+	chunk_size = limits.receive_buffer_size;
+	max_chunk_count = limits.max_chunk_count;
+	max_message_size = limits.max_message_size;
+	chunk_count = 0;
+	body_length = 0;
+
+	begin_chunk();
+}
+
+void opc_ua::tcp::ServerChunkWriter::begin_chunk()
+{
+	BinarySerializer srl;
+
+	// the chunk is built in space reserved in the private buffer,
+	// which is never committed, so the same space is reused for
+	// every chunk
+	if (evbuffer_reserve_space(buf, chunk_size, &extent, 1) != 1)
+		throw std::runtime_error("Failure reserving space in buffer");
+	// keep the fast write path within the chunk
+	extent.iov_len = chunk_size;
+
+	// the size & IsFinal are patched in end_chunk()
+	SecureConversationMessageHeader h;
+	h.message_type = msg_type;
+	h.is_final = MessageIsFinal::INTERMEDIATE;
+	h.message_size = 0;
+	h.secure_channel_id = channel_id;
+	srl.serialize(*this, h);
+
+	write(security_header.data(), security_header.size());
+
+	SequenceHeader seqh = {
+		.sequence_number = (*sequence_number)++,
+		.request_id = request_id,
+	};
+	srl.serialize(*this, seqh);
 
-	bufferevent_flush(bev, EV_WRITE, BEV_FLUSH);
+	header_length = extent_used;
+}
+
+void opc_ua::tcp::ServerChunkWriter::end_chunk(MessageIsFinal is_final)
+{
+	unsigned char* h = static_cast<unsigned char*>(extent.iov_base);
+
+	// the client would refuse the response, check before anything
+	// is changed so that the chunk can be aborted still
+	if (is_final != MessageIsFinal::ABORTED)
+	{
+		size_t new_length = body_length + extent_used - header_length;
+
+		if (max_message_size && new_length > max_message_size)
+			throw TransportError(status::Bad_ResponseTooLarge,
+					"Response exceeds the message size limit");
+		if (max_chunk_count && is_final == MessageIsFinal::INTERMEDIATE
+				&& chunk_count + 1 >= max_chunk_count)
+			throw TransportError(status::Bad_ResponseTooLarge,
+					"Response exceeds the chunk count limit");
+
+		body_length = new_length;
+	}
+
+	// (offsets as in MessageHeader)
+	h[3] = static_cast<unsigned char>(is_final);
+	for (int i = 0; i < 4; ++i)
+		h[4 + i] = extent_used >> (8 * i);
+
+	// copy it, so that the output holds only the data (a small
+	// response would pin the whole reserved chunk otherwise)
+	if (evbuffer_add(bufferevent_get_output(ts.bev), extent.iov_base, extent_used) == -1)
+		throw std::runtime_error("Failure appending to buffer");
+	extent_used = 0;
+	++chunk_count;
+
+	ts.output_appended();
+}
+
+void opc_ua::tcp::ServerChunkWriter::write_buffer(const void* data, size_t length)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+
+	// fill the current chunk up and continue in the next one
+	while (length > extent.iov_len - extent_used)
+	{
+		size_t part = extent.iov_len - extent_used;
+
+		std::memcpy(static_cast<unsigned char*>(extent.iov_base) + extent_used, p, part);
+		extent_used += part;
+		p += part;
+		length -= part;
+
+		end_chunk(MessageIsFinal::INTERMEDIATE);
+		begin_chunk();
+	}
+
+	std::memcpy(static_cast<unsigned char*>(extent.iov_base) + extent_used, p, length);
+	extent_used += length;
+}
+
+void opc_ua::tcp::ServerChunkWriter::finish()
+{
+	end_chunk(MessageIsFinal::FINAL);
+}
+
+void opc_ua::tcp::ServerChunkWriter::abort(StatusCode error, const String& reason)
+{
+	BinarySerializer srl;
+
+	// drop the chunk in progress, along with its sequence number
+	extent_used = 0;
+	--*sequence_number;
+
+	begin_chunk();
+	srl.serialize(*this, error);
+	srl.serialize(*this, reason);
+	end_chunk(MessageIsFinal::ABORTED);
+}
+
+size_t opc_ua::tcp::ServerChunkWriter::chunks_sent() const
+{
+	return chunk_count;
+}
+
+bool opc_ua::tcp::ServerChunkWriter::patchable() const
+{
+	return false;
+}
+
+opc_ua::tcp::RequestCache::RequestCache(size_t max_request_size)
+	: max_size(max_request_size)
+{
+}
+
+opc_ua::Struct& opc_ua::tcp::RequestCache::get(UInt32 base_id, size_t encoded_size)
+{
+	std::unique_ptr<Struct>& msg = encoded_size > max_size
+		? oversized : cache[base_id];
+
+	if (!msg || msg->get_node_id() != base_id)
+		msg.reset(struct_constructors.at(base_id)());
+	return *msg;
+}
+
+void opc_ua::tcp::RequestCache::release()
+{
+	oversized.reset();
+}
+
+size_t opc_ua::tcp::RequestCache::size() const
+{
+	return cache.size();
 }
 
 opc_ua::tcp::ServerMessageStream::ServerMessageStream(Server& serv, ServerTransportStream& new_ts)
-	: server(serv), ts(new_ts), attached_session(nullptr)
+	: server(serv), ts(new_ts),
+	sequence_number(1), request_cache(serv.config.max_cached_request_size),
+	out(new_ts), pending_read(nullptr)
 {
 }
 
 opc_ua::tcp::ServerMessageStream::~ServerMessageStream()
 {
 	if (attached_session)
-		attached_session->detach();
+		server.detach_session(*attached_session, *this);
 }
 
-void opc_ua::tcp::ServerMessageStream::write_message(Response& msg, UInt32 request_id, MessageType msg_type)
+void opc_ua::tcp::ServerMessageStream::write_fault(const Request& req, UInt32 request_id, StatusCode status)
+{
+	ServiceFault fault;
+
+	fault.response_header.request_handle = req.request_header.request_handle;
+	fault.response_header.service_result = status;
+	write_message(fault, request_id);
+}
+
+bool opc_ua::tcp::ServerMessageStream::check_session(const Request& req, UInt32 request_id)
+{
+	// expired, or closed through another channel
+	if (attached_session && attached_session->is_closed())
+	{
+		server.detach_session(*attached_session, *this);
+		attached_session.reset();
+	}
+
+	if (!attached_session
+			|| req.request_header.authentication_token != attached_session->authentication_token)
+	{
+		write_fault(req, request_id, status::Bad_SessionIdInvalid);
+		return false;
+	}
+
+	attached_session->touch();
+	return true;
+}
+
+void opc_ua::tcp::ServerMessageStream::begin_response(UInt32 request_id, MessageType msg_type)
 {
-	MemorySerializationBuffer headers, body;
+	MemorySerializationBuffer headers;
 	BinarySerializer srl;
 
+	assert(!pending_read);
+
 	// OPN message takes asymmetric header
 	// MSG & CLO take symmetric header
 	if (msg_type == MessageType::OPN)
@@ -260,44 +871,152 @@ void opc_ua::tcp::ServerMessageStream::write_message(Response& msg, UInt32 reque
 		srl.serialize(headers, sech);
 	}
 
-	SequenceHeader seqh = {
-		.sequence_number = sequence_number++,
-		.request_id = request_id,
-	};
+	security_header.resize(headers.size());
+	headers.read(security_header.data(), security_header.size());
 
-	NodeId msg_id(id_mapping.at(msg.get_node_id()));
-	srl.serialize(body, msg_id);
+	out.begin(msg_type, secure_channel_id, security_header,
+			sequence_number, request_id);
+}
+
+void opc_ua::tcp::ServerMessageStream::write_message(Response& msg, UInt32 request_id, MessageType msg_type)
+{
+	BinarySerializer srl;
 
 	// fill response header in
-	msg.response_header.timestamp = DateTime::now();
-	srl.serialize(body, msg);
+	msg.response_header.timestamp = server.now(ts.base());
 
-	// message splitting support
-	size_t max_chunk_size = ts.remote_limits.receive_buffer_size
-		- SecureConversationMessageHeader::serialized_length
-		- SequenceHeader::serialized_length
-		- headers.size();
+	begin_response(request_id, msg_type);
 
-	std::vector<Byte> headers_copy(headers.size());
-	headers.read(headers_copy.data(), headers_copy.size());
+	try
+	{
+		NodeId msg_id(id_mapping.at(msg.get_node_id()));
 
-	while (1)
+		srl.serialize(out, msg_id);
+		srl.serialize(out, msg);
+		out.finish();
+	}
+	catch (TransportError& e)
 	{
-		MemorySerializationBuffer buf;
+		// over the client limits, cancel the chunks sent so far
+		out.abort(e.status, e.what());
+	}
+	catch (std::exception& e)
+	{
+		out.abort(status::Bad_EncodingError, e.what());
+		throw;
+	}
+}
 
-		buf.write(headers_copy.data(), headers_copy.size());
-		srl.serialize(buf, seqh);
-		buf.move(body, max_chunk_size);
+void opc_ua::tcp::ServerMessageStream::start_read(const ReadRequest& rr, UInt32 request_id)
+{
+	BinarySerializer srl;
+	ResponseHeader rh;
 
-		ts.write_message(msg_type,
-				body.size() > 0 ? MessageIsFinal::INTERMEDIATE : MessageIsFinal::FINAL,
-				buf, secure_channel_id);
+	// use a single timestamp for the whole request
+	read_time = server.now(ts.base());
 
-		if (body.size() == 0)
-			break;
+	rh.timestamp = read_time;
+	rh.request_handle = rr.request_header.request_handle;
+	rh.service_result = 0;
+
+	begin_response(request_id, MessageType::MSG);
+
+	// the ReadResponse is encoded field by field, the results are
+	// produced as the chunks are written
+	try
+	{
+		NodeId msg_id(id_mapping.at(UInt32(ReadResponse::NODE_ID)));
+		// (empty array is encoded as null)
+		Int32 results_len = rr.nodes_to_read.empty() ? -1 : rr.nodes_to_read.size();
 
-		seqh.sequence_number = sequence_number++;
+		srl.serialize(out, msg_id);
+		srl.serialize(out, rh);
+		srl.serialize(out, results_len);
 	}
+	catch (TransportError& e)
+	{
+		out.abort(e.status, e.what());
+		return;
+	}
+	catch (std::exception& e)
+	{
+		out.abort(status::Bad_EncodingError, e.what());
+		throw;
+	}
+
+	pending_read = &rr;
+	read_pos = 0;
+
+	// small responses are completed right away, large ones continue
+	// from the scheduler so that they do not hold up other connections
+	if (!continue_read())
+		ts.defer_response(*this);
+}
+
+bool opc_ua::tcp::ServerMessageStream::continue_read()
+{
+	BinarySerializer srl;
+	const ReadRequest& rr = *pending_read;
+	size_t chunks_per_turn = server.config.chunks_per_turn;
+	size_t turn_end = out.chunks_sent() + chunks_per_turn;
+
+	try
+	{
+		while (read_pos < rr.nodes_to_read.size())
+		{
+			if (chunks_per_turn && out.chunks_sent() >= turn_end)
+				return false;
+
+			auto& r = rr.nodes_to_read[read_pos++];
+
+			read_value.flags = static_cast<Byte>(DataValueFlags::SERVER_TIMESTAMP_SPECIFIED);
+			read_value.server_timestamp = read_time;
+			// (locked for the value only, not while it is written out)
+			{
+				AddressSpace::SharedLock as_lock(server.address_space);
+				BaseNode* n = server.address_space.find_node(r.node_id);
+				// TODO: index_range, data_encoding
+
+				read_value.status_code = status::Bad_NodeIdUnknown;
+				if (n)
+				{
+					try
+					{
+						read_value.value = n->get_attribute(static_cast<AttributeId>(r.attribute_id),
+									attached_session->session, rr.max_age);
+						read_value.status_code = status::Good;
+					}
+					catch (std::runtime_error&)
+					{
+						read_value.status_code = status::Bad_AttributeIdInvalid;
+					}
+				}
+			}
+			read_value.flags |= static_cast<Byte>(read_value.status_code == status::Good
+					? DataValueFlags::VALUE_SPECIFIED : DataValueFlags::STATUS_CODE_SPECIFIED);
+			srl.serialize(out, read_value);
+		}
+
+		// no diagnostic infos (null array)
+		Int32 diag_len = -1;
+		srl.serialize(out, diag_len);
+		out.finish();
+	}
+	catch (TransportError& e)
+	{
+		out.abort(e.status, e.what());
+	}
+	catch (std::exception& e)
+	{
+		pending_read = nullptr;
+		request_cache.release();
+		out.abort(status::Bad_EncodingError, e.what());
+		throw;
+	}
+
+	pending_read = nullptr;
+	request_cache.release();
+	return true;
 }
 
 void opc_ua::tcp::ServerMessageStream::process_secure_channel_request(ReadableSerializationBuffer& sctx, UInt32 channel_id)
@@ -321,16 +1040,13 @@ void opc_ua::tcp::ServerMessageStream::process_secure_channel_request(ReadableSe
 	if (req.security_mode != MessageSecurityMode::NONE)
 		throw std::runtime_error("Security mode unsupported");
 
-	std::random_device rnd;
-	std::uniform_int_distribution<opc_ua::UInt32> dist;
-
 	secure_channel_id = channel_id;
-	token_id = dist(rnd);
+	random_bytes(&token_id, sizeof(token_id));
 
 	OpenSecureChannelResponse resp;
 	resp.response_header.request_handle = req.request_header.request_handle;
 	resp.response_header.service_result = 0;
-	resp.security_token.created_at = DateTime::now();
+	resp.security_token.created_at = server.now(ts.base());
 	resp.security_token.channel_id = secure_channel_id;
 	resp.security_token.token_id = token_id;
 
@@ -341,7 +1057,7 @@ void opc_ua::tcp::ServerMessageStream::process_secure_channel_request(ReadableSe
 
 void opc_ua::tcp::ServerMessageStream::handle_message(MessageHeader& h, ReadableSerializationBuffer& chunk)
 {
-	BinarySerializer srl;
+	BinarySerializer srl(server.config.max_array_length);
 	SymmetricAlgorithmSecurityHeader sech;
 	srl.unserialize(chunk, sech);
 
@@ -356,7 +1072,7 @@ void opc_ua::tcp::ServerMessageStream::handle_message(MessageHeader& h, Readable
 	switch (h.is_final)
 	{
 		case MessageIsFinal::INTERMEDIATE:
-			chunk_store[seqh.request_id].move(chunk);
+			chunk_store.add_chunk(seqh.request_id, chunk, ts.local_limits);
 			return;
 		case MessageIsFinal::ABORTED:
 		{
@@ -367,20 +1083,13 @@ void opc_ua::tcp::ServerMessageStream::handle_message(MessageHeader& h, Readable
 			srl.unserialize(chunk, reason);
 			// TODO: report the error
 
-			chunk_store.erase(seqh.request_id);
+			chunk_store.discard(seqh.request_id);
 			return;
 		}
 		case MessageIsFinal::FINAL:
 		{
-			auto it = chunk_store.find(seqh.request_id);
-
-			if (it != chunk_store.end())
-			{
-				body.move((*it).second);
-				chunk_store.erase(it);
-			}
-
-			body.move(chunk);
+			chunk_store.finish(seqh.request_id, chunk, ts.local_limits, body);
+			body.pullup();
 			break;
 		}
 		default:
@@ -396,12 +1105,15 @@ void opc_ua::tcp::ServerMessageStream::handle_message(MessageHeader& h, Readable
 		throw std::runtime_error("Non-standard namespace received");
 
 	UInt32 base_id = reverse_id_mapping.at(msg_id.as_int);
-	Struct* msg = struct_constructors.at(base_id)();
-	msg->unserialize(body, srl);
+	// decode over the previous request of the same type, reusing
+	// the storage of its arrays and strings
+	Struct& msg = request_cache.get(base_id, body.size());
+	srl.unserialize(body, msg);
 
 	// convert to Request
-	// XXX: check type properly
-	std::unique_ptr<Request> req(dynamic_cast<Request*>(msg));
+	Request* req = dynamic_cast<Request*>(&msg);
+	if (!req)
+		throw std::runtime_error("Non-request message received");
 
 	if (body.size() != 0)
 		throw std::runtime_error("Part of message body not unserialized");
@@ -415,7 +1127,7 @@ void opc_ua::tcp::ServerMessageStream::handle_message(MessageHeader& h, Readable
 				case CreateSessionRequest::NODE_ID:
 				{
 					const CreateSessionRequest& csr
-						= *dynamic_cast<CreateSessionRequest*>(req.get());
+						= *dynamic_cast<CreateSessionRequest*>(req);
 
 					CreateSessionResponse resp = server.create_session(csr);
 					write_message(resp, seqh.request_id);
@@ -426,60 +1138,94 @@ void opc_ua::tcp::ServerMessageStream::handle_message(MessageHeader& h, Readable
 				case ActivateSessionRequest::NODE_ID:
 				{
 					const ActivateSessionRequest& asr
-						= *dynamic_cast<ActivateSessionRequest*>(req.get());
+						= *dynamic_cast<ActivateSessionRequest*>(req);
+
+					ActivateSessionResponse resp;
+					std::shared_ptr<ServerSessionStream> ss
+						= server.activate_session(asr, *this, resp);
+					if (!ss)
+					{
+						write_fault(asr, seqh.request_id, status::Bad_SessionIdInvalid);
+						break;
+					}
 
-					attached_session = &server.activate_session(asr, *this, seqh.request_id);
+					// moved from another session
+					if (attached_session && attached_session != ss)
+						server.detach_session(*attached_session, *this);
+					attached_session = std::move(ss);
+					// (written outside the sessions lock)
+					write_message(resp, seqh.request_id);
 					break;
 				}
 
-				// TODO: move to ServerSessionStream
-				case ReadRequest::NODE_ID:
+				case CloseSessionRequest::NODE_ID:
 				{
-					const ReadRequest& rr = *dynamic_cast<ReadRequest*>(req.get());
-					ReadResponse resp;
-
-					resp.response_header.request_handle = rr.request_header.request_handle;
-					resp.response_header.service_result = 0;
-					resp.results.resize(rr.nodes_to_read.size());
+					// (no subscriptions to delete)
+					if (!check_session(*req, seqh.request_id))
+						break;
 
-					for (size_t i = 0; i < rr.nodes_to_read.size(); ++i)
-					{
-						auto& r = rr.nodes_to_read[i];
-						auto& res = resp.results[i];
+					server.close_session(*attached_session);
+					server.detach_session(*attached_session, *this);
+					attached_session.reset();
 
-						BaseNode& n = server.address_space.get_node(r.node_id);
-						// TODO: index_range, data_encoding
+					CloseSessionResponse resp;
+					resp.response_header.request_handle = req->request_header.request_handle;
+					resp.response_header.service_result = 0;
+					write_message(resp, seqh.request_id);
+					break;
+				}
 
-						res.flags = static_cast<Byte>(DataValueFlags::VALUE_SPECIFIED)
-								| static_cast<Byte>(DataValueFlags::SERVER_TIMESTAMP_SPECIFIED);
-						res.value = n.get_attribute(static_cast<AttributeId>(r.attribute_id),
-									attached_session->session, rr.max_age);
-						res.server_timestamp = DateTime::now();
-					}
+				// TODO: move to ServerSessionStream
+				case ReadRequest::NODE_ID:
+				{
+					const ReadRequest& rr = *dynamic_cast<ReadRequest*>(req);
 
-					write_message(resp, seqh.request_id);
+					if (check_session(rr, seqh.request_id))
+						start_read(rr, seqh.request_id);
 					break;
 				}
 
 				case WriteRequest::NODE_ID:
 				{
-					const WriteRequest& wr = *dynamic_cast<WriteRequest*>(req.get());
+					const WriteRequest& wr = *dynamic_cast<WriteRequest*>(req);
+					if (!check_session(wr, seqh.request_id))
+						break;
+
 					WriteResponse resp;
 
 					resp.response_header.request_handle = wr.request_header.request_handle;
 					resp.response_header.service_result = 0;
 					resp.results.resize(wr.nodes_to_write.size());
 
-					for (size_t i = 0; i < wr.nodes_to_write.size(); ++i)
+					// (the lock is released before the response
+					// is written out)
 					{
-						auto& r = wr.nodes_to_write[i];
-						auto& res = resp.results[i];
-
-						BaseNode& n = server.address_space.get_node(r.node_id);
-						// TODO: index_range, data_encoding
-
-						res = n.set_attribute(static_cast<AttributeId>(r.attribute_id),
-								attached_session->session, r.value.value);
+						std::lock_guard<AddressSpace> as_lock(server.address_space);
+
+						for (size_t i = 0; i < wr.nodes_to_write.size(); ++i)
+						{
+							auto& r = wr.nodes_to_write[i];
+							auto& res = resp.results[i];
+
+							BaseNode* n = server.address_space.find_node(r.node_id);
+							// TODO: index_range, data_encoding
+
+							if (!n)
+							{
+								res = status::Bad_NodeIdUnknown;
+								continue;
+							}
+
+							try
+							{
+								res = n->set_attribute(static_cast<AttributeId>(r.attribute_id),
+										attached_session->session, r.value.value);
+							}
+							catch (std::runtime_error&)
+							{
+								res = status::Bad_AttributeIdInvalid;
+							}
+						}
 					}
 
 					write_message(resp, seqh.request_id);
@@ -492,43 +1238,75 @@ void opc_ua::tcp::ServerMessageStream::handle_message(MessageHeader& h, Readable
 
 			break;
 		}
-		// TODO: handle CLO
+		case MessageType::CLO:
+		{
+			// the channel is removed by the transport stream
+			if (req->get_node_id() != CloseSecureChannelRequest::NODE_ID)
+				throw std::runtime_error("Non-close request received in CLO");
+			break;
+		}
 		default:
 			assert(not_reached);
 	}
+
+	// (a pending read releases it once done)
+	if (!pending_read)
+		request_cache.release();
 }
 
 opc_ua::tcp::ServerSessionStream::ServerSessionStream(Server& serv, const CreateSessionRequest& csr, CreateSessionResponse& resp)
 	: server(serv), secure_channel(nullptr), session_name(csr.session_name),
+	last_activity(clock_ms()), closed(false),
 	session_id(GUID::random_guid(), server_namespace_index),
-	authentication_token(GUID::random_guid(), server_namespace_index)
+	authentication_token(GUID::random_guid(), server_namespace_index),
+	timeout(std::min(std::max(csr.requested_session_timeout,
+			serv.config.min_session_timeout), serv.config.max_session_timeout))
 {
 	resp.response_header.request_handle = csr.request_header.request_handle;
 	resp.response_header.service_result = 0;
 
 	resp.session_id = session_id;
 	resp.authentication_token = authentication_token;
+	resp.revised_session_timeout = timeout;
 	resp.server_nonce = random_nonce();
 }
 
-void opc_ua::tcp::ServerSessionStream::attach(ServerMessageStream& ms, const ActivateSessionRequest& asr, UInt32 request_id)
+void opc_ua::tcp::ServerSessionStream::attach(ServerMessageStream& ms, const ActivateSessionRequest& asr, ActivateSessionResponse& resp)
 {
 	secure_channel = &ms;
-
-	ActivateSessionResponse resp;
+	touch();
 
 	resp.response_header.request_handle = asr.request_header.request_handle;
 	resp.response_header.service_result = 0;
 
 	resp.server_nonce = random_nonce();
 	resp.results.push_back(0);
+}
+
+void opc_ua::tcp::ServerSessionStream::detach(ServerMessageStream& ms)
+{
+	if (secure_channel == &ms)
+		secure_channel = nullptr;
+}
 
-	write_message(resp, request_id);
+void opc_ua::tcp::ServerSessionStream::touch()
+{
+	last_activity.store(clock_ms(), std::memory_order_relaxed);
+}
+
+uint64_t opc_ua::tcp::ServerSessionStream::expiry() const
+{
+	return last_activity.load(std::memory_order_relaxed) + timeout;
+}
+
+void opc_ua::tcp::ServerSessionStream::close()
+{
+	closed = true;
 }
 
-void opc_ua::tcp::ServerSessionStream::detach()
+bool opc_ua::tcp::ServerSessionStream::is_closed() const
 {
-	secure_channel = nullptr;
+	return closed;
 }
 
 void opc_ua::tcp::ServerSessionStream::write_message(Response& msg, UInt32 request_id)
@@ -536,8 +1314,20 @@ void opc_ua::tcp::ServerSessionStream::write_message(Response& msg, UInt32 reque
 	secure_channel->write_message(msg, request_id);
 }
 
+opc_ua::AddressSpace::AddressSpace()
+{
+	if (pthread_rwlock_init(&rwlock, nullptr))
+		throw std::runtime_error("Unable to initialize address space lock");
+}
+
+opc_ua::AddressSpace::~AddressSpace()
+{
+	pthread_rwlock_destroy(&rwlock);
+}
+
 void opc_ua::AddressSpace::add_node(const std::shared_ptr<BaseNode>& n)
 {
+	std::lock_guard<AddressSpace> lock(*this);
 	nodes.emplace(n.get()->node_id(), n);
 }
 
@@ -545,3 +1335,41 @@ opc_ua::BaseNode& opc_ua::AddressSpace::get_node(const NodeId& n)
 {
 	return *nodes.at(n).get();
 }
+
+opc_ua::BaseNode* opc_ua::AddressSpace::find_node(const NodeId& n)
+{
+	auto it = nodes.find(n);
+
+	return it != nodes.end() ? it->second.get() : nullptr;
+}
+
+void opc_ua::AddressSpace::lock_shared()
+{
+	pthread_rwlock_rdlock(&rwlock);
+}
+
+void opc_ua::AddressSpace::unlock_shared()
+{
+	pthread_rwlock_unlock(&rwlock);
+}
+
+void opc_ua::AddressSpace::lock()
+{
+	pthread_rwlock_wrlock(&rwlock);
+}
+
+void opc_ua::AddressSpace::unlock()
+{
+	pthread_rwlock_unlock(&rwlock);
+}
+
+opc_ua::AddressSpace::SharedLock::SharedLock(AddressSpace& new_as)
+	: as(new_as)
+{
+	as.lock_shared();
+}
+
+opc_ua::AddressSpace::SharedLock::~SharedLock()
+{
+	as.unlock_shared();
+}
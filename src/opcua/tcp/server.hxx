@@ -13,12 +13,24 @@
 #include <event2/listener.h>
 
 #include <opcua/common/object.hxx>
+#include <opcua/common/slab.hxx>
 #include <opcua/common/struct.hxx>
+#include <opcua/common/timerwheel.hxx>
 #include <opcua/common/types.hxx>
 #include <opcua/common/util.hxx>
 #include <opcua/tcp/types.hxx>
 
+#include <atomic>
+#include <deque>
 #include <forward_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <pthread.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -30,10 +42,40 @@ namespace opc_ua
 	class AddressSpace
 	{
 		std::unordered_map<NodeId, std::shared_ptr<BaseNode>> nodes;
+		// guards the node map and node attributes against server
+		// threads running concurrently
+		pthread_rwlock_t rwlock;
 
 	public:
+		AddressSpace();
+		~AddressSpace();
+		AddressSpace(const AddressSpace&) = delete;
+		AddressSpace& operator=(const AddressSpace&) = delete;
+
+		// (takes the exclusive lock)
 		void add_node(const std::shared_ptr<BaseNode>& n);
+		// (the caller needs to hold at least the shared lock)
 		BaseNode& get_node(const NodeId& n);
+		// (returns null if there is no such node)
+		BaseNode* find_node(const NodeId& n);
+
+		// shared lock for reading attributes, exclusive one for
+		// writing them; lock()/unlock() make it usable with
+		// std::lock_guard
+		void lock_shared();
+		void unlock_shared();
+		void lock();
+		void unlock();
+
+		// RAII holder of the shared lock
+		class SharedLock
+		{
+			AddressSpace& as;
+
+		public:
+			SharedLock(AddressSpace& new_as);
+			~SharedLock();
+		};
 	};
 
 	// Detailed session information.
@@ -45,20 +87,148 @@ namespace opc_ua
 	{
 		extern const UInt32 server_namespace_index;
 
+		// Server tunables.
+		struct ServerConfig
+		{
+			// take timestamps from the time cached by the event loop
+			// at the start of each iteration, rather than the system
+			// clock (saves a clock call per timestamp)
+			bool cached_clock;
+			// addresses to listen on, in any form accepted by
+			// evutil_parse_sockaddr_port() (e.g. "0.0.0.0:6001"
+			// or "[::]:6001")
+			std::vector<std::string> listen_addresses;
+			// additional threads, each running its own event loop
+			// with its own SO_REUSEPORT listeners; a connection
+			// is served entirely by the loop that accepted it
+			// (0 = everything runs in the caller's event loop)
+			unsigned int worker_threads;
+			// queued output size per connection that is written out
+			// immediately rather than on the next event loop
+			// iteration (0 = never)
+			size_t flush_threshold;
+			// per-connection output backlog above which reading
+			// from the client is suspended, and the one below
+			// which it is resumed (high mark 0 = never suspend)
+			size_t output_high_watermark;
+			size_t output_low_watermark;
+			// chunks of a large response sent before yielding
+			// to the other connections of the event loop
+			// (0 = send whole responses at once)
+			unsigned int chunks_per_turn;
+			// bounds for the session timeout requested by clients
+			// (in ms); sessions with no requests for that long
+			// are closed
+			Double min_session_timeout;
+			Double max_session_timeout;
+			// encoded size of the largest request whose decoded
+			// object is kept for reuse by the channel (see
+			// RequestCache)
+			size_t max_cached_request_size;
+			// longest array accepted in a request (bounds the memory
+			// a request can expand to when decoded, 0 = no limit)
+			size_t max_array_length;
+
+			ServerConfig();
+		};
+
 		// (opaque)
 		class Server;
 		class ServerTransportStream;
 		class ServerSessionStream;
 
+		// Encodes a message straight into chunk-sized frames. Each
+		// chunk is reserved as a contiguous extent that is filled by
+		// the regular write path; when it fills up, its header is
+		// back-patched with the final size and IsFinal flag, and it is
+		// copied to the output buffer of the connection while the rest
+		// of the message is being encoded (the reserved space is reused
+		// for the next chunk, it is never committed). The remote
+		// limits are enforced by throwing TransportError, the message
+		// needs to be aborted then.
+		class ServerChunkWriter : public WritableSerializationBuffer
+		{
+			ServerTransportStream& ts;
+
+			// headers repeated in every chunk
+			MessageType msg_type;
+			UInt32 channel_id;
+			std::vector<Byte> security_header;
+			UInt32* sequence_number;
+			UInt32 request_id;
+
+			size_t chunk_size;
+			UInt32 max_chunk_count;
+			UInt32 max_message_size;
+			// headers length in the current chunk
+			size_t header_length;
+			// chunks and body length written already
+			size_t chunk_count;
+			size_t body_length;
+
+			void begin_chunk();
+			void end_chunk(MessageIsFinal is_final);
+
+			virtual void write_buffer(const void* data, size_t length);
+
+			// the chunk boundaries are maintained by write() only
+			using WritableSerializationBuffer::reserve;
+			using WritableSerializationBuffer::commit;
+			using WritableSerializationBuffer::move;
+
+		public:
+			ServerChunkWriter(ServerTransportStream& new_ts);
+			~ServerChunkWriter();
+
+			// start a new message
+			void begin(MessageType type, UInt32 secure_channel_id,
+					const std::vector<Byte>& sech, UInt32& seq_number,
+					UInt32 req_id);
+			// complete the last chunk
+			void finish();
+			// drop the chunk in progress and send an abort chunk
+			// in its place
+			void abort(StatusCode error, const String& reason);
+
+			// number of chunks of the message sent so far
+			size_t chunks_sent() const;
+
+			// (completed chunks are sent out immediately)
+			virtual bool patchable() const;
+		};
+
+		// Decoded requests kept for reuse, by type, so that the next
+		// request of the type is decoded over the storage of the arrays
+		// and strings of the previous one. Requests encoded in more than
+		// max_size bytes are decoded into a separate object that is
+		// dropped on release(), so that a single large request does not
+		// pin its storage for the lifetime of the channel.
+		class RequestCache
+		{
+			std::unordered_map<UInt32, std::unique_ptr<Struct>> cache;
+			std::unique_ptr<Struct> oversized;
+			size_t max_size;
+
+		public:
+			RequestCache(size_t max_request_size);
+
+			// object to decode the request of the type into
+			Struct& get(UInt32 base_id, size_t encoded_size);
+			// the request returned last is no longer used
+			void release();
+
+			// number of requests kept
+			size_t size() const;
+		};
+
 		class ServerMessageStream
 		{
 			Server& server;
 			ServerTransportStream& ts;
-			ServerSessionStream* attached_session;
+			std::shared_ptr<ServerSessionStream> attached_session;
 
 			// sequential number source
-			static UInt32 sequence_number;
-			static UInt32 next_request_id;
+			UInt32 sequence_number;
 
 			// secure channel id for write_message()
 			UInt32 secure_channel_id;
@@ -66,7 +236,31 @@ namespace opc_ua
 			UInt32 token_id;
 
 			// segmented message support
-			std::unordered_map<UInt32, MemorySerializationBuffer> chunk_store;
+			ChunkAssembler chunk_store;
+			// decoded requests kept for reuse
+			RequestCache request_cache;
+
+			// response encoder (one message at a time)
+			ServerChunkWriter out;
+			std::vector<Byte> security_header;
+
+			// read request whose response is still being written
+			// (stays in request_cache, no further requests are
+			// decoded meanwhile)
+			const ReadRequest* pending_read;
+			size_t read_pos;
+			DateTime read_time;
+			DataValue read_value;
+
+			// prepare the security header & start the response
+			void begin_response(UInt32 request_id, MessageType msg_type);
+			// start serving a read request
+			void start_read(const ReadRequest& rr, UInt32 request_id);
+			// send a ServiceFault in reply to the request
+			void write_fault(const Request& req, UInt32 request_id, StatusCode status);
+			// check that the request belongs to the (open) attached
+			// session, reply with a fault otherwise
+			bool check_session(const Request& req, UInt32 request_id);
 
 		public:
 			ServerMessageStream(Server& serv, ServerTransportStream& new_ts);
@@ -81,10 +275,16 @@ namespace opc_ua
 			void process_secure_channel_request(ReadableSerializationBuffer& buf, UInt32 channel_id);
 			// handle incoming message.
 			void handle_message(MessageHeader& h, ReadableSerializationBuffer& chunk);
+
+			// write the next few chunks of the pending read response,
+			// return true when it is complete
+			bool continue_read();
 		};
 
 		class ServerTransportStream
 		{
+			friend class ServerChunkWriter;
+
 			Server& server;
 			bufferevent* bev;
 			ReadableSerializationBuffer in_ctx;
@@ -94,22 +294,58 @@ namespace opc_ua
 			bool connected;
 			bool got_header;
 			MessageHeader h;
+			// reading suspended until the output backlog drains
+			bool read_paused;
+			// channel with a response split over scheduler turns;
+			// further messages are not processed until it is done
+			ServerMessageStream* pending_response;
 
 			// secure channels
 			std::unordered_map<UInt32, ServerMessageStream> secure_channels;
-			static UInt32 next_secure_channel_id;
+			// (shared by all server threads)
+			static std::atomic<UInt32> next_secure_channel_id;
 
 			static void read_handler(bufferevent* bev, void* ctx);
+			// (read_handler() body, throws TransportError)
+			static void process_input(ServerTransportStream* s);
+			static void write_handler(bufferevent* bev, void* ctx);
 			static void event_handler(bufferevent* bev, short what, void* ctx);
 
+			// send ERR and drop the connection (the stream is gone
+			// afterwards if it was accepted by a reactor)
+			void close_with_error(StatusCode error, const String& reason);
+			// handle new data in the output buffer (early write,
+			// read suspension)
+			void output_appended();
+			// queue the pending response in the scheduler
+			void schedule();
+
 		public:
 			// remote side limits
 			ProtocolInfo remote_limits;
+			// limits enforced on the received messages
+			ProtocolInfo local_limits;
+			// id in the connection registry of the reactor
+			// (no_connection_id if not registered)
+			size_t connection_id;
+
+			static constexpr size_t no_connection_id = static_cast<size_t>(-1);
 
 			ServerTransportStream(Server& serv, event_base* ev, evutil_socket_t sock);
 			~ServerTransportStream();
 
+			// event loop serving the connection
+			event_base* base() const;
+			// bytes queued for sending to the client
+			size_t output_backlog() const;
+
 			void write_message(MessageType msg_type, MessageIsFinal is_final, ReadableSerializationBuffer& msg, UInt32 secure_channel_id = 0);
+
+			// continue the response through the scheduler
+			void defer_response(ServerMessageStream& ms);
+			// one scheduler turn of the pending response, return true
+			// if another one is needed
+			bool run_turn();
 		};
 
 		class ServerSessionStream
@@ -119,40 +355,113 @@ namespace opc_ua
 
 			std::string session_name;
 
+			// time of the last request, in ms (see clock_ms())
+			std::atomic<uint64_t> last_activity;
+			// set once the session is removed from the server
+			std::atomic<bool> closed;
+
 		public:
 			Session session;
 
 			// session info
 			NodeId session_id;
 			NodeId authentication_token;
+			// revised timeout, in ms
+			Double timeout;
 
 			ServerSessionStream(Server& serv, const CreateSessionRequest& csr, CreateSessionResponse& resp);
 
-			void attach(ServerMessageStream& ms, const ActivateSessionRequest& asr, UInt32 request_id);
-			void detach();
+			// (fills the response in, for the channel to send)
+			void attach(ServerMessageStream& ms, const ActivateSessionRequest& asr, ActivateSessionResponse& resp);
+			// detach from the secure channel, if it is the one
+			// the session is attached to
+			void detach(ServerMessageStream& ms);
+
+			// note a request, postponing the timeout
+			void touch();
+			// time the session expires at (if not touched again)
+			uint64_t expiry() const;
+			void close();
+			bool is_closed() const;
 
 			void write_message(Response& msg, UInt32 request_id);
 		};
 
 		class Server
 		{
-			evconnlistener* listener;
+			// An event loop with its listeners and the connections
+			// accepted by them. The connections are touched only
+			// by the thread running the loop.
+			struct Reactor
+			{
+				Server& server;
+				event_base* base;
+				// whether the base was created (and is freed) by us
+				bool owns_base;
+				std::vector<evconnlistener*> listeners;
+				Slab<ServerTransportStream> connections;
+				std::thread thread;
+
+				// connections with pending responses, served
+				// round-robin from a zero timeout so that I/O
+				// is processed between the turns
+				std::deque<ServerTransportStream*> run_queue;
+				event* scheduler;
+
+				static void run_scheduled(evutil_socket_t fd, short what, void* data);
+
+				Reactor(Server& serv, event_base* ev, bool own_base);
+				~Reactor();
+
+				void listen(const std::string& address);
+			};
+
+			Reactor* find_reactor(event_base* ev);
 
 			static void handle_connection(evconnlistener* listener,
 					evutil_socket_t sock, sockaddr* addr, int socklen, void* data);
 
-			std::forward_list<ServerTransportStream> connections;
-			std::forward_list<ServerSessionStream> sessions;
+			// sessions are shared by all reactors, and indexed
+			// by the authentication token; a closed session stays
+			// alive until the channel attached to it lets it go
+			std::mutex sessions_mutex;
+			std::unordered_map<NodeId, std::shared_ptr<ServerSessionStream>> sessions;
+			// session timeouts (keyed by the authentication token,
+			// checked against the actual expiry when they fire),
+			// run every tick by a persistent timer in the main event
+			// loop (the workers only add to the wheel)
+			TimerWheel<NodeId> session_timers;
+			event* session_timer;
+
+			static void expire_sessions(evutil_socket_t fd, short what, void* data);
+
+			// (declared after the sessions so that the connections
+			// are gone before the sessions they refer to)
+			std::forward_list<Reactor> reactors;
 
 		public:
 			AddressSpace& address_space;
+			const ServerConfig config;
+
+			Server(event_base* ev, AddressSpace& as, const ServerConfig& cfg = ServerConfig());
+			// stops and joins the worker threads
+			~Server();
 
-			Server(event_base* ev, AddressSpace& as);
+			// current time for timestamps, in the given event loop
+			// (see ServerConfig::cached_clock)
+			DateTime now(event_base* ev) const;
 
 			CreateSessionResponse create_session(const CreateSessionRequest& csr);
-			ServerSessionStream& activate_session(const ActivateSessionRequest& asr, ServerMessageStream& ms, UInt32 request_id);
+			// (returns null if the session does not exist, the response
+			// is to be sent by the caller)
+			std::shared_ptr<ServerSessionStream> activate_session(const ActivateSessionRequest& asr, ServerMessageStream& ms, ActivateSessionResponse& resp);
+			void detach_session(ServerSessionStream& ss, ServerMessageStream& ms);
+			void close_session(ServerSessionStream& ss);
 
 			void handle_disconnect(ServerTransportStream* ts);
+			// queue a connection for a scheduler turn, return false
+			// if it is not served by any of the reactors
+			bool schedule(ServerTransportStream* ts);
 		};
 	};
 };
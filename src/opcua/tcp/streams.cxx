@@ -11,17 +11,25 @@
 
 #include <opcua/tcp/idmapping.hxx>
 
+#include <algorithm>
 #include <cassert>
 #include <stdexcept>
 
-opc_ua::UInt32 opc_ua::tcp::MessageStream::sequence_number = 0;
-opc_ua::UInt32 opc_ua::tcp::MessageStream::next_request_id = 0;
+// request timeout granularity (ms) & wheel size (~100 s per turn)
+static const uint64_t timeout_tick = 100;
+static const size_t timeout_wheel_slots = 1024;
+
+// request bodies kept for reuse, at most
+static const size_t max_spare_bodies = 64;
 
 opc_ua::tcp::TransportStream::TransportStream(event_base* ev)
 	: bev(bufferevent_socket_new(ev, -1, BEV_OPT_CLOSE_ON_FREE)),
 	in_ctx(bufferevent_get_input(bev)),
 	out_ctx(bufferevent_get_output(bev)),
-	connected(false), got_header(false)
+	connected(false), got_header(false), next_opn_request_id(0),
+	remote_limits(libevent_protocol_info),
+	local_limits(libevent_protocol_info),
+	flush_threshold(65536)
 {
 	assert(bev);
 
@@ -34,14 +42,32 @@ opc_ua::tcp::TransportStream::~TransportStream()
 	bufferevent_free(bev);
 }
 
+event_base* opc_ua::tcp::TransportStream::base() const
+{
+	return bufferevent_get_base(bev);
+}
+
 void opc_ua::tcp::TransportStream::connect_hostname(const char* hostname, uint16_t port, const std::string& endpoint, sa_family_t family)
 {
 	if (bufferevent_socket_connect_hostname(bev, 0, family, hostname, port))
 		throw std::runtime_error("Connect failed prematurely (hostname resolution?)");
 
 	// say hello after connecting
+	send_hello(endpoint);
+}
+
+void opc_ua::tcp::TransportStream::connect_socket(evutil_socket_t sock, const std::string& endpoint)
+{
+	if (evutil_make_socket_nonblocking(sock) || bufferevent_setfd(bev, sock))
+		throw std::runtime_error("Unable to use the socket");
+
+	send_hello(endpoint);
+}
+
+void opc_ua::tcp::TransportStream::send_hello(const std::string& endpoint)
+{
 	HelloMessage hello = {
-		.protocol_info = libevent_protocol_info,
+		.protocol_info = local_limits,
 		.endpoint_url = endpoint,
 	};
 
@@ -56,106 +82,117 @@ void opc_ua::tcp::TransportStream::read_handler(bufferevent* bev, void* ctx)
 	BinarySerializer srl;
 	TransportStream* s = static_cast<TransportStream*>(ctx);
 
-	if (!s->got_header)
+	// process every complete frame buffered so far, anything written
+	// meanwhile goes out together once the socket becomes writable
+	for (;;)
 	{
-		// wait for complete header
-		if (s->in_ctx.size() < s->h.serialized_length)
-			return;
-
-		srl.unserialize(s->in_ctx, s->h);
-		s->got_header = true;
-
-		// pass-through in case we got the message body too
-	}
-
-	// wait for complete body
-	if (s->in_ctx.size() < s->h.message_size - s->h.serialized_length)
-		return;
-
-	MemorySerializationBuffer buf;
-	buf.move(s->in_ctx, s->h.message_size - s->h.serialized_length);
-
-	// process the message
-	switch (s->h.message_type)
-	{
-		case MessageType::ACK:
+		if (!s->got_header)
 		{
-			AcknowledgeMessage ack;
-			srl.unserialize(buf, ack);
-			s->remote_limits = ack.protocol_info;
+			// wait for complete header
+			if (s->in_ctx.size() < s->h.serialized_length)
+				break;
 
-			s->connected = true;
-			// push queued requests
-			for (auto ms : s->secure_channel_queue)
-				ms->request_secure_channel();
+			srl.unserialize(s->in_ctx, s->h);
+			s->got_header = true;
 
-			break;
-		}
+			// refuse oversized chunks before buffering their body
+			if (s->h.message_size > s->local_limits.receive_buffer_size)
+				throw TransportError(status::Bad_TcpMessageTooLarge, "Chunk size limit exceeded");
+			if (s->h.message_size < s->h.serialized_length)
+				throw TransportError(status::Bad_CommunicationError, "Invalid message size");
 
-		case MessageType::ERR:
-		{
-			ErrorMessage err;
-			srl.unserialize(buf, err);
+			// pass-through in case we got the message body too
+		}
 
-			throw std::runtime_error("ERR message received");
+		// wait for complete body
+		if (s->in_ctx.size() < s->h.message_size - s->h.serialized_length)
 			break;
-		}
 
-		case MessageType::OPN:
+		MemorySerializationBuffer buf;
+		buf.move(s->in_ctx, s->h.message_size - s->h.serialized_length);
+		// decode the whole message from a contiguous region
+		buf.pullup();
+
+		// process the message
+		switch (s->h.message_type)
 		{
-			UInt32 secure_channel_id;
-			srl.unserialize(buf, secure_channel_id);
+			case MessageType::ACK:
+			{
+				AcknowledgeMessage ack;
+				srl.unserialize(buf, ack);
+				s->remote_limits = ack.protocol_info;
 
-			std::vector<Byte> data_copy(buf.size());
-			buf.read(data_copy.data(), data_copy.size());
+				s->connected = true;
+				// push queued requests
+				for (auto ms : s->secure_channel_queue)
+					s->pending_channels[ms->request_secure_channel()] = ms;
+				s->secure_channel_queue.clear();
 
-			for (auto i = s->secure_channel_queue.begin();; ++i)
-			{
-				if (i == s->secure_channel_queue.end())
-					throw std::runtime_error("Received open secure channel response with no matching request");
+				break;
+			}
 
-				MessageStream* ms = *i;
+			case MessageType::ERR:
+			{
+				ErrorMessage err;
+				srl.unserialize(buf, err);
 
-				// copy the current input into a local buffer
-				MemorySerializationBuffer copy_buf;
-				copy_buf.write(data_copy.data(), data_copy.size());
+				throw std::runtime_error("ERR message received");
+				break;
+			}
 
-				if (ms->process_secure_channel_response(copy_buf, secure_channel_id))
+			case MessageType::OPN:
+			{
+				UInt32 secure_channel_id;
+				AsymmetricAlgorithmSecurityHeader sech;
+				SequenceHeader seqh;
+				srl.unserialize(buf, secure_channel_id);
+				srl.unserialize(buf, sech);
+				srl.unserialize(buf, seqh);
+
+				auto it = s->pending_channels.find(seqh.request_id);
+				// (the channel may have been destroyed meanwhile)
+				if (it == s->pending_channels.end())
 				{
-#if 0 // fails (because of extra padding size field?)
-					if (copy_buf.size() != 0)
-						throw std::runtime_error("Part of message not unserialized in process_secure_channel_response()");
-#endif
-
-					// request matched, let's activate the channel
-					s->secure_channel_queue.erase(i);
-					s->secure_channels[secure_channel_id] = ms;
+					buf.skip(buf.size());
 					break;
 				}
-			}
 
-			break;
-		}
+				// request matched, let's activate the channel
+				MessageStream* ms = it->second;
+				s->pending_channels.erase(it);
+				ms->process_secure_channel_response(buf, secure_channel_id);
+				s->secure_channels[secure_channel_id] = ms;
 
-		case MessageType::CLO:
-		case MessageType::MSG:
-		{
-			UInt32 secure_channel_id;
-			srl.unserialize(buf, secure_channel_id);
+				// skip what is left (extra padding size field?)
+				buf.skip(buf.size());
+				break;
+			}
 
-			s->secure_channels[secure_channel_id]->handle_message(s->h, buf);
-			break;
-		}
+			case MessageType::CLO:
+			case MessageType::MSG:
+			{
+				UInt32 secure_channel_id;
+				srl.unserialize(buf, secure_channel_id);
+
+				auto it = s->secure_channels.find(secure_channel_id);
+				// (late responses for a channel closed meanwhile)
+				if (it == s->secure_channels.end())
+					buf.skip(buf.size());
+				else
+					it->second->handle_message(s->h, buf);
+				break;
+			}
 
-		default:
-			assert(not_reached);
-	}
+			default:
+				assert(not_reached);
+		}
 
-	if (buf.size() != 0)
-		throw std::runtime_error("Part of message not unserialized");
+		if (buf.size() != 0)
+			throw std::runtime_error("Part of message not unserialized");
 
-	// prepare for the next message
-	s->got_header = false;
+		// prepare for the next message
+		s->got_header = false;
+	}
 }
 
 void opc_ua::tcp::TransportStream::event_handler(bufferevent* bev, short what, void* ctx)
@@ -200,30 +237,89 @@ void opc_ua::tcp::TransportStream::write_message(MessageType msg_type, MessageIs
 	}
 
 	out_ctx.move(msg);
+	out_ctx.commit();
 
-	bufferevent_flush(bev, EV_WRITE, BEV_FLUSH);
+	// the bufferevent writes everything queued at once (using writev())
+	// when the event loop finds the socket writable; write out large
+	// backlogs early rather than letting a single burst pile up
+	if (connected && flush_threshold && out_ctx.size() >= flush_threshold)
+		write_out(bev);
 }
 
 void opc_ua::tcp::TransportStream::add_secure_channel(MessageStream& ms)
 {
-	secure_channel_queue.push_back(&ms);
 	if (connected)
-		ms.request_secure_channel();
+		pending_channels[ms.request_secure_channel()] = &ms;
+	else
+		secure_channel_queue.push_back(&ms);
+}
+
+void opc_ua::tcp::TransportStream::remove_secure_channel(MessageStream& ms)
+{
+	for (auto it = secure_channels.begin(); it != secure_channels.end(); )
+	{
+		if (it->second == &ms)
+			it = secure_channels.erase(it);
+		else
+			++it;
+	}
+	for (auto it = pending_channels.begin(); it != pending_channels.end(); )
+	{
+		if (it->second == &ms)
+			it = pending_channels.erase(it);
+		else
+			++it;
+	}
+	secure_channel_queue.erase(std::remove(secure_channel_queue.begin(),
+				secure_channel_queue.end(), &ms),
+			secure_channel_queue.end());
 }
 
 opc_ua::tcp::MessageStream::MessageStream(TransportStream& new_ts)
-	: ts(new_ts), attached_session(nullptr), established(false)
+	: ts(new_ts), attached_session(nullptr),
+	sequence_number(0), next_request_id(0), established(false)
 {
 	ts.add_secure_channel(*this);
 }
 
 opc_ua::tcp::MessageStream::~MessageStream()
 {
+	if (attached_session)
+		attached_session->detach(*this);
+	ts.remove_secure_channel(*this);
+}
+
+event_base* opc_ua::tcp::MessageStream::base() const
+{
+	return ts.base();
+}
+
+opc_ua::UInt32 opc_ua::tcp::MessageStream::write_message(Request& msg, MessageType msg_type)
+{
+	MemorySerializationBuffer body;
+
+	encode_request(msg, body);
+	return write_encoded(body, msg_type);
+}
+
+void opc_ua::tcp::MessageStream::encode_request(Request& msg, WritableSerializationBuffer& body)
+{
+	BinarySerializer srl;
+
+	// fill request header in (the request handle is up to the session)
+	msg.request_header.timestamp = DateTime::now();
+
+	NodeId msg_id(id_mapping.at(msg.get_node_id()));
+
+	// encode the whole body into a single preallocated extent
+	body.reserve(encoded_size(msg_id) + encoded_size(msg));
+	srl.serialize(body, msg_id);
+	srl.serialize(body, msg);
 }
 
-void opc_ua::tcp::MessageStream::write_message(Request& msg, MessageType msg_type)
+opc_ua::UInt32 opc_ua::tcp::MessageStream::write_encoded(ReadableSerializationBuffer& body, MessageType msg_type)
 {
-	MemorySerializationBuffer headers, body;
+	MemorySerializationBuffer headers;
 	BinarySerializer srl;
 
 	// OPN message takes asymmetric header
@@ -247,64 +343,61 @@ void opc_ua::tcp::MessageStream::write_message(Request& msg, MessageType msg_typ
 
 	SequenceHeader seqh = {
 		.sequence_number = sequence_number++,
-		.request_id = next_request_id++,
+		.request_id = msg_type == MessageType::OPN
+			? ts.next_opn_request_id++ : next_request_id++,
 	};
 
-	NodeId msg_id(id_mapping.at(msg.get_node_id()));
-	srl.serialize(body, msg_id);
-
-	// fill request header in
-	msg.request_header.timestamp = DateTime::now();
-	msg.request_header.request_handle = seqh.request_id;
-	srl.serialize(body, msg);
+	size_t body_size = body.size();
 
 	// message splitting support
-	size_t max_chunk_size = ts.remote_limits.receive_buffer_size
+	const ProtocolInfo& limits = ts.remote_limits;
+	size_t max_chunk_size = limits.receive_buffer_size
 		- SecureConversationMessageHeader::serialized_length
 		- SequenceHeader::serialized_length
 		- headers.size();
+	size_t chunk_count = (body_size + max_chunk_size - 1) / max_chunk_size;
+
+	if ((limits.max_message_size && body_size > limits.max_message_size)
+			|| (limits.max_chunk_count && chunk_count > limits.max_chunk_count))
+		throw std::runtime_error("Request exceeds the server's message size limit");
 
 	std::vector<Byte> headers_copy(headers.size());
 	headers.read(headers_copy.data(), headers_copy.size());
 
-	while (1)
+	for (size_t pos = 0; ; )
 	{
 		MemorySerializationBuffer buf;
+		size_t n = std::min(max_chunk_size, body_size - pos);
 
 		buf.write(headers_copy.data(), headers_copy.size());
 		srl.serialize(buf, seqh);
-		buf.move(body, max_chunk_size);
+		buf.copy(body, pos, n);
+		pos += n;
 
 		ts.write_message(msg_type,
-				body.size() > 0 ? MessageIsFinal::INTERMEDIATE : MessageIsFinal::FINAL,
+				pos < body_size ? MessageIsFinal::INTERMEDIATE : MessageIsFinal::FINAL,
 				buf, secure_channel_id);
 
-		if (body.size() == 0)
+		if (pos == body_size)
 			break;
 
 		seqh.sequence_number = sequence_number++;
 	}
+
+	return seqh.request_id;
 }
 
-void opc_ua::tcp::MessageStream::request_secure_channel()
+opc_ua::UInt32 opc_ua::tcp::MessageStream::request_secure_channel()
 {
-	channel_request_id = sequence_number;
-
 	OpenSecureChannelRequest req(SecurityTokenRequestType::ISSUE,
 			MessageSecurityMode::NONE, "", 360000);
 
-	write_message(req, MessageType::OPN);
+	return write_message(req, MessageType::OPN);
 }
 
-bool opc_ua::tcp::MessageStream::process_secure_channel_response(ReadableSerializationBuffer& sctx, UInt32 channel_id)
+void opc_ua::tcp::MessageStream::process_secure_channel_response(ReadableSerializationBuffer& sctx, UInt32 channel_id)
 {
 	BinarySerializer srl;
-	AsymmetricAlgorithmSecurityHeader sech;
-	srl.unserialize(sctx, sech);
-
-	SequenceHeader seqh;
-	srl.unserialize(sctx, seqh);
-
 	OpenSecureChannelResponse resp;
 	NodeId resp_id;
 
@@ -314,19 +407,12 @@ bool opc_ua::tcp::MessageStream::process_secure_channel_response(ReadableSeriali
 
 	srl.unserialize(sctx, resp);
 
-	// was this our request?
-	if (seqh.request_id == channel_request_id)
-	{
-		secure_channel_id = channel_id;
-		assert(secure_channel_id == resp.security_token.channel_id);
-		token_id = resp.security_token.token_id;
-		established = true;
-		if (attached_session)
-			attached_session->open_session();
-		return true;
-	}
-	else
-		return false;
+	secure_channel_id = channel_id;
+	assert(secure_channel_id == resp.security_token.channel_id);
+	token_id = resp.security_token.token_id;
+	established = true;
+	if (attached_session)
+		attached_session->open_session();
 }
 
 void opc_ua::tcp::MessageStream::close()
@@ -353,7 +439,7 @@ void opc_ua::tcp::MessageStream::handle_message(MessageHeader& h, ReadableSerial
 	switch (h.is_final)
 	{
 		case MessageIsFinal::INTERMEDIATE:
-			chunk_store[seqh.request_id].move(chunk);
+			chunk_store.add_chunk(seqh.request_id, chunk, ts.local_limits);
 			return;
 		case MessageIsFinal::ABORTED:
 		{
@@ -364,20 +450,13 @@ void opc_ua::tcp::MessageStream::handle_message(MessageHeader& h, ReadableSerial
 			srl.unserialize(chunk, reason);
 			// TODO: report the error
 
-			chunk_store.erase(seqh.request_id);
+			chunk_store.discard(seqh.request_id);
 			return;
 		}
 		case MessageIsFinal::FINAL:
 		{
-			auto it = chunk_store.find(seqh.request_id);
-
-			if (it != chunk_store.end())
-			{
-				body.move((*it).second);
-				chunk_store.erase(it);
-			}
-
-			body.move(chunk);
+			chunk_store.finish(seqh.request_id, chunk, ts.local_limits, body);
+			body.pullup();
 			break;
 		}
 		default:
@@ -394,7 +473,7 @@ void opc_ua::tcp::MessageStream::handle_message(MessageHeader& h, ReadableSerial
 
 	UInt32 base_id = reverse_id_mapping.at(msg_id.as_int);
 	Struct* msg = struct_constructors.at(base_id)();
-	msg->unserialize(body, srl);
+	srl.unserialize(body, *msg);
 
 	// convert to Response
 	// XXX: check type properly
@@ -425,19 +504,38 @@ void opc_ua::tcp::MessageStream::attach_session(SessionStream& s)
 		s.open_session();
 }
 
+void opc_ua::tcp::MessageStream::detach_session(SessionStream& s)
+{
+	if (attached_session == &s)
+		attached_session = nullptr;
+}
+
 void opc_ua::tcp::SessionStream::handle_create_session(std::unique_ptr<Response> msg, void* data)
 {
 	SessionStream* self = static_cast<SessionStream*>(data);
 	CreateSessionResponse* resp = dynamic_cast<CreateSessionResponse*>(msg.get());
 
+	// (a ServiceFault, e.g. Bad_Timeout)
+	if (!resp)
+	{
+		self->setup_failed(std::move(msg));
+		return;
+	}
+
 	self->session_id = resp->session_id;
 	self->authentication_token = resp->authentication_token;
+	++self->token_serial;
+
+	self->activate_session();
+}
 
+void opc_ua::tcp::SessionStream::activate_session()
+{
 	opc_ua::ActivateSessionRequest asr;
 	asr.user_identity_token.inner_object.reset(new opc_ua::AnonymousIdentityToken);
 	asr.locale_ids.emplace_back("en");
 
-	self->write_message(asr, self->handle_activate_session, data);
+	submit(asr, handle_activate_session, this, true);
 }
 
 void opc_ua::tcp::SessionStream::handle_activate_session(std::unique_ptr<Response> msg, void* data)
@@ -445,43 +543,359 @@ void opc_ua::tcp::SessionStream::handle_activate_session(std::unique_ptr<Respons
 	SessionStream* self = static_cast<SessionStream*>(data);
 	ActivateSessionResponse* resp = dynamic_cast<ActivateSessionResponse*>(msg.get());
 
-	if (resp->results.at(0) != 0)
-		throw std::runtime_error("Activate session request failed");
+	// the server dropped the session meanwhile, start a new one
+	if (!resp && msg->response_header.service_result == status::Bad_SessionIdInvalid)
+	{
+		self->authentication_token = NodeId();
+		++self->token_serial;
+		self->open_session();
+		return;
+	}
+	if (!resp)
+	{
+		self->setup_failed(std::move(msg));
+		return;
+	}
+	// activation refused
+	if (resp->results.empty() || resp->results[0] != 0)
+	{
+		callback_data& cb = self->session_established_callback;
+		if (cb.callback)
+			fail_request(msg->response_header.request_handle, cb,
+					resp->results.empty() ? status::Bad_UnknownResponse : resp->results[0]);
+		return;
+	}
 	self->session_established = true;
 
-	self->session_established_callback.callback(std::move(msg),
-			self->session_established_callback.data);
+	// requests waiting for the session (re-sent ones first)
+	self->send_queued();
+
+	if (self->session_established_callback.callback)
+		self->session_established_callback.callback(std::move(msg),
+				self->session_established_callback.data);
+}
+
+void opc_ua::tcp::SessionStream::setup_failed(std::unique_ptr<Response> fault)
+{
+	// the waiting requests stay queued (until they time out), the
+	// session can be set up again by reattaching
+	if (session_established_callback.callback)
+		session_established_callback.callback(std::move(fault),
+				session_established_callback.data);
 }
 
 opc_ua::tcp::SessionStream::SessionStream(const std::string& sess_name)
 	: secure_channel(nullptr), session_name(sess_name),
-	session_established(false)
+	session_established(false), destroying(false), token_serial(0),
+	in_flight(0), next_request_handle(1),
+	timeouts(timeout_wheel_slots, clock_ms() / timeout_tick),
+	timeout_timer(nullptr), max_in_flight(64), default_timeout(60000),
+	resend_in_flight(true)
 {
 }
 
+opc_ua::tcp::SessionStream::~SessionStream()
+{
+	if (secure_channel)
+		secure_channel->detach_session(*this);
+	secure_channel = nullptr;
+	session_established = false;
+	destroying = true;
+
+	// complete the pending requests, so that no callback (or future)
+	// is left waiting for a stream that is gone (the requests sent
+	// by the callbacks meanwhile fail in submit())
+	std::vector<std::pair<UInt32, callback_data>> failed;
+
+	for (auto& it : callbacks)
+	{
+		// (the session setup callbacks are our own)
+		if (!it.second.setup)
+			failed.emplace_back(it.first, std::move(it.second));
+	}
+	callbacks.clear();
+	queue.clear();
+
+	std::sort(failed.begin(), failed.end(),
+		[] (const std::pair<UInt32, callback_data>& a,
+			const std::pair<UInt32, callback_data>& b) {
+			return a.first < b.first;
+		});
+	for (auto& f : failed)
+		fail_request(f.first, f.second, status::Bad_CommunicationError);
+
+	if (timeout_timer)
+		event_free(timeout_timer);
+}
+
 void opc_ua::tcp::SessionStream::write_message(Request& msg, request_callback_type callback, void* cb_data)
 {
+	submit(msg, callback, cb_data, false);
+}
+
+void opc_ua::tcp::SessionStream::submit(Request& msg, request_callback_type callback, void* cb_data, bool setup)
+{
+	UInt32 handle = next_request_handle++;
+	UInt32 timeout;
+
+	if (destroying)
+	{
+		callback_data cb;
+		cb.callback = callback;
+		cb.data = cb_data;
+		fail_request(handle, cb, status::Bad_CommunicationError);
+		return;
+	}
+
 	msg.request_header.authentication_token = authentication_token;
+	msg.request_header.request_handle = handle;
+	if (!msg.request_header.timeout_hint)
+		msg.request_header.timeout_hint = default_timeout;
+	timeout = msg.request_header.timeout_hint;
+
+	callback_data& cb = callbacks[handle];
+	cb.callback = callback;
+	cb.data = cb_data;
+	cb.deadline = 0;
+	cb.timeout_tick = 0;
+	cb.sent = false;
+	cb.setup = setup;
+	if (timeout)
+	{
+		cb.deadline = clock_ms() + timeout;
+		// (rounded up, so that the deadline has passed when it fires)
+		cb.timeout_tick = timeouts.add(
+				(cb.deadline + timeout_tick - 1) / timeout_tick, handle);
+		arm_timeout_timer();
+	}
 
-	secure_channel->write_message(msg);
-	callbacks[msg.request_header.request_handle] = {
-		.callback = callback,
-		.data = cb_data
-	};
+	// wait for the session and a free slot (unless this is
+	// the session setup itself)
+	bool wait = !setup && (!session_established
+			|| (max_in_flight && in_flight >= max_in_flight));
+
+	try
+	{
+		if (wait || (resend_in_flight && !setup))
+		{
+			cb.body = take_body();
+			cb.token_serial = token_serial;
+			MessageStream::encode_request(msg, *cb.body);
+		}
+
+		if (wait)
+		{
+			queue.push_back(handle);
+			return;
+		}
+
+		if (cb.body)
+			secure_channel->write_encoded(*cb.body);
+		else
+			secure_channel->write_message(msg);
+	}
+	catch (std::exception& e)
+	{
+		cancel_timeout(handle, cb);
+		callbacks.erase(handle);
+		throw;
+	}
+	cb.sent = true;
+	++in_flight;
+}
+
+void opc_ua::tcp::SessionStream::send_queued()
+{
+	while (session_established && !queue.empty()
+			&& (!max_in_flight || in_flight < max_in_flight))
+	{
+		auto it = callbacks.find(queue.front());
+		queue.pop_front();
+
+		// timed out while waiting
+		if (it == callbacks.end())
+			continue;
+
+		callback_data& cb = it->second;
+		send_body(cb);
+		if (!resend_in_flight)
+			recycle_body(std::move(cb.body));
+		cb.sent = true;
+		++in_flight;
+	}
+}
+
+void opc_ua::tcp::SessionStream::send_body(callback_data& cb)
+{
+	// the session may have been created (or replaced) since it was
+	// encoded: splice the current authentication token in, in place
+	// of the old one (at the start of the request header, followed
+	// by the timestamp, which is refreshed as well)
+	if (cb.token_serial != token_serial)
+	{
+		BinarySerializer srl;
+		std::unique_ptr<MemorySerializationBuffer> body(take_body());
+		NodeId msg_id, old_token;
+		DateTime timestamp;
+
+		srl.unserialize(*cb.body, msg_id);
+		srl.unserialize(*cb.body, old_token);
+		srl.unserialize(*cb.body, timestamp);
+
+		srl.serialize(*body, msg_id);
+		srl.serialize(*body, authentication_token);
+		srl.serialize(*body, DateTime::now());
+		body->move(*cb.body);
+
+		recycle_body(std::move(cb.body));
+		cb.body = std::move(body);
+		cb.token_serial = token_serial;
+	}
+
+	secure_channel->write_encoded(*cb.body);
+}
+
+std::unique_ptr<opc_ua::MemorySerializationBuffer> opc_ua::tcp::SessionStream::take_body()
+{
+	if (spare_bodies.empty())
+		return std::unique_ptr<MemorySerializationBuffer>(new MemorySerializationBuffer);
+
+	std::unique_ptr<MemorySerializationBuffer> body(std::move(spare_bodies.back()));
+	spare_bodies.pop_back();
+	return body;
+}
+
+void opc_ua::tcp::SessionStream::recycle_body(std::unique_ptr<MemorySerializationBuffer> body)
+{
+	if (!body || spare_bodies.size() >= max_spare_bodies)
+		return;
+
+	body->skip(body->size());
+	spare_bodies.push_back(std::move(body));
+}
+
+void opc_ua::tcp::SessionStream::arm_timeout_timer()
+{
+	if (!evtimer_pending(timeout_timer, nullptr))
+	{
+		timeval tv = {0, timeout_tick * 1000};
+		evtimer_add(timeout_timer, &tv);
+	}
+}
+
+void opc_ua::tcp::SessionStream::cancel_timeout(UInt32 handle, const callback_data& cb)
+{
+	if (cb.deadline)
+		timeouts.cancel(cb.timeout_tick, handle);
+}
+
+void opc_ua::tcp::SessionStream::fail_request(UInt32 handle, callback_data& cb, StatusCode result)
+{
+	std::unique_ptr<Response> fault(new ServiceFault);
+
+	fault->response_header.timestamp = DateTime::now();
+	fault->response_header.request_handle = handle;
+	fault->response_header.service_result = result;
+	cb.callback(std::move(fault), cb.data);
+}
+
+void opc_ua::tcp::SessionStream::handle_timeouts(evutil_socket_t fd, short what, void* data)
+{
+	SessionStream* self = static_cast<SessionStream*>(data);
+	uint64_t now = clock_ms();
+
+	self->timeouts.advance(now / timeout_tick, [self] (UInt32 handle) {
+		auto it = self->callbacks.find(handle);
+
+		// answered meanwhile
+		if (it == self->callbacks.end())
+			return;
+
+		callback_data cb = std::move(it->second);
+		self->callbacks.erase(it);
+		// (a late response is ignored)
+		if (cb.sent)
+			--self->in_flight;
+
+		fail_request(handle, cb, status::Bad_Timeout);
+	});
+
+	// drop the leading requests that timed out in the queue
+	while (!self->queue.empty() && !self->callbacks.count(self->queue.front()))
+		self->queue.pop_front();
+	self->send_queued();
+
+	if (!self->timeouts.empty())
+		self->arm_timeout_timer();
 }
 
 void opc_ua::tcp::SessionStream::attach(MessageStream& ms, const std::string& endpoint, request_callback_type on_established, void* cb_data)
 {
+	// moving over from another channel: the responses to the requests
+	// in flight there are not going to come, send them again (in order,
+	// before the waiting ones) once the session is reactivated
+	if (secure_channel && secure_channel != &ms)
+		secure_channel->detach_session(*this);
+
+	std::vector<UInt32> resend;
+	std::vector<std::pair<UInt32, callback_data>> failed;
+	for (auto it = callbacks.begin(); it != callbacks.end(); )
+	{
+		callback_data& cb = it->second;
+
+		if (!cb.sent)
+			++it;
+		// (the session setup starts over)
+		else if (cb.setup)
+		{
+			cancel_timeout(it->first, cb);
+			it = callbacks.erase(it);
+		}
+		else if (cb.body)
+		{
+			cb.sent = false;
+			resend.push_back(it->first);
+			++it;
+		}
+		else
+		{
+			cancel_timeout(it->first, cb);
+			failed.emplace_back(it->first, std::move(cb));
+			it = callbacks.erase(it);
+		}
+	}
+	std::sort(resend.begin(), resend.end());
+	queue.insert(queue.begin(), resend.begin(), resend.end());
+	in_flight = 0;
+
 	secure_channel = &ms;
 	endpoint_uri = endpoint;
+	session_established = false;
+	if (!timeout_timer)
+	{
+		timeout_timer = evtimer_new(ms.base(), handle_timeouts, this);
+		if (!timeout_timer)
+			throw std::runtime_error("Unable to create timeout timer");
+	}
 	ms.attach_session(*this);
 
 	session_established_callback.callback = on_established;
 	session_established_callback.data = cb_data;
+
+	// (called last, as they can send new requests)
+	for (auto& f : failed)
+		fail_request(f.first, f.second, status::Bad_CommunicationError);
 }
 
 void opc_ua::tcp::SessionStream::open_session()
 {
+	// resume
+	if (authentication_token != NodeId())
+	{
+		activate_session();
+		return;
+	}
+
 	opc_ua::CreateSessionRequest csr(
 		opc_ua::ApplicationType::CLIENT,
 		endpoint_uri,
@@ -489,17 +903,30 @@ void opc_ua::tcp::SessionStream::open_session()
 		random_nonce(),
 		1E9);
 
-	write_message(csr, handle_create_session, this);
+	submit(csr, handle_create_session, this, true);
+}
+
+void opc_ua::tcp::SessionStream::detach(MessageStream& ms)
+{
+	if (secure_channel == &ms)
+		secure_channel = nullptr;
 }
 
 void opc_ua::tcp::SessionStream::on_message(std::unique_ptr<Response> msg)
 {
 	auto it = callbacks.find(msg->response_header.request_handle);
 
+	// timed out already
 	if (it == callbacks.end())
-		throw std::runtime_error("Got a response to unknown request");
-
-	it->second.callback(std::move(msg), it->second.data);
+		return;
 
+	callback_data cb = std::move(it->second);
+	cancel_timeout(it->first, cb);
 	callbacks.erase(it);
+	--in_flight;
+	recycle_body(std::move(cb.body));
+
+	// the queued requests go before any sent by the callback
+	send_queued();
+	cb.callback(std::move(msg), cb.data);
 }
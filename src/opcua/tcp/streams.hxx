@@ -13,10 +13,13 @@
 #include <event2/listener.h>
 
 #include <opcua/common/struct.hxx>
+#include <opcua/common/timerwheel.hxx>
 #include <opcua/common/types.hxx>
 #include <opcua/common/util.hxx>
+#include <opcua/tcp/future.hxx>
 #include <opcua/tcp/types.hxx>
 
+#include <deque>
 #include <functional>
 #include <memory>
 #include <unordered_map>
@@ -36,6 +39,8 @@ namespace opc_ua
 		// headers.
 		class TransportStream
 		{
+			friend class MessageStream;
+
 			bufferevent* bev;
 			ReadableSerializationBuffer in_ctx;
 			WritableSerializationBuffer out_ctx;
@@ -47,23 +52,45 @@ namespace opc_ua
 
 			// secure channels
 			std::unordered_map<UInt32, MessageStream*> secure_channels;
+			// channels waiting for the connection to request opening
 			std::vector<MessageStream*> secure_channel_queue;
+			// channels waiting for the OPN response, by request id
+			std::unordered_map<UInt32, MessageStream*> pending_channels;
+			// request id source for OPN (the responses are matched
+			// by the connection, before the channel has an id)
+			UInt32 next_opn_request_id;
 
 			static void read_handler(bufferevent* bev, void* ctx);
 			static void event_handler(bufferevent* bev, short what, void* ctx);
 
+			void send_hello(const std::string& endpoint);
+
 		public:
 			// remote side limits
 			ProtocolInfo remote_limits;
+			// limits announced in HEL, enforced on the received
+			// messages
+			ProtocolInfo local_limits;
+			// queued output size that is written out immediately
+			// rather than on the next event loop iteration (0 = never)
+			size_t flush_threshold;
 
 			TransportStream(event_base* ev);
 			~TransportStream();
 
+			// event loop serving the connection
+			event_base* base() const;
+
 			void connect_hostname(const char* hostname, uint16_t port, const std::string& endpoint, sa_family_t family = AF_UNSPEC);
+			// use an already connected socket (closed with the stream)
+			void connect_socket(evutil_socket_t sock, const std::string& endpoint);
 			void write_message(MessageType msg_type, MessageIsFinal is_final, ReadableSerializationBuffer& msg, UInt32 secure_channel_id = 0);
 
 			// Queue a request for secure channel.
 			void add_secure_channel(MessageStream& ms);
+			// Forget the channel (it is going away), the messages
+			// still coming for it are dropped.
+			void remove_secure_channel(MessageStream& ms);
 		};
 
 		// Wrapper stream that splits, encodes and transmits OPC messages.
@@ -73,34 +100,42 @@ namespace opc_ua
 			SessionStream* attached_session;
 
 			// sequential number source
-			static UInt32 sequence_number;
-			static UInt32 next_request_id;
+			UInt32 sequence_number;
+			UInt32 next_request_id;
 
 			// Is the channel established already?
 			bool established;
-			// OPN request identifier
-			UInt32 channel_request_id;
 			// secure channel id for write_message()
 			UInt32 secure_channel_id;
 			// security token id for further messages
 			UInt32 token_id;
 
 			// segmented message support
-			std::unordered_map<UInt32, MemorySerializationBuffer> chunk_store;
+			ChunkAssembler chunk_store;
 
 		public:
+			// (the transport stream has to outlive the channel)
 			MessageStream(TransportStream& new_ts);
 			~MessageStream();
 
+			// event loop serving the channel
+			event_base* base() const;
+
 			// fill in the request header and send the message through
-			// the associated secure channel.
-			void write_message(Request& msg, MessageType msg_type = MessageType::MSG);
-
-			// write secure channel request
-			void request_secure_channel();
-			// process secure channel response
-			// return true if it matches our request
-			bool process_secure_channel_response(ReadableSerializationBuffer& buf, UInt32 channel_id);
+			// the associated secure channel. Returns the request id.
+			UInt32 write_message(Request& msg, MessageType msg_type = MessageType::MSG);
+			// The same in two steps: encode the request (with its type
+			// id) into the body, then send it leaving the body in place,
+			// so that it can be sent again.
+			static void encode_request(Request& msg, WritableSerializationBuffer& body);
+			UInt32 write_encoded(ReadableSerializationBuffer& body, MessageType msg_type = MessageType::MSG);
+
+			// write secure channel request, return its request id
+			UInt32 request_secure_channel();
+			// process secure channel response (after the security
+			// and sequence headers, which the transport matched
+			// the request by)
+			void process_secure_channel_response(ReadableSerializationBuffer& buf, UInt32 channel_id);
 			// request closing secure channel
 			void close();
 			// handle incoming message.
@@ -108,6 +143,8 @@ namespace opc_ua
 
 			// Attach a new session stream.
 			void attach_session(SessionStream& s);
+			// Stop passing responses to the session (if still attached).
+			void detach_session(SessionStream& s);
 		};
 
 		// Wrapper that establishes a session over MessageStream. Supports
@@ -126,18 +163,54 @@ namespace opc_ua
 			std::string endpoint_uri;
 
 			bool session_established;
+			// set by the destructor, new requests fail right away
+			bool destroying;
 
 			// session info
 			NodeId session_id;
 			NodeId authentication_token;
+			// bumped on every authentication token change (the bodies
+			// kept with an older one get the current one spliced in)
+			UInt32 token_serial;
 
-			// request map
+			// request map, by request handle (both in flight
+			// and queued requests)
 			struct callback_data
 			{
 				request_callback_type callback;
 				void* data;
+				// time the request times out at, in ms (0 = never)
+				uint64_t deadline;
+				// its tick in the timeout wheel (for cancelling)
+				uint64_t timeout_tick;
+				// encoded request waiting for a free slot in
+				// the window, or kept for re-sending after
+				// a reattach
+				std::unique_ptr<MemorySerializationBuffer> body;
+				// token_serial of the authentication token in it
+				UInt32 token_serial;
+				// was it sent over the current channel?
+				bool sent;
+				// CreateSession/ActivateSession (bypasses the queue,
+				// not re-sent)
+				bool setup;
 			};
 			std::unordered_map<UInt32, callback_data> callbacks;
+			// handles of the queued requests, in order
+			std::deque<UInt32> queue;
+			// requests sent & not answered (or timed out) yet
+			size_t in_flight;
+			UInt32 next_request_handle;
+
+			// request timeouts (keyed by the request handle, cancelled
+			// when the request is answered or dropped), run by a timer
+			// while any are pending
+			TimerWheel<UInt32> timeouts;
+			event* timeout_timer;
+
+			// drained request bodies, for reuse (so that keeping
+			// the requests costs no allocations in the steady state)
+			std::vector<std::unique_ptr<MemorySerializationBuffer>> spare_bodies;
 
 			// callback for session start
 			callback_data session_established_callback;
@@ -145,20 +218,77 @@ namespace opc_ua
 			// internal callbacks
 			static void handle_create_session(std::unique_ptr<Response> msg, void* data);
 			static void handle_activate_session(std::unique_ptr<Response> msg, void* data);
+			static void handle_timeouts(evutil_socket_t fd, short what, void* data);
+
+			// register the request, send it unless it has to wait
+			void submit(Request& msg, request_callback_type callback, void* cb_data, bool setup);
+			void activate_session();
+			// pass the ServiceFault answering the session setup
+			// to the on_established callback
+			void setup_failed(std::unique_ptr<Response> fault);
+			void arm_timeout_timer();
+			// remove the request's timeout from the wheel
+			void cancel_timeout(UInt32 handle, const callback_data& cb);
+			// call back with a ServiceFault carrying the status
+			static void fail_request(UInt32 handle, callback_data& cb, StatusCode result);
+			// send queued requests while the window allows
+			void send_queued();
+			// send the kept body (with the current token)
+			void send_body(callback_data& cb);
+			std::unique_ptr<MemorySerializationBuffer> take_body();
+			void recycle_body(std::unique_ptr<MemorySerializationBuffer> body);
 
 		public:
-			SessionStream(const std::string& sess_name);
+			// requests sent without waiting for the responses,
+			// further ones are queued (0 = no limit)
+			size_t max_in_flight;
+			// timeout for requests that do not specify timeout_hint,
+			// in ms (0 = wait forever)
+			UInt32 default_timeout;
+			// keep the encoded body of every request until it is
+			// answered, so that the requests in flight can be re-sent
+			// when the session is reattached to a new channel
+			// (otherwise they fail with Bad_CommunicationError)
+			bool resend_in_flight;
 
-			// Send request and register the callback for response.
+			SessionStream(const std::string& sess_name);
+			// (the pending requests fail with Bad_CommunicationError,
+			// as do the ones sent from their callbacks)
+			~SessionStream();
+
+			// Send request (or queue it, if the window is full or the
+			// session is not active yet) and register the callback
+			// for response. If no response comes
+			// within the timeout, the callback gets a ServiceFault
+			// with Bad_Timeout instead.
 			void write_message(Request& msg, request_callback_type callback, void* cb_data);
-
-			// Attach to a secure channel.
+			// Send request and complete the future with the response
+			// (of the type matching the request).
+			template <class Req>
+			void write_message(Req& msg, Future<typename Req::response_type>& result);
+
+			// Attach to a secure channel. If the session was created
+			// already (i.e. this is a reconnect), it is resumed with
+			// ActivateSession alone and the requests in flight are sent
+			// again; a new session is created only if the server does
+			// not know the old one anymore. on_established is called
+			// once the session is active, or with a ServiceFault if
+			// the setup fails.
 			void attach(MessageStream& ms, const std::string& endpoint, request_callback_type on_established = {}, void* cb_data = nullptr);
 			// Start/resume session.
 			void open_session();
+			// The channel is going away.
+			void detach(MessageStream& ms);
 			// Handle incoming message.
 			void on_message(std::unique_ptr<Response> msg);
 		};
+
+		template <class Req>
+		void SessionStream::write_message(Req& msg, Future<typename Req::response_type>& result)
+		{
+			result.reset();
+			write_message(msg, Future<typename Req::response_type>::complete, &result);
+		}
 	};
 };
 
@@ -13,55 +13,85 @@
 
 #include <cassert>
 #include <cstdlib>
+#include <limits>
 #include <stdexcept>
 
-// Unix Epoch offset in seconds
-static opc_ua::Int64 unix_epoch_s = 11644478640;
+// Unix Epoch offset in seconds (from 1601-01-01)
+static constexpr opc_ua::Int64 unix_epoch_s = 11644473600;
+// DateTime resolution
+static constexpr opc_ua::Int64 ticks_per_second = 10000000;
+static constexpr opc_ua::Int64 ns_per_tick = 100;
 
 const opc_ua::tcp::ProtocolInfo opc_ua::tcp::libevent_protocol_info = {
 	.protocol_version = 0,
-	// our buffers are pretty much unlimited thanks to libevent
-	.receive_buffer_size = 0x10000000,
-	.send_buffer_size = 0x1000000,
-	.max_message_size = 0,
-	.max_chunk_count = 0,
+	// libevent could take larger chunks but the limits bound the memory
+	// a single peer can make us hold
+	.receive_buffer_size = 0x10000,
+	.send_buffer_size = 0x10000,
+	.max_message_size = 0x1000000,
+	.max_chunk_count = 1024,
 };
 
-void opc_ua::tcp::BinarySerializer::serialize(WritableSerializationBuffer& ctx, Boolean b)
+opc_ua::tcp::TransportError::TransportError(StatusCode st, const std::string& reason)
+	: std::runtime_error(reason), status(st)
 {
-	Byte i = b ? 1 : 0;
-
-	ctx.write(&i, sizeof(i));
 }
 
-void opc_ua::tcp::BinarySerializer::serialize(WritableSerializationBuffer& ctx, Byte i)
+opc_ua::tcp::ChunkAssembler::ChunkAssembler()
+	: buffered(0)
 {
-	ctx.write(&i, sizeof(i));
 }
 
-void opc_ua::tcp::BinarySerializer::serialize(WritableSerializationBuffer& ctx, UInt16 i)
+void opc_ua::tcp::ChunkAssembler::add_chunk(UInt32 request_id, ReadableSerializationBuffer& chunk, const ProtocolInfo& limits)
 {
-	ctx.write(&i, sizeof(i));
+	PartialMessage& m = messages[request_id];
+	size_t length = chunk.size();
+
+	// count the final chunk in already
+	if (limits.max_chunk_count && ++m.chunk_count >= limits.max_chunk_count)
+		throw TransportError(status::Bad_TcpMessageTooLarge, "Too many chunks in message");
+	// all messages in progress together are bound by the message size
+	// limit, so that interleaving does not multiply it
+	if (limits.max_message_size && buffered + length > limits.max_message_size)
+		throw TransportError(status::Bad_TcpMessageTooLarge, "Message size limit exceeded");
+
+	m.body.move(chunk);
+	buffered += length;
 }
 
-void opc_ua::tcp::BinarySerializer::serialize(WritableSerializationBuffer& ctx, UInt32 i)
+void opc_ua::tcp::ChunkAssembler::finish(UInt32 request_id, ReadableSerializationBuffer& chunk, const ProtocolInfo& limits, WritableSerializationBuffer& out)
 {
-	ctx.write(&i, sizeof(i));
-}
+	auto it = messages.find(request_id);
 
-void opc_ua::tcp::BinarySerializer::serialize(WritableSerializationBuffer& ctx, Int32 i)
-{
-	ctx.write(&i, sizeof(i));
+	if (it != messages.end())
+	{
+		size_t length = it->second.body.size();
+
+		if (limits.max_message_size && length + chunk.size() > limits.max_message_size)
+			throw TransportError(status::Bad_TcpMessageTooLarge, "Message size limit exceeded");
+
+		out.move(it->second.body);
+		buffered -= length;
+		messages.erase(it);
+	}
+
+	out.move(chunk);
 }
 
-void opc_ua::tcp::BinarySerializer::serialize(WritableSerializationBuffer& ctx, Int64 i)
+void opc_ua::tcp::ChunkAssembler::discard(UInt32 request_id)
 {
-	ctx.write(&i, sizeof(i));
+	auto it = messages.find(request_id);
+
+	if (it != messages.end())
+	{
+		buffered -= it->second.body.size();
+		messages.erase(it);
+	}
 }
 
-void opc_ua::tcp::BinarySerializer::serialize(WritableSerializationBuffer& ctx, Double f)
+opc_ua::tcp::BinarySerializer::BinarySerializer(size_t max_array_len)
+	: max_array_length(max_array_len)
 {
-	ctx.write(&f, sizeof(f));
 }
 
 void opc_ua::tcp::BinarySerializer::serialize(WritableSerializationBuffer& ctx, const String& s)
@@ -79,12 +109,19 @@ void opc_ua::tcp::BinarySerializer::serialize(WritableSerializationBuffer& ctx,
 {
 	// convert time_t to seconds since 1601-01-01
 	Int64 secs = unix_epoch_s + t.ts.tv_sec;
-	// and then to hundreds of nanoseconds, and add the remainder
-	Int64 ts = secs * 1E7 + (t.ts.tv_nsec / 100);
+	Int64 ts;
 
-	// the spec doesn't allow values earlier than 1601-01-01
-	if (ts < 0)
+	// the spec doesn't allow values earlier than 1601-01-01,
+	// and maps too large values to the maximum
+	if (secs < 0)
 		ts = 0;
+	else if (secs >= std::numeric_limits<Int64>::max() / ticks_per_second)
+		ts = std::numeric_limits<Int64>::max();
+	else
+	{
+		// and then to hundreds of nanoseconds, and add the remainder
+		ts = secs * ticks_per_second + t.ts.tv_nsec / ns_per_tick;
+	}
 
 	serialize(ctx, ts);
 }
@@ -133,7 +170,7 @@ void opc_ua::tcp::BinarySerializer::serialize(WritableSerializationBuffer& ctx,
 		case NodeIdType::NUMERIC:
 		{
 			// id can be encoded as two-byte id
-			if (n.as_int <= 0xff)
+			if (n.ns == 0 && n.as_int <= 0xff)
 			{
 				serialize(ctx, static_cast<Byte>(BinaryNodeIdType::TWO_BYTE));
 				serialize(ctx, static_cast<Byte>(n.as_int));
@@ -181,7 +218,45 @@ void opc_ua::tcp::BinarySerializer::serialize(WritableSerializationBuffer& ctx,
 
 void opc_ua::tcp::BinarySerializer::serialize(WritableSerializationBuffer& ctx, const Struct& s)
 {
-	s.serialize(ctx, *this);
+	// use the statically dispatched field lists where available
+	switch (s.get_node_id())
+	{
+		case RequestHeader::NODE_ID:
+			serialize(ctx, static_cast<const RequestHeader&>(s));
+			break;
+		case ResponseHeader::NODE_ID:
+			serialize(ctx, static_cast<const ResponseHeader&>(s));
+			break;
+		case DiagnosticInfo::NODE_ID:
+			serialize(ctx, static_cast<const DiagnosticInfo&>(s));
+			break;
+		case QualifiedName::NODE_ID:
+			serialize(ctx, static_cast<const QualifiedName&>(s));
+			break;
+		case ReadValueId::NODE_ID:
+			serialize(ctx, static_cast<const ReadValueId&>(s));
+			break;
+		case ReadRequest::NODE_ID:
+			serialize(ctx, static_cast<const ReadRequest&>(s));
+			break;
+		case DataValue::NODE_ID:
+			serialize(ctx, static_cast<const DataValue&>(s));
+			break;
+		case ReadResponse::NODE_ID:
+			serialize(ctx, static_cast<const ReadResponse&>(s));
+			break;
+		case WriteValue::NODE_ID:
+			serialize(ctx, static_cast<const WriteValue&>(s));
+			break;
+		case WriteRequest::NODE_ID:
+			serialize(ctx, static_cast<const WriteRequest&>(s));
+			break;
+		case WriteResponse::NODE_ID:
+			serialize(ctx, static_cast<const WriteResponse&>(s));
+			break;
+		default:
+			s.serialize(ctx, *this);
+	}
 }
 
 void opc_ua::tcp::BinarySerializer::serialize(WritableSerializationBuffer& ctx, const ExtensionObject& s)
@@ -200,14 +275,26 @@ void opc_ua::tcp::BinarySerializer::serialize(WritableSerializationBuffer& ctx,
 
 		NodeId mapped_id(id_mapping.at(orig_id.as_int));
 
-		MemorySerializationBuffer lctx;
-		// serialize to buffer to obtain length
-		s.inner_object.get()->serialize(lctx, *this);
-
 		serialize(ctx, mapped_id);
 		serialize(ctx, Byte(1));
-		serialize(ctx, static_cast<UInt32>(lctx.size()));
-		ctx.move(lctx);
+
+		if (ctx.patchable())
+		{
+			// fill the length in once the object is encoded
+			size_t length_pos = ctx.mark();
+			serialize(ctx, UInt32(0));
+
+			size_t start = ctx.mark();
+			serialize(ctx, *s.inner_object);
+
+			UInt32 length = ctx.mark() - start;
+			ctx.patch(length_pos, &length, sizeof(length));
+		}
+		else
+		{
+			serialize(ctx, static_cast<UInt32>(encoded_size(*s.inner_object)));
+			serialize(ctx, *s.inner_object);
+		}
 	}
 }
 
@@ -343,58 +430,22 @@ void opc_ua::tcp::BinarySerializer::serialize(WritableSerializationBuffer& ctx,
 	a.serialize_all(ctx, *this);
 }
 
-void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, Boolean& b)
-{
-	Byte i;
-	ctx.read(&i, sizeof(i));
-
-	b = !!i;
-}
-
-void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, Byte& i)
-{
-	ctx.read(&i, sizeof(i));
-}
-
-void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, UInt16& i)
-{
-	ctx.read(&i, sizeof(i));
-}
-
-void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, UInt32& i)
-{
-	ctx.read(&i, sizeof(i));
-}
-
-void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, Int32& i)
-{
-	ctx.read(&i, sizeof(i));
-}
-
-void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, Int64& i)
-{
-	ctx.read(&i, sizeof(i));
-}
-
-void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, Double& f)
-{
-	ctx.read(&f, sizeof(f));
-}
-
 void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, String& s)
 {
 	Int32 length;
 	ctx.read(&length, sizeof(length));
 
-	s.clear();
-	if (length != -1)
+	// negative length denotes null string
+	if (length > 0)
 	{
-		// XXX: very ugly
-		char buf[length];
-		ctx.read(buf, length);
+		if (static_cast<size_t>(length) > ctx.size())
+			throw std::runtime_error("String length exceeds remaining message size");
 
-		s.append(buf, length);
+		s.resize(length);
+		ctx.read(&s[0], length);
 	}
+	else
+		s.clear();
 }
 
 void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, DateTime& t)
@@ -402,12 +453,19 @@ void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx
 	Int64 ts;
 	unserialize(ctx, ts);
 
-	// first, take the ns part
-	t.ts.tv_nsec = (ts % static_cast<Int64>(1E7)) * 100;
-	// shift it down to seconds
-	ts /= 1E7;
+	// split into seconds and the remainder, rounding towards
+	// negative infinity so that tv_nsec stays non-negative
+	Int64 secs = ts / ticks_per_second;
+	Int64 rem = ts % ticks_per_second;
+	if (rem < 0)
+	{
+		rem += ticks_per_second;
+		--secs;
+	}
+
+	t.ts.tv_nsec = rem * ns_per_tick;
 	// and readjust to unix Epoch
-	t.ts.tv_sec = ts - unix_epoch_s;
+	t.ts.tv_sec = secs - unix_epoch_s;
 }
 
 void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, LocalizedText& s)
@@ -496,19 +554,22 @@ void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx
 		case BinaryNodeIdType::STRING:
 		{
 			UInt16 ns;
-			CharArray id;
 			unserialize(ctx, ns);
-			unserialize(ctx, id);
-			n = NodeId(id, ns);
+			// decode in place to reuse the string storage
+			if (n.type != NodeIdType::STRING)
+				n = NodeId(CharArray(), ns);
+			n.ns = ns;
+			unserialize(ctx, n.as_chararray);
 			break;
 		}
 		case BinaryNodeIdType::BYTE_STRING:
 		{
 			UInt16 ns;
-			ByteString id;
 			unserialize(ctx, ns);
-			unserialize(ctx, id);
-			n = NodeId(id, ns, 0);
+			if (n.type != NodeIdType::BYTE_STRING)
+				n = NodeId(ByteString(), ns, 0);
+			n.ns = ns;
+			unserialize(ctx, n.as_bytestring);
 			break;
 		}
 		default:
@@ -518,7 +579,45 @@ void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx
 
 void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, Struct& s)
 {
-	s.unserialize(ctx, *this);
+	// use the statically dispatched field lists where available
+	switch (s.get_node_id())
+	{
+		case RequestHeader::NODE_ID:
+			unserialize(ctx, static_cast<RequestHeader&>(s));
+			break;
+		case ResponseHeader::NODE_ID:
+			unserialize(ctx, static_cast<ResponseHeader&>(s));
+			break;
+		case DiagnosticInfo::NODE_ID:
+			unserialize(ctx, static_cast<DiagnosticInfo&>(s));
+			break;
+		case QualifiedName::NODE_ID:
+			unserialize(ctx, static_cast<QualifiedName&>(s));
+			break;
+		case ReadValueId::NODE_ID:
+			unserialize(ctx, static_cast<ReadValueId&>(s));
+			break;
+		case ReadRequest::NODE_ID:
+			unserialize(ctx, static_cast<ReadRequest&>(s));
+			break;
+		case DataValue::NODE_ID:
+			unserialize(ctx, static_cast<DataValue&>(s));
+			break;
+		case ReadResponse::NODE_ID:
+			unserialize(ctx, static_cast<ReadResponse&>(s));
+			break;
+		case WriteValue::NODE_ID:
+			unserialize(ctx, static_cast<WriteValue&>(s));
+			break;
+		case WriteRequest::NODE_ID:
+			unserialize(ctx, static_cast<WriteRequest&>(s));
+			break;
+		case WriteResponse::NODE_ID:
+			unserialize(ctx, static_cast<WriteResponse&>(s));
+			break;
+		default:
+			s.unserialize(ctx, *this);
+	}
 }
 
 void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, ExtensionObject& s)
@@ -542,15 +641,36 @@ void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx
 			throw std::runtime_error("Non-standard namespaces are not supported");
 
 		UInt32 base_id = reverse_id_mapping.at(id.as_int);
-		s.inner_object.reset(struct_constructors.at(base_id)());
+		// (an object of the same type is decoded over)
+		if (!s.inner_object || s.inner_object->get_node_id() != base_id)
+			s.inner_object.reset(struct_constructors.at(base_id)());
 
 		UInt32 length;
 		unserialize(ctx, length);
 
+		// decode the body in place if the data is in a window already
+		if (ctx.windowed())
+		{
+			size_t end = ctx.limit(length);
+
+			try
+			{
+				unserialize(ctx, *s.inner_object);
+			}
+			catch (std::exception& e)
+			{
+				ctx.unlimit(end);
+				throw;
+			}
+			ctx.unlimit(end);
+			return;
+		}
+
 		MemorySerializationBuffer buf;
 		buf.move(ctx, length);
+		buf.pullup();
 
-		s.inner_object.get()->unserialize(buf, *this);
+		unserialize(buf, *s.inner_object);
 	}
 }
 
@@ -567,6 +687,7 @@ void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx
 	if (is_array)
 		throw std::runtime_error("Variant arrays unsupported");
 
+	v.reset(vtype);
 	switch (vtype)
 	{
 		case VariantType::NONE:
@@ -605,9 +726,9 @@ void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx
 			unserialize(ctx, v.as_bytestring);
 			break;
 		default:
+			v.reset();
 			throw std::runtime_error("Unsupported variant type");
 	}
-	v.variant_type = vtype;
 }
 
 void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, MessageIsFinal& b)
@@ -682,7 +803,338 @@ void opc_ua::tcp::BinarySerializer::unserialize(ReadableSerializationBuffer& ctx
 	Int32 length;
 	ctx.read(&length, sizeof(length));
 
-	a.clear();
 	if (length > 0)
+	{
+		check_array_length(ctx, length, a.min_element_size());
 		a.unserialize_n(ctx, *this, length);
+	}
+	else
+		a.clear();
+}
+
+void opc_ua::tcp::BinarySerializer::check_array_length(ReadableSerializationBuffer& ctx, size_t length, size_t min_element_size) const
+{
+	if (length > ctx.size() / min_element_size)
+		throw std::runtime_error("Array length exceeds remaining message size");
+	if (max_array_length && length > max_array_length)
+		throw std::runtime_error("Array length limit exceeded");
+}
+
+opc_ua::tcp::BinarySizeCalculator::BinarySizeCalculator()
+	: length(0)
+{
+}
+
+opc_ua::WritableSerializationBuffer& opc_ua::tcp::BinarySizeCalculator::null_buffer()
+{
+	// never written to, so it can be shared
+	static MemorySerializationBuffer buf;
+
+	return buf;
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize(WritableSerializationBuffer& ctx, Boolean b)
+{
+	length += sizeof(Byte);
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize(WritableSerializationBuffer& ctx, Byte i)
+{
+	length += sizeof(i);
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize(WritableSerializationBuffer& ctx, UInt16 i)
+{
+	length += sizeof(i);
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize(WritableSerializationBuffer& ctx, UInt32 i)
+{
+	length += sizeof(i);
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize(WritableSerializationBuffer& ctx, Int32 i)
+{
+	length += sizeof(i);
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize(WritableSerializationBuffer& ctx, Int64 i)
+{
+	length += sizeof(i);
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize(WritableSerializationBuffer& ctx, Double f)
+{
+	length += sizeof(f);
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize(WritableSerializationBuffer& ctx, const String& s)
+{
+	length += sizeof(Int32) + s.size();
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize(WritableSerializationBuffer& ctx, DateTime t)
+{
+	length += sizeof(Int64);
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize(WritableSerializationBuffer& ctx, const LocalizedText& s)
+{
+	length += sizeof(Byte);
+	if (!s.locale.empty())
+		serialize(ctx, s.locale);
+	if (!s.text.empty())
+		serialize(ctx, s.text);
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize(WritableSerializationBuffer& ctx, const GUID& g)
+{
+	length += g.guid.size();
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize(WritableSerializationBuffer& ctx, const NodeId& n)
+{
+	// encoding byte
+	length += sizeof(Byte);
+
+	switch (n.type)
+	{
+		case NodeIdType::NUMERIC:
+		{
+			if (n.ns == 0 && n.as_int <= 0xff)
+				length += sizeof(Byte);
+			else if (n.ns <= 0xff && n.as_int <= 0xffff)
+				length += sizeof(Byte) + sizeof(UInt16);
+			else
+				length += sizeof(n.ns) + sizeof(n.as_int);
+			break;
+		}
+		case NodeIdType::GUID:
+			length += sizeof(n.ns);
+			serialize(ctx, n.as_guid);
+			break;
+		case NodeIdType::STRING:
+			length += sizeof(n.ns);
+			serialize(ctx, n.as_chararray);
+			break;
+		case NodeIdType::BYTE_STRING:
+			length += sizeof(n.ns);
+			serialize(ctx, n.as_bytestring);
+			break;
+		default:
+			assert(not_reached);
+	}
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize(WritableSerializationBuffer& ctx, const Struct& s)
+{
+	s.serialize(ctx, *this);
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize(WritableSerializationBuffer& ctx, const ExtensionObject& s)
+{
+	if (!s.inner_object)
+		serialize(ctx, NodeId(0));
+	else
+	{
+		serialize(ctx, NodeId(id_mapping.at(s.inner_object->get_node_id())));
+		length += sizeof(UInt32);
+		serialize(ctx, *s.inner_object);
+	}
+
+	// encoding byte
+	length += sizeof(Byte);
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize(WritableSerializationBuffer& ctx, const Variant& v)
+{
+	// encoding mask
+	length += sizeof(Byte);
+
+	switch (v.variant_type)
+	{
+		case VariantType::NONE:
+			break;
+		case VariantType::BOOLEAN:
+			serialize(ctx, v.as_boolean);
+			break;
+		case VariantType::BYTE:
+			serialize(ctx, v.as_byte);
+			break;
+		case VariantType::UINT16:
+			serialize(ctx, v.as_uint16);
+			break;
+		case VariantType::INT32:
+			serialize(ctx, v.as_int32);
+			break;
+		case VariantType::UINT32:
+			serialize(ctx, v.as_uint32);
+			break;
+		case VariantType::INT64:
+			serialize(ctx, v.as_int64);
+			break;
+		case VariantType::DOUBLE:
+			serialize(ctx, v.as_double);
+			break;
+		case VariantType::STRING:
+			serialize(ctx, v.as_string);
+			break;
+		case VariantType::DATETIME:
+			serialize(ctx, v.as_datetime);
+			break;
+		case VariantType::GUID:
+			serialize(ctx, v.as_guid);
+			break;
+		case VariantType::BYTESTRING:
+			serialize(ctx, v.as_bytestring);
+			break;
+		default:
+			throw std::runtime_error("Unsupported variant type");
+	}
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize(WritableSerializationBuffer& ctx, const AbstractArraySerialization& a)
+{
+	length += sizeof(Int32);
+	a.serialize_all(ctx, *this);
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize_n(WritableSerializationBuffer& ctx, const Byte* v, size_t count)
+{
+	length += count * sizeof(*v);
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize_n(WritableSerializationBuffer& ctx, const UInt16* v, size_t count)
+{
+	length += count * sizeof(*v);
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize_n(WritableSerializationBuffer& ctx, const UInt32* v, size_t count)
+{
+	length += count * sizeof(*v);
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize_n(WritableSerializationBuffer& ctx, const Int32* v, size_t count)
+{
+	length += count * sizeof(*v);
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize_n(WritableSerializationBuffer& ctx, const Int64* v, size_t count)
+{
+	length += count * sizeof(*v);
+}
+
+void opc_ua::tcp::BinarySizeCalculator::serialize_n(WritableSerializationBuffer& ctx, const Double* v, size_t count)
+{
+	length += count * sizeof(*v);
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize(ReadableSerializationBuffer& ctx, Boolean& b)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize(ReadableSerializationBuffer& ctx, Byte& i)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize(ReadableSerializationBuffer& ctx, UInt16& i)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize(ReadableSerializationBuffer& ctx, Int32& i)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize(ReadableSerializationBuffer& ctx, UInt32& i)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize(ReadableSerializationBuffer& ctx, Int64& i)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize(ReadableSerializationBuffer& ctx, Double& f)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize(ReadableSerializationBuffer& ctx, String& s)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize(ReadableSerializationBuffer& ctx, DateTime& t)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize(ReadableSerializationBuffer& ctx, LocalizedText& s)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize(ReadableSerializationBuffer& ctx, GUID& g)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize(ReadableSerializationBuffer& ctx, NodeId& n)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize(ReadableSerializationBuffer& ctx, Struct& s)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize(ReadableSerializationBuffer& ctx, ExtensionObject& s)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize(ReadableSerializationBuffer& ctx, Variant& v)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize(ReadableSerializationBuffer& ctx, const AbstractArrayUnserialization& a)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize_n(ReadableSerializationBuffer& ctx, Byte* v, size_t count)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize_n(ReadableSerializationBuffer& ctx, UInt16* v, size_t count)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize_n(ReadableSerializationBuffer& ctx, UInt32* v, size_t count)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize_n(ReadableSerializationBuffer& ctx, Int32* v, size_t count)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize_n(ReadableSerializationBuffer& ctx, Int64* v, size_t count)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
+}
+
+void opc_ua::tcp::BinarySizeCalculator::unserialize_n(ReadableSerializationBuffer& ctx, Double* v, size_t count)
+{
+	throw std::logic_error("BinarySizeCalculator can not unserialize");
 }
@@ -12,6 +12,11 @@
 #include <opcua/common/types.hxx>
 #include <opcua/common/util.hxx>
 
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+
 namespace opc_ua
 {
 	namespace tcp
@@ -114,6 +119,18 @@ namespace opc_ua
 			String reason;
 		};
 
+		// Violation of the negotiated limits. On receiving, the
+		// connection can not be used anymore, and the server reports
+		// the status to the client in an ERR message before closing it.
+		// On sending, the message is aborted with the status instead.
+		class TransportError : public std::runtime_error
+		{
+		public:
+			StatusCode status;
+
+			TransportError(StatusCode st, const std::string& reason);
+		};
+
 		struct AsymmetricAlgorithmSecurityHeader
 		{
 			String security_policy_uri;
@@ -145,8 +162,50 @@ namespace opc_ua
 			// Byte signature[];
 		};
 
-		struct BinarySerializer : public Serializer
+		// Reassembly of chunked messages, within the limits announced
+		// to the remote side. The chunk bodies are moved over from
+		// the input buffer as-is, so no data is copied until the final
+		// pullup(). Throws TransportError when a limit is exceeded.
+		class ChunkAssembler
+		{
+			struct PartialMessage
+			{
+				MemorySerializationBuffer body;
+				UInt32 chunk_count;
+
+				PartialMessage() : chunk_count(0) {}
+			};
+
+			std::unordered_map<UInt32, PartialMessage> messages;
+			// total size of all partial messages
+			size_t buffered;
+
+		public:
+			ChunkAssembler();
+
+			// store an intermediate chunk of the message
+			void add_chunk(UInt32 request_id, ReadableSerializationBuffer& chunk, const ProtocolInfo& limits);
+			// move the complete message along with the final chunk
+			// into out
+			void finish(UInt32 request_id, ReadableSerializationBuffer& chunk, const ProtocolInfo& limits, WritableSerializationBuffer& out);
+			// discard the chunks of an aborted message
+			void discard(UInt32 request_id);
+		};
+
+		// OPC UA Binary encoding. The class is final, so that calls
+		// made through BinarySerializer itself are resolved statically.
+		// The field lists of hot structs are instantiated for it, and
+		// primitive types are encoded inline.
+		struct BinarySerializer final : public Serializer
 		{
+			// longest array accepted when decoding (0 = no limit
+			// other than the remaining message size)
+			size_t max_array_length;
+
+			static constexpr size_t default_max_array_length = 0x10000;
+
+			BinarySerializer(size_t max_array_len = default_max_array_length);
+
 			virtual void serialize(WritableSerializationBuffer& ctx, Boolean b);
 			virtual void serialize(WritableSerializationBuffer& ctx, Byte i);
 			virtual void serialize(WritableSerializationBuffer& ctx, UInt16 i);
@@ -181,6 +240,20 @@ namespace opc_ua
 			virtual void unserialize(ReadableSerializationBuffer& ctx, Variant& v);
 			virtual void unserialize(ReadableSerializationBuffer& ctx, const AbstractArrayUnserialization& a);
 
+			virtual void serialize_n(WritableSerializationBuffer& ctx, const Byte* v, size_t count);
+			virtual void serialize_n(WritableSerializationBuffer& ctx, const UInt16* v, size_t count);
+			virtual void serialize_n(WritableSerializationBuffer& ctx, const UInt32* v, size_t count);
+			virtual void serialize_n(WritableSerializationBuffer& ctx, const Int32* v, size_t count);
+			virtual void serialize_n(WritableSerializationBuffer& ctx, const Int64* v, size_t count);
+			virtual void serialize_n(WritableSerializationBuffer& ctx, const Double* v, size_t count);
+
+			virtual void unserialize_n(ReadableSerializationBuffer& ctx, Byte* v, size_t count);
+			virtual void unserialize_n(ReadableSerializationBuffer& ctx, UInt16* v, size_t count);
+			virtual void unserialize_n(ReadableSerializationBuffer& ctx, UInt32* v, size_t count);
+			virtual void unserialize_n(ReadableSerializationBuffer& ctx, Int32* v, size_t count);
+			virtual void unserialize_n(ReadableSerializationBuffer& ctx, Int64* v, size_t count);
+			virtual void unserialize_n(ReadableSerializationBuffer& ctx, Double* v, size_t count);
+
 			// UA TCP specific types
 			void serialize(WritableSerializationBuffer& ctx, MessageIsFinal b);
 			void serialize(WritableSerializationBuffer& ctx, MessageType t);
@@ -204,7 +277,329 @@ namespace opc_ua
 			void unserialize(ReadableSerializationBuffer& ctx, AsymmetricAlgorithmSecurityHeader& h);
 			void unserialize(ReadableSerializationBuffer& ctx, SymmetricAlgorithmSecurityHeader& h);
 			void unserialize(ReadableSerializationBuffer& ctx, SequenceHeader& h);
+
+			// statically dispatched structs and arrays
+			template <class T>
+			auto serialize(WritableSerializationBuffer& ctx, const T& s)
+				-> decltype(s.serialize_fields(ctx, *this));
+			template <class T>
+			void serialize(WritableSerializationBuffer& ctx, const ArraySerialization<T>& a);
+
+			template <class T>
+			auto unserialize(ReadableSerializationBuffer& ctx, T& s)
+				-> decltype(s.unserialize_fields(ctx, *this));
+			template <class T>
+			void unserialize(ReadableSerializationBuffer& ctx, const ArrayUnserialization<T>& a);
+
+		private:
+			// array elements, copied as a block or one by one
+			template <class T>
+			void serialize_elements(WritableSerializationBuffer& ctx, const Array<T>& a, std::true_type);
+			template <class T>
+			void serialize_elements(WritableSerializationBuffer& ctx, const Array<T>& a, std::false_type);
+			template <class T>
+			void unserialize_elements(ReadableSerializationBuffer& ctx, Array<T>& a, std::true_type);
+			template <class T>
+			void unserialize_elements(ReadableSerializationBuffer& ctx, Array<T>& a, std::false_type);
+
+			// throw if the array cannot fit in the remaining data
+			// or exceeds max_array_length (before allocating it)
+			void check_array_length(ReadableSerializationBuffer& ctx, size_t length, size_t min_element_size) const;
+		};
+
+		// Computes the length of OPC UA Binary encoding without
+		// producing it. The buffers passed are not used.
+		struct BinarySizeCalculator final : public Serializer
+		{
+			// total length of the values passed so far
+			size_t length;
+
+			BinarySizeCalculator();
+
+			// an (unused) buffer that can be passed to serialize()
+			static WritableSerializationBuffer& null_buffer();
+
+			virtual void serialize(WritableSerializationBuffer& ctx, Boolean b);
+			virtual void serialize(WritableSerializationBuffer& ctx, Byte i);
+			virtual void serialize(WritableSerializationBuffer& ctx, UInt16 i);
+			virtual void serialize(WritableSerializationBuffer& ctx, UInt32 i);
+			virtual void serialize(WritableSerializationBuffer& ctx, Int32 i);
+			virtual void serialize(WritableSerializationBuffer& ctx, Int64 i);
+			virtual void serialize(WritableSerializationBuffer& ctx, Double f);
+			virtual void serialize(WritableSerializationBuffer& ctx, const String& s);
+			virtual void serialize(WritableSerializationBuffer& ctx, DateTime t);
+			virtual void serialize(WritableSerializationBuffer& ctx, const LocalizedText& s);
+			virtual void serialize(WritableSerializationBuffer& ctx, const GUID& g);
+			virtual void serialize(WritableSerializationBuffer& ctx, const NodeId& n);
+			virtual void serialize(WritableSerializationBuffer& ctx, const Struct& s);
+			virtual void serialize(WritableSerializationBuffer& ctx, const ExtensionObject& s);
+			virtual void serialize(WritableSerializationBuffer& ctx, const Variant& v);
+			virtual void serialize(WritableSerializationBuffer& ctx, const AbstractArraySerialization& a);
+
+			virtual void serialize_n(WritableSerializationBuffer& ctx, const Byte* v, size_t count);
+			virtual void serialize_n(WritableSerializationBuffer& ctx, const UInt16* v, size_t count);
+			virtual void serialize_n(WritableSerializationBuffer& ctx, const UInt32* v, size_t count);
+			virtual void serialize_n(WritableSerializationBuffer& ctx, const Int32* v, size_t count);
+			virtual void serialize_n(WritableSerializationBuffer& ctx, const Int64* v, size_t count);
+			virtual void serialize_n(WritableSerializationBuffer& ctx, const Double* v, size_t count);
+
+			// (all throw std::logic_error)
+			virtual void unserialize(ReadableSerializationBuffer& ctx, Boolean& b);
+			virtual void unserialize(ReadableSerializationBuffer& ctx, Byte& i);
+			virtual void unserialize(ReadableSerializationBuffer& ctx, UInt16& i);
+			virtual void unserialize(ReadableSerializationBuffer& ctx, Int32& i);
+			virtual void unserialize(ReadableSerializationBuffer& ctx, UInt32& i);
+			virtual void unserialize(ReadableSerializationBuffer& ctx, Int64& i);
+			virtual void unserialize(ReadableSerializationBuffer& ctx, Double& f);
+			virtual void unserialize(ReadableSerializationBuffer& ctx, String& s);
+			virtual void unserialize(ReadableSerializationBuffer& ctx, DateTime& t);
+			virtual void unserialize(ReadableSerializationBuffer& ctx, LocalizedText& s);
+			virtual void unserialize(ReadableSerializationBuffer& ctx, GUID& g);
+			virtual void unserialize(ReadableSerializationBuffer& ctx, NodeId& n);
+			virtual void unserialize(ReadableSerializationBuffer& ctx, Struct& s);
+			virtual void unserialize(ReadableSerializationBuffer& ctx, ExtensionObject& s);
+			virtual void unserialize(ReadableSerializationBuffer& ctx, Variant& v);
+			virtual void unserialize(ReadableSerializationBuffer& ctx, const AbstractArrayUnserialization& a);
+
+			virtual void unserialize_n(ReadableSerializationBuffer& ctx, Byte* v, size_t count);
+			virtual void unserialize_n(ReadableSerializationBuffer& ctx, UInt16* v, size_t count);
+			virtual void unserialize_n(ReadableSerializationBuffer& ctx, UInt32* v, size_t count);
+			virtual void unserialize_n(ReadableSerializationBuffer& ctx, Int32* v, size_t count);
+			virtual void unserialize_n(ReadableSerializationBuffer& ctx, Int64* v, size_t count);
+			virtual void unserialize_n(ReadableSerializationBuffer& ctx, Double* v, size_t count);
 		};
+
+		// get the length of OPC UA Binary encoding of a value
+		template <class T>
+		size_t encoded_size(const T& v);
+
+		// primitive types
+		inline void BinarySerializer::serialize(WritableSerializationBuffer& ctx, Boolean b)
+		{
+			Byte i = b ? 1 : 0;
+
+			ctx.write(&i, sizeof(i));
+		}
+
+		inline void BinarySerializer::serialize(WritableSerializationBuffer& ctx, Byte i)
+		{
+			ctx.write(&i, sizeof(i));
+		}
+
+		inline void BinarySerializer::serialize(WritableSerializationBuffer& ctx, UInt16 i)
+		{
+			ctx.write(&i, sizeof(i));
+		}
+
+		inline void BinarySerializer::serialize(WritableSerializationBuffer& ctx, UInt32 i)
+		{
+			ctx.write(&i, sizeof(i));
+		}
+
+		inline void BinarySerializer::serialize(WritableSerializationBuffer& ctx, Int32 i)
+		{
+			ctx.write(&i, sizeof(i));
+		}
+
+		inline void BinarySerializer::serialize(WritableSerializationBuffer& ctx, Int64 i)
+		{
+			ctx.write(&i, sizeof(i));
+		}
+
+		inline void BinarySerializer::serialize(WritableSerializationBuffer& ctx, Double f)
+		{
+			ctx.write(&f, sizeof(f));
+		}
+
+		inline void BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, Boolean& b)
+		{
+			Byte i;
+			ctx.read(&i, sizeof(i));
+
+			b = !!i;
+		}
+
+		inline void BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, Byte& i)
+		{
+			ctx.read(&i, sizeof(i));
+		}
+
+		inline void BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, UInt16& i)
+		{
+			ctx.read(&i, sizeof(i));
+		}
+
+		inline void BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, UInt32& i)
+		{
+			ctx.read(&i, sizeof(i));
+		}
+
+		inline void BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, Int32& i)
+		{
+			ctx.read(&i, sizeof(i));
+		}
+
+		inline void BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, Int64& i)
+		{
+			ctx.read(&i, sizeof(i));
+		}
+
+		inline void BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, Double& f)
+		{
+			ctx.read(&f, sizeof(f));
+		}
+
+		// primitive arrays; the host byte order is used, as for scalars
+		inline void BinarySerializer::serialize_n(WritableSerializationBuffer& ctx, const Byte* v, size_t count)
+		{
+			ctx.write(v, count * sizeof(*v));
+		}
+
+		inline void BinarySerializer::serialize_n(WritableSerializationBuffer& ctx, const UInt16* v, size_t count)
+		{
+			ctx.write(v, count * sizeof(*v));
+		}
+
+		inline void BinarySerializer::serialize_n(WritableSerializationBuffer& ctx, const UInt32* v, size_t count)
+		{
+			ctx.write(v, count * sizeof(*v));
+		}
+
+		inline void BinarySerializer::serialize_n(WritableSerializationBuffer& ctx, const Int32* v, size_t count)
+		{
+			ctx.write(v, count * sizeof(*v));
+		}
+
+		inline void BinarySerializer::serialize_n(WritableSerializationBuffer& ctx, const Int64* v, size_t count)
+		{
+			ctx.write(v, count * sizeof(*v));
+		}
+
+		inline void BinarySerializer::serialize_n(WritableSerializationBuffer& ctx, const Double* v, size_t count)
+		{
+			ctx.write(v, count * sizeof(*v));
+		}
+
+		inline void BinarySerializer::unserialize_n(ReadableSerializationBuffer& ctx, Byte* v, size_t count)
+		{
+			ctx.read(v, count * sizeof(*v));
+		}
+
+		inline void BinarySerializer::unserialize_n(ReadableSerializationBuffer& ctx, UInt16* v, size_t count)
+		{
+			ctx.read(v, count * sizeof(*v));
+		}
+
+		inline void BinarySerializer::unserialize_n(ReadableSerializationBuffer& ctx, UInt32* v, size_t count)
+		{
+			ctx.read(v, count * sizeof(*v));
+		}
+
+		inline void BinarySerializer::unserialize_n(ReadableSerializationBuffer& ctx, Int32* v, size_t count)
+		{
+			ctx.read(v, count * sizeof(*v));
+		}
+
+		inline void BinarySerializer::unserialize_n(ReadableSerializationBuffer& ctx, Int64* v, size_t count)
+		{
+			ctx.read(v, count * sizeof(*v));
+		}
+
+		inline void BinarySerializer::unserialize_n(ReadableSerializationBuffer& ctx, Double* v, size_t count)
+		{
+			ctx.read(v, count * sizeof(*v));
+		}
+
+		// static dispatch
+		template <class T>
+		auto BinarySerializer::serialize(WritableSerializationBuffer& ctx, const T& s)
+			-> decltype(s.serialize_fields(ctx, *this))
+		{
+			s.serialize_fields(ctx, *this);
+		}
+
+		template <class T>
+		void BinarySerializer::serialize(WritableSerializationBuffer& ctx, const ArraySerialization<T>& a)
+		{
+			Int32 a_len = a.size();
+			// TODO: allow proper distinction between null & empty array
+			if (a_len == 0)
+				a_len = -1;
+			serialize(ctx, a_len);
+
+			serialize_elements(ctx, a.array(), is_block_serializable<T>());
+		}
+
+		template <class T>
+		auto BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, T& s)
+			-> decltype(s.unserialize_fields(ctx, *this))
+		{
+			s.unserialize_fields(ctx, *this);
+		}
+
+		template <class T>
+		void BinarySerializer::unserialize(ReadableSerializationBuffer& ctx, const ArrayUnserialization<T>& a)
+		{
+			Int32 length;
+			unserialize(ctx, length);
+
+			if (length > 0)
+			{
+				check_array_length(ctx, length, min_encoded_size<T>::value);
+
+				try
+				{
+					// existing elements are decoded over, reusing their storage
+					a.array().resize(length);
+
+					unserialize_elements(ctx, a.array(), is_block_serializable<T>());
+				}
+				catch (...)
+				{
+					Array<T>().swap(a.array());
+					throw;
+				}
+			}
+			else
+				a.array().clear();
+		}
+
+		template <class T>
+		void BinarySerializer::serialize_elements(WritableSerializationBuffer& ctx, const Array<T>& a, std::true_type)
+		{
+			if (!a.empty())
+				serialize_n(ctx, a.data(), a.size());
+		}
+
+		template <class T>
+		void BinarySerializer::serialize_elements(WritableSerializationBuffer& ctx, const Array<T>& a, std::false_type)
+		{
+			for (const T& i : a)
+				serialize(ctx, i);
+		}
+
+		template <class T>
+		void BinarySerializer::unserialize_elements(ReadableSerializationBuffer& ctx, Array<T>& a, std::true_type)
+		{
+			unserialize_n(ctx, a.data(), a.size());
+		}
+
+		template <class T>
+		void BinarySerializer::unserialize_elements(ReadableSerializationBuffer& ctx, Array<T>& a, std::false_type)
+		{
+			for (T& i : a)
+				unserialize(ctx, i);
+		}
+
+		// size calculator implementation
+		template <class T>
+		size_t encoded_size(const T& v)
+		{
+			BinarySizeCalculator calc;
+
+			calc.serialize(BinarySizeCalculator::null_buffer(), v);
+			return calc.length;
+		}
 	};
 };
 
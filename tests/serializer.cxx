@@ -7,27 +7,72 @@
 #	include "config.h"
 #endif
 
+#include <opcua/common/object.hxx>
+#include <opcua/common/random.hxx>
+#include <opcua/common/slab.hxx>
+#include <opcua/common/timerwheel.hxx>
 #include <opcua/common/types.hxx>
 #include <opcua/common/util.hxx>
+#include <opcua/tcp/idmapping.hxx>
+#include <opcua/tcp/server.hxx>
+#include <opcua/tcp/streams.hxx>
 #include <opcua/tcp/types.hxx>
 
+#include <algorithm>
+#include <csignal>
 #include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 template <class T>
 void test_unserialize(const std::vector<uint8_t> ser_val, const T& val1)
+{
+	// decode both straight from the evbuffer and from a contiguous window
+	for (bool contiguous : {false, true})
+	{
+		opc_ua::MemorySerializationBuffer buf;
+		opc_ua::tcp::BinarySerializer s;
+		T val2;
+
+		// move data into a buffer
+		buf.write(ser_val.data(), ser_val.size());
+		if (contiguous)
+			buf.pullup();
+
+		// unserialize the value
+		s.unserialize(buf, val2);
+
+		if (val1 != val2)
+			throw std::logic_error("Unserialization returned different value");
+		if (buf.size() != 0)
+			throw std::logic_error("Unserialization left data in the buffer");
+	}
+}
+
+void test_short_read(const std::vector<uint8_t> ser_val)
 {
 	opc_ua::MemorySerializationBuffer buf;
 	opc_ua::tcp::BinarySerializer s;
-	T val2;
+	opc_ua::String val;
 
-	// move data into a buffer
 	buf.write(ser_val.data(), ser_val.size());
+	buf.pullup();
 
-	// unserialize the value
-	s.unserialize(buf, val2);
+	try
+	{
+		s.unserialize(buf, val);
+	}
+	catch (std::runtime_error&)
+	{
+		return;
+	}
 
-	if (val1 != val2)
-		throw std::logic_error("Unserialization returned different value");
+	throw std::logic_error("Reading past the contiguous window succeeded");
 }
 
 template <class T>
@@ -46,10 +91,1418 @@ void test_serialize(const T& val1, const std::vector<uint8_t> ser_exp)
 
 	if (ser_val != ser_exp)
 		throw std::logic_error("Serialized value does not match reference");
+	if (opc_ua::tcp::encoded_size(val1) != ser_exp.size())
+		throw std::logic_error("Encoded size does not match reference");
 
 	test_unserialize(ser_val, val1);
 }
 
+template <class T>
+void test_array(const opc_ua::Array<T>& val1, const std::vector<uint8_t> ser_exp)
+{
+	opc_ua::tcp::BinarySerializer bs;
+
+	// check both the static and the virtual dispatch
+	for (opc_ua::Serializer* s : {static_cast<opc_ua::Serializer*>(nullptr), static_cast<opc_ua::Serializer*>(&bs)})
+	{
+		opc_ua::MemorySerializationBuffer buf;
+		std::vector<uint8_t> ser_val;
+		opc_ua::Array<T> val2;
+
+		if (s)
+			s->serialize(buf, opc_ua::ArraySerialization<T>(val1));
+		else
+			bs.serialize(buf, opc_ua::ArraySerialization<T>(val1));
+
+		ser_val.resize(buf.size());
+		buf.read(ser_val.data(), ser_val.size());
+
+		if (ser_val != ser_exp)
+			throw std::logic_error("Serialized array does not match reference");
+		if (opc_ua::tcp::encoded_size(opc_ua::ArraySerialization<T>(val1)) != ser_exp.size())
+			throw std::logic_error("Encoded size does not match reference");
+
+		buf.write(ser_val.data(), ser_val.size());
+		buf.pullup();
+		if (s)
+			s->unserialize(buf, opc_ua::ArrayUnserialization<T>(val2));
+		else
+			bs.unserialize(buf, opc_ua::ArrayUnserialization<T>(val2));
+
+		if (val1 != val2)
+			throw std::logic_error("Unserialization returned different array");
+		if (buf.size() != 0)
+			throw std::logic_error("Unserialization left data in the buffer");
+	}
+}
+
+void test_node_id()
+{
+	std::hash<opc_ua::NodeId> h;
+	opc_ua::NodeId i1("I1", 1), q1("Q1", 1);
+
+	if (h(i1) == h(q1))
+		throw std::logic_error("String NodeIds share the hash");
+	if (opc_ua::NodeId(5, 0) == opc_ua::NodeId(5, 1))
+		throw std::logic_error("NodeIds in different namespaces compare equal");
+
+	opc_ua::NodeId a(i1);
+	if (a != i1 || h(a) != h(i1))
+		throw std::logic_error("Copied NodeId differs from the original");
+	a = opc_ua::NodeId(7);
+	a = q1;
+	if (a != q1)
+		throw std::logic_error("Assigned NodeId differs from the original");
+}
+
+void test_reuse()
+{
+	opc_ua::MemorySerializationBuffer buf;
+	opc_ua::tcp::BinarySerializer srl;
+
+	// decoding over a previously decoded object
+	opc_ua::DataValue full, value_only, out;
+	full.flags = 0x0F;
+	full.value = opc_ua::Variant(opc_ua::String("ABCD"));
+	full.status_code = 5;
+	full.source_timestamp = full.server_timestamp = opc_ua::DateTime({10, 0});
+	value_only.flags = 0x01;
+	value_only.value = opc_ua::Variant(opc_ua::UInt32(7));
+
+	srl.serialize(buf, full);
+	srl.serialize(buf, value_only);
+	srl.unserialize(buf, out);
+	srl.unserialize(buf, out);
+	if (out.value != value_only.value || out.status_code != 0
+			|| out.source_timestamp != opc_ua::DateTime()
+			|| out.server_timestamp != opc_ua::DateTime())
+		throw std::logic_error("Fields of the reused DataValue not reset");
+
+	opc_ua::Array<opc_ua::String> three{"A", "B", "C"}, one{"D"}, out_arr;
+	srl.serialize(buf, opc_ua::ArraySerialization<opc_ua::String>(three));
+	srl.serialize(buf, opc_ua::ArraySerialization<opc_ua::String>(one));
+	srl.unserialize(buf, opc_ua::ArrayUnserialization<opc_ua::String>(out_arr));
+	srl.unserialize(buf, opc_ua::ArrayUnserialization<opc_ua::String>(out_arr));
+	if (out_arr != one)
+		throw std::logic_error("Reused array differs from the encoded one");
+}
+
+template <class T>
+void expect_array_rejected(const std::vector<uint8_t>& ser, size_t max_array_length)
+{
+	// both through the static and the virtual entry point
+	for (bool virt : {false, true})
+	{
+		opc_ua::MemorySerializationBuffer buf;
+		opc_ua::tcp::BinarySerializer srl(max_array_length);
+		opc_ua::Serializer& s = srl;
+		opc_ua::Array<T> out;
+
+		buf.write(ser.data(), ser.size());
+		buf.pullup();
+		try
+		{
+			if (virt)
+				s.unserialize(buf, opc_ua::ArrayUnserialization<T>(out));
+			else
+				srl.unserialize(buf, opc_ua::ArrayUnserialization<T>(out));
+		}
+		catch (std::runtime_error&)
+		{
+			if (out.capacity() != 0)
+				throw std::logic_error("Storage of the rejected array kept");
+			continue;
+		}
+
+		throw std::logic_error("Array exceeding the limits accepted");
+	}
+}
+
+void test_array_limits()
+{
+	// 1000 elements in 1000 bytes: enough for Bytes only
+	std::vector<uint8_t> ser{0xE8, 0x03, 0x00, 0x00};
+	ser.resize(ser.size() + 1000);
+	expect_array_rejected<opc_ua::UInt32>(ser, 0);
+	expect_array_rejected<opc_ua::String>(ser, 0);
+	expect_array_rejected<opc_ua::NodeId>(ser, 0);
+	// valid empty Variants, but over the array length limit
+	expect_array_rejected<opc_ua::Variant>(ser, 999);
+
+	// short read in the middle of the elements
+	std::vector<uint8_t> trunc{0x02, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x41,
+			0x05, 0x00, 0x00, 0x00};
+	expect_array_rejected<opc_ua::String>(trunc, 0);
+
+	opc_ua::MemorySerializationBuffer buf;
+	opc_ua::tcp::BinarySerializer srl(1000);
+	opc_ua::Array<opc_ua::Variant> out;
+	buf.write(ser.data(), ser.size());
+	srl.unserialize(buf, opc_ua::ArrayUnserialization<opc_ua::Variant>(out));
+	if (out.size() != 1000 || buf.size() != 0)
+		throw std::logic_error("Array at the length limit rejected");
+}
+
+void test_variant_copy()
+{
+	opc_ua::Variant s(opc_ua::String(100, 'x'));
+	opc_ua::Variant i(opc_ua::UInt32(5));
+
+	opc_ua::Variant a(s);
+	opc_ua::Variant b(std::move(a));
+	if (b != s)
+		throw std::logic_error("Copied variant differs from the original");
+
+	b = i;
+	if (b != i)
+		throw std::logic_error("Assigned scalar variant differs from the original");
+	b = std::move(s);
+	if (b.variant_type != opc_ua::VariantType::STRING || b.as_string.size() != 100)
+		throw std::logic_error("Moved variant differs from the original");
+
+	// unserializing over a value of a different type
+	opc_ua::MemorySerializationBuffer buf;
+	opc_ua::tcp::BinarySerializer srl;
+	srl.serialize(buf, i);
+	srl.unserialize(buf, b);
+	if (b != i)
+		throw std::logic_error("Unserialization over a string variant failed");
+}
+
+void test_copy_skip()
+{
+	opc_ua::MemorySerializationBuffer src, dst;
+	std::string data(6000, 'x');
+	char out[6];
+
+	// spanning a chain added directly and the buffered writes
+	data.replace(4090, 12, "0123456789AB");
+	src.write(data.data(), 4096);
+	src.write(data.data() + 4096, data.size() - 4096);
+	dst.copy(src, 4092, 6);
+	dst.read(out, 6);
+	if (std::string(out, 6) != "234567" || src.size() != data.size())
+		throw std::logic_error("Copied data differs from the original");
+
+	src.skip(4096);
+	src.read(out, 6);
+	if (std::string(out, 6) != "6789AB")
+		throw std::logic_error("Wrong data after skipping");
+
+	// through the read window
+	src.pullup();
+	src.skip(src.size() - 1);
+	if (src.size() != 1)
+		throw std::logic_error("Wrong size after skipping the window");
+}
+
+// a buffer that makes ExtensionObject encoding compute the lengths
+// up front instead of patching them in
+struct UnpatchableBuffer : public opc_ua::MemorySerializationBuffer
+{
+	UnpatchableBuffer()
+		: SerializationBuffer(evbuffer_new())
+	{
+	}
+
+	virtual bool patchable() const
+	{
+		return false;
+	}
+};
+
+void test_extension_object()
+{
+	opc_ua::tcp::BinarySerializer srl;
+	opc_ua::ReadRequest rr;
+
+	// nested objects, the innermost one past the write slab size
+	opc_ua::ReadRequest* innermost = &rr;
+	for (int i = 1; i <= 3; ++i)
+	{
+		opc_ua::ReadRequest* next = new opc_ua::ReadRequest;
+		next->nodes_to_read.resize(1);
+		next->nodes_to_read[0].node_id = opc_ua::NodeId(std::string(2000 * i, 'x'), 1);
+		innermost->request_header.additional_header.inner_object.reset(next);
+		innermost = next;
+	}
+
+	opc_ua::MemorySerializationBuffer patched;
+	UnpatchableBuffer computed;
+	srl.serialize(patched, rr);
+	srl.serialize(computed, rr);
+
+	std::vector<uint8_t> patched_data(patched.size()), computed_data(computed.size());
+	patched.read(patched_data.data(), patched_data.size());
+	computed.read(computed_data.data(), computed_data.size());
+	if (patched_data != computed_data)
+		throw std::logic_error("Patched ExtensionObject lengths do not match computed ones");
+	if (patched_data.size() != opc_ua::tcp::encoded_size(rr))
+		throw std::logic_error("Encoded size does not match the ExtensionObject encoding");
+
+	// decoding, in place from a window (with data following the body)
+	// and copied out of the evbuffer, the second time over the objects
+	// decoded the first time
+	opc_ua::ReadRequest out;
+	for (bool contiguous : {false, true})
+	{
+		opc_ua::MemorySerializationBuffer buf;
+		opc_ua::UInt32 trailer;
+
+		buf.write(patched_data.data(), patched_data.size());
+		srl.serialize(buf, opc_ua::UInt32(7));
+		if (contiguous)
+			buf.pullup();
+		srl.unserialize(buf, out);
+		srl.unserialize(buf, trailer);
+
+		opc_ua::ReadRequest* r = &out;
+		for (int i = 1; i <= 3; ++i)
+		{
+			r = dynamic_cast<opc_ua::ReadRequest*>(
+					r->request_header.additional_header.inner_object.get());
+			if (!r || r->nodes_to_read.at(0).node_id
+					!= opc_ua::NodeId(std::string(2000 * i, 'x'), 1))
+				throw std::logic_error("Decoded ExtensionObject differs from the original");
+		}
+		if (trailer != 7 || buf.size() != 0)
+			throw std::logic_error("ExtensionObject decoding overran its body");
+	}
+}
+
+void test_chunk_limits()
+{
+	opc_ua::tcp::ChunkAssembler ca;
+	opc_ua::tcp::ProtocolInfo limits = opc_ua::tcp::libevent_protocol_info;
+	std::vector<uint8_t> data(100, 'x');
+
+	limits.max_message_size = 250;
+	limits.max_chunk_count = 3;
+
+	// two chunks within the limits
+	opc_ua::MemorySerializationBuffer chunk, out;
+	chunk.write(data.data(), data.size());
+	ca.add_chunk(1, chunk, limits);
+	chunk.write(data.data(), data.size());
+	ca.finish(1, chunk, limits, out);
+	if (out.size() != 200)
+		throw std::logic_error("Reassembled message has wrong size");
+
+	// messages in progress count towards the size limit together
+	chunk.write(data.data(), data.size());
+	ca.add_chunk(2, chunk, limits);
+	chunk.write(data.data(), data.size());
+	ca.add_chunk(3, chunk, limits);
+	chunk.write(data.data(), data.size());
+	try
+	{
+		ca.add_chunk(3, chunk, limits);
+		throw std::logic_error("Message size limit not enforced");
+	}
+	catch (opc_ua::tcp::TransportError& e)
+	{
+		if (e.status != opc_ua::status::Bad_TcpMessageTooLarge)
+			throw std::logic_error("Wrong status for exceeded message size");
+	}
+
+	// the final chunk counts towards the chunk limit
+	ca.discard(2);
+	ca.discard(3);
+	limits.max_message_size = 0;
+	for (int i = 0; i < 2; ++i)
+	{
+		opc_ua::MemorySerializationBuffer c;
+		c.write(data.data(), data.size());
+		ca.add_chunk(4, c, limits);
+	}
+	try
+	{
+		opc_ua::MemorySerializationBuffer c;
+		c.write(data.data(), data.size());
+		ca.add_chunk(4, c, limits);
+		throw std::logic_error("Chunk count limit not enforced");
+	}
+	catch (opc_ua::tcp::TransportError&)
+	{
+	}
+}
+
+struct chunk
+{
+	uint8_t is_final;
+	uint32_t size;
+	uint32_t sequence_number;
+	uint32_t request_id;
+	std::vector<uint8_t> body;
+};
+
+// split whatever was sent to the socket into chunks (with 4-byte
+// security headers)
+std::vector<chunk> read_chunks(int fd)
+{
+	std::vector<uint8_t> data;
+	std::vector<chunk> ret;
+	uint8_t tmp[4096];
+	ssize_t rd;
+
+	while ((rd = recv(fd, tmp, sizeof(tmp), MSG_DONTWAIT)) > 0)
+		data.insert(data.end(), tmp, tmp + rd);
+
+	auto u32 = [&data] (size_t pos) {
+		return uint32_t(data.at(pos)) | uint32_t(data.at(pos + 1)) << 8
+			| uint32_t(data.at(pos + 2)) << 16 | uint32_t(data.at(pos + 3)) << 24;
+	};
+
+	for (size_t pos = 0; pos < data.size(); )
+	{
+		chunk c;
+
+		c.is_final = data.at(pos + 3);
+		c.size = u32(pos + 4);
+		c.sequence_number = u32(pos + 16);
+		c.request_id = u32(pos + 20);
+		c.body.assign(data.begin() + pos + 24, data.begin() + pos + c.size);
+		ret.push_back(c);
+		pos += c.size;
+	}
+
+	return ret;
+}
+
+// run the event loop until the condition holds (up to 5 s)
+template <class F>
+void run_until(event_base* ev, F cond)
+{
+	uint64_t deadline = opc_ua::clock_ms() + 5000;
+
+	// (the session timer of the server wakes the loop up every tick)
+	while (!cond())
+	{
+		if (opc_ua::clock_ms() > deadline)
+			throw std::logic_error("Timed out waiting for the server");
+		event_base_loop(ev, EVLOOP_ONCE);
+	}
+}
+
+uint32_t get_u32(const std::vector<uint8_t>& data, size_t pos)
+{
+	return uint32_t(data.at(pos)) | uint32_t(data.at(pos + 1)) << 8
+		| uint32_t(data.at(pos + 2)) << 16 | uint32_t(data.at(pos + 3)) << 24;
+}
+
+void write_all(int fd, const std::vector<uint8_t>& data)
+{
+	if (write(fd, data.data(), data.size()) != static_cast<ssize_t>(data.size()))
+		throw std::runtime_error("write() failed");
+}
+
+// single-chunk frame (for OPN, MSG and CLO,
+// the body starts with the secure channel id)
+std::vector<uint8_t> raw_frame(opc_ua::tcp::MessageType type, opc_ua::MemorySerializationBuffer& body)
+{
+	opc_ua::MemorySerializationBuffer out;
+	opc_ua::tcp::BinarySerializer srl;
+	opc_ua::tcp::MessageHeader h;
+
+	h.message_type = type;
+	h.is_final = opc_ua::tcp::MessageIsFinal::FINAL;
+	h.message_size = h.serialized_length + body.size();
+	srl.serialize(out, h);
+	out.move(body);
+
+	std::vector<uint8_t> ret(out.size());
+	out.read(ret.data(), ret.size());
+	return ret;
+}
+
+std::vector<uint8_t> hello_frame(opc_ua::UInt32 receive_buffer_size = opc_ua::tcp::libevent_protocol_info.receive_buffer_size)
+{
+	opc_ua::MemorySerializationBuffer body;
+	opc_ua::tcp::BinarySerializer srl;
+	opc_ua::tcp::HelloMessage hello = {
+		.protocol_info = opc_ua::tcp::libevent_protocol_info,
+		.endpoint_url = "opc.tcp://localhost/test",
+	};
+
+	hello.protocol_info.receive_buffer_size = receive_buffer_size;
+	srl.serialize(body, hello);
+	return raw_frame(opc_ua::tcp::MessageType::HEL, body);
+}
+
+std::vector<uint8_t> open_frame(opc_ua::UInt32 request_id)
+{
+	opc_ua::MemorySerializationBuffer body;
+	opc_ua::tcp::BinarySerializer srl;
+	opc_ua::tcp::AsymmetricAlgorithmSecurityHeader sech = {
+		.security_policy_uri = "http://opcfoundation.org/UA/SecurityPolicy#None",
+		.sender_certificate = "",
+		.receiver_certificate_thumbprint = "",
+	};
+	opc_ua::tcp::SequenceHeader seqh = {
+		.sequence_number = request_id,
+		.request_id = request_id,
+	};
+	opc_ua::OpenSecureChannelRequest req(opc_ua::SecurityTokenRequestType::ISSUE,
+			opc_ua::MessageSecurityMode::NONE, "", 360000);
+
+	srl.serialize(body, opc_ua::UInt32(0));
+	srl.serialize(body, sech);
+	srl.serialize(body, seqh);
+	srl.serialize(body, opc_ua::NodeId(opc_ua::tcp::id_mapping.at(req.get_node_id())));
+	srl.serialize(body, req);
+	return raw_frame(opc_ua::tcp::MessageType::OPN, body);
+}
+
+// secure channel opened by hand
+struct raw_channel
+{
+	opc_ua::UInt32 channel_id;
+	opc_ua::UInt32 token_id;
+};
+
+std::vector<uint8_t> request_frame(const raw_channel& c, opc_ua::UInt32 request_id, const opc_ua::Request& req)
+{
+	opc_ua::MemorySerializationBuffer body;
+	opc_ua::tcp::BinarySerializer srl;
+	opc_ua::tcp::SymmetricAlgorithmSecurityHeader sech = {
+		.token_id = c.token_id,
+	};
+	opc_ua::tcp::SequenceHeader seqh = {
+		.sequence_number = request_id,
+		.request_id = request_id,
+	};
+
+	srl.serialize(body, c.channel_id);
+	srl.serialize(body, sech);
+	srl.serialize(body, seqh);
+	srl.serialize(body, opc_ua::NodeId(opc_ua::tcp::id_mapping.at(req.get_node_id())));
+	srl.serialize(body, static_cast<const opc_ua::Struct&>(req));
+	return raw_frame(opc_ua::tcp::MessageType::MSG, body);
+}
+
+// split the data received so far into frames (a partial one
+// is kept in pending)
+void recv_frames(int fd, std::vector<uint8_t>& pending, std::vector<std::vector<uint8_t>>& frames)
+{
+	uint8_t tmp[4096];
+	ssize_t rd;
+
+	while ((rd = recv(fd, tmp, sizeof(tmp), MSG_DONTWAIT)) > 0)
+		pending.insert(pending.end(), tmp, tmp + rd);
+
+	while (pending.size() >= 8 && pending.size() >= get_u32(pending, 4))
+	{
+		size_t size = get_u32(pending, 4);
+		frames.emplace_back(pending.begin(), pending.begin() + size);
+		pending.erase(pending.begin(), pending.begin() + size);
+	}
+}
+
+// say hello and open a channel in a single write
+raw_channel open_raw_channel(event_base* ev, int fd,
+		opc_ua::UInt32 receive_buffer_size = opc_ua::tcp::libevent_protocol_info.receive_buffer_size)
+{
+	std::vector<uint8_t> data = hello_frame(receive_buffer_size), opn = open_frame(1);
+	std::vector<uint8_t> pending;
+	std::vector<std::vector<uint8_t>> frames;
+
+	data.insert(data.end(), opn.begin(), opn.end());
+	write_all(fd, data);
+	run_until(ev, [&] {
+		recv_frames(fd, pending, frames);
+		return frames.size() >= 2;
+	});
+	if (memcmp(frames[0].data(), "ACKF", 4) || memcmp(frames[1].data(), "OPNF", 4))
+		throw std::logic_error("HEL and OPN not answered with ACK and OPN");
+
+	opc_ua::MemorySerializationBuffer buf;
+	opc_ua::tcp::BinarySerializer srl;
+	opc_ua::tcp::AsymmetricAlgorithmSecurityHeader sech;
+	opc_ua::tcp::SequenceHeader seqh;
+	opc_ua::NodeId type_id;
+	opc_ua::OpenSecureChannelResponse resp;
+	raw_channel c;
+
+	buf.write(frames[1].data() + 8, frames[1].size() - 8);
+	srl.unserialize(buf, c.channel_id);
+	srl.unserialize(buf, sech);
+	srl.unserialize(buf, seqh);
+	srl.unserialize(buf, type_id);
+	srl.unserialize(buf, static_cast<opc_ua::Struct&>(resp));
+	c.token_id = resp.security_token.token_id;
+	return c;
+}
+
+// decode the response from a single-chunk MSG frame
+template <class T>
+void decode_response(const std::vector<uint8_t>& frame, T& resp)
+{
+	opc_ua::MemorySerializationBuffer buf;
+	opc_ua::tcp::BinarySerializer srl;
+	opc_ua::NodeId type_id;
+
+	buf.write(frame.data() + 24, frame.size() - 24);
+	srl.unserialize(buf, type_id);
+	if (type_id.as_int != opc_ua::tcp::id_mapping.at(resp.get_node_id()))
+		throw std::logic_error("Unexpected response type");
+	srl.unserialize(buf, static_cast<opc_ua::Struct&>(resp));
+}
+
+// create and activate a session (request ids 2 and 3), return
+// its authentication token
+opc_ua::NodeId open_raw_session(event_base* ev, int fd, const raw_channel& c)
+{
+	opc_ua::CreateSessionRequest csr(opc_ua::ApplicationType::CLIENT,
+			"opc.tcp://localhost/test", "test", opc_ua::random_nonce(), 60000);
+	opc_ua::CreateSessionResponse cresp;
+	opc_ua::ActivateSessionRequest asr;
+	opc_ua::ActivateSessionResponse aresp;
+	std::vector<uint8_t> pending;
+	std::vector<std::vector<uint8_t>> frames;
+
+	write_all(fd, request_frame(c, 2, csr));
+	run_until(ev, [&] {
+		recv_frames(fd, pending, frames);
+		return frames.size() >= 1;
+	});
+	decode_response(frames[0], cresp);
+
+	asr.request_header.authentication_token = cresp.authentication_token;
+	write_all(fd, request_frame(c, 3, asr));
+	run_until(ev, [&] {
+		recv_frames(fd, pending, frames);
+		return frames.size() >= 2;
+	});
+	decode_response(frames[1], aresp);
+	if (aresp.response_header.service_result != opc_ua::status::Good)
+		throw std::logic_error("Session not activated");
+
+	return cresp.authentication_token;
+}
+
+// run the event loop until data arrives on fd (up to 100 iterations)
+void wait_readable(event_base* ev, int fd)
+{
+	uint8_t tmp;
+
+	for (int i = 0; i < 100; ++i)
+	{
+		if (recv(fd, &tmp, 1, MSG_PEEK | MSG_DONTWAIT) > 0)
+			return;
+		event_base_loop(ev, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+	}
+
+	throw std::logic_error("No data received from the server");
+}
+
+void test_write_out_error()
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+		throw std::runtime_error("socketpair() failed");
+	// (raised by writing to the closed socket otherwise)
+	signal(SIGPIPE, SIG_IGN);
+
+	event_base* ev = event_base_new();
+	bufferevent* bev = bufferevent_socket_new(ev, fds[0], BEV_OPT_CLOSE_ON_FREE);
+	short events = 0;
+
+	bufferevent_setcb(bev, nullptr, nullptr, [] (bufferevent*, short what, void* data) {
+		*static_cast<short*>(data) |= what;
+	}, &events);
+	// only write_out() writes
+	bufferevent_disable(bev, EV_WRITE);
+
+	close(fds[1]);
+	evbuffer_add(bufferevent_get_output(bev), "x", 1);
+	if (opc_ua::write_out(bev) != -1)
+		throw std::logic_error("Write to a closed socket succeeded");
+	if (events)
+		throw std::logic_error("Write error reported before returning");
+
+	event_base_loop(ev, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+	if (events != (BEV_EVENT_WRITING | BEV_EVENT_ERROR))
+		throw std::logic_error("Write error not passed to the event callback");
+
+	bufferevent_free(bev);
+	event_base_free(ev);
+}
+
+void test_connection_reset()
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+		throw std::runtime_error("socketpair() failed");
+
+	event_base* ev = event_base_new();
+	opc_ua::AddressSpace as;
+	opc_ua::tcp::ServerConfig config;
+	config.listen_addresses.clear();
+
+	{
+		opc_ua::tcp::Server server(ev, as, config);
+		opc_ua::tcp::ServerTransportStream ts(server, ev, fds[0]);
+		std::vector<uint8_t> hel = hello_frame();
+
+		if (write(fds[1], hel.data(), hel.size()) != static_cast<ssize_t>(hel.size()))
+			throw std::runtime_error("write() failed");
+		wait_readable(ev, fds[1]);
+
+		// closing with the ACK unread resets the connection
+		close(fds[1]);
+		for (int i = 0; i < 10; ++i)
+			event_base_loop(ev, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+	}
+
+	event_base_free(ev);
+}
+
+void test_pipelined_requests()
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+		throw std::runtime_error("socketpair() failed");
+
+	event_base* ev = event_base_new();
+	opc_ua::AddressSpace as;
+	opc_ua::tcp::ServerConfig config;
+	config.listen_addresses.clear();
+
+	{
+		opc_ua::tcp::Server server(ev, as, config);
+		opc_ua::tcp::ServerTransportStream ts(server, ev, fds[0]);
+		raw_channel c = open_raw_channel(ev, fds[1]);
+		std::vector<uint8_t> data, pending;
+		std::vector<std::vector<uint8_t>> frames;
+		opc_ua::ReadRequest rr;
+		const opc_ua::UInt32 count = 16;
+
+		// (answered with faults, as there is no session)
+		for (opc_ua::UInt32 i = 0; i < count; ++i)
+		{
+			std::vector<uint8_t> f = request_frame(c, 2 + i, rr);
+			data.insert(data.end(), f.begin(), f.end());
+		}
+		write_all(fds[1], data);
+
+		run_until(ev, [&] {
+			recv_frames(fds[1], pending, frames);
+			return frames.size() >= count;
+		});
+		if (frames.size() != count || !pending.empty())
+			throw std::logic_error("Extra data in response to pipelined requests");
+		for (opc_ua::UInt32 i = 0; i < count; ++i)
+		{
+			if (memcmp(frames[i].data(), "MSGF", 4) || get_u32(frames[i], 20) != 2 + i)
+				throw std::logic_error("Pipelined requests not answered in order");
+		}
+	}
+
+	close(fds[1]);
+	event_base_free(ev);
+}
+
+void test_read_pause()
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+		throw std::runtime_error("socketpair() failed");
+	// (so that the responses back up quickly)
+	int sndbuf = 4096;
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	evutil_make_socket_nonblocking(fds[0]);
+
+	event_base* ev = event_base_new();
+	opc_ua::AddressSpace as;
+	opc_ua::tcp::ServerConfig config;
+	config.listen_addresses.clear();
+	config.output_high_watermark = 8192;
+	config.output_low_watermark = 1024;
+
+	{
+		opc_ua::tcp::Server server(ev, as, config);
+		opc_ua::tcp::ServerTransportStream ts(server, ev, fds[0]);
+		raw_channel c = open_raw_channel(ev, fds[1]);
+		std::vector<uint8_t> data, pending;
+		std::vector<std::vector<uint8_t>> frames;
+		opc_ua::ReadRequest rr;
+		const opc_ua::UInt32 count = 1000;
+
+		for (opc_ua::UInt32 i = 0; i < count; ++i)
+		{
+			std::vector<uint8_t> f = request_frame(c, 2 + i, rr);
+			data.insert(data.end(), f.begin(), f.end());
+		}
+		write_all(fds[1], data);
+
+		// the client does not read, the server stops reading
+		// once the responses back up over the high watermark
+		for (int i = 0; i < 50; ++i)
+			event_base_loop(ev, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+
+		int unread;
+		if (ioctl(fds[0], FIONREAD, &unread) || unread == 0)
+			throw std::logic_error("Server kept reading with the output backed up");
+		if (ts.output_backlog() < config.output_high_watermark
+				|| ts.output_backlog() > 2 * config.output_high_watermark)
+			throw std::logic_error("Output backlog not stopped at the high watermark");
+
+		// reading is resumed as the client drains the responses
+		run_until(ev, [&] {
+			recv_frames(fds[1], pending, frames);
+			return frames.size() >= count;
+		});
+		if (frames.size() != count || get_u32(frames.back(), 20) != 1 + count)
+			throw std::logic_error("Requests left unanswered after the output drained");
+	}
+
+	close(fds[1]);
+	event_base_free(ev);
+}
+
+// variable with a 1000-character string value
+struct LongVariable : opc_ua::Variable
+{
+	opc_ua::NodeId node_id() { return opc_ua::NodeId("Long", 1); }
+	opc_ua::NodeClass node_class() { return opc_ua::NodeClass::VARIABLE; }
+	opc_ua::QualifiedName browse_name() { return {"Long", 1}; }
+	opc_ua::LocalizedText display_name(opc_ua::Session&, opc_ua::Double) { return {"", "Long"}; }
+	opc_ua::UInt32 write_mask(opc_ua::Session&, opc_ua::Double) { return 0; }
+	opc_ua::UInt32 user_write_mask(opc_ua::Session&, opc_ua::Double) { return 0; }
+	opc_ua::Variant value(opc_ua::Session&, opc_ua::Double) { return opc_ua::Variant(opc_ua::String(1000, 'x')); }
+	opc_ua::NodeId data_type(opc_ua::Session&, opc_ua::Double) { return {}; }
+	opc_ua::Int32 value_rank(opc_ua::Session&, opc_ua::Double) { return -1; }
+	opc_ua::Array<opc_ua::UInt32> array_dimensions(opc_ua::Session&, opc_ua::Double) { return {}; }
+	opc_ua::Byte access_level(opc_ua::Session&, opc_ua::Double) { return 1; }
+	opc_ua::Byte user_access_level(opc_ua::Session&, opc_ua::Double) { return 1; }
+	opc_ua::Boolean historizing(opc_ua::Session&, opc_ua::Double) { return false; }
+	opc_ua::StatusCode value(opc_ua::Session&, const opc_ua::Variant&) { return 0; }
+};
+
+void test_deferred_response()
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+		throw std::runtime_error("socketpair() failed");
+	evutil_make_socket_nonblocking(fds[0]);
+
+	event_base* ev = event_base_new();
+	opc_ua::AddressSpace as;
+	opc_ua::tcp::ServerConfig config;
+	config.listen_addresses.clear();
+	config.chunks_per_turn = 1;
+	as.add_node(std::make_shared<LongVariable>());
+
+	{
+		opc_ua::tcp::Server server(ev, as, config);
+		opc_ua::tcp::ServerTransportStream ts(server, ev, fds[0]);
+		// ~100 KB of values in 8 KB chunks
+		raw_channel c = open_raw_channel(ev, fds[1], 8192);
+		opc_ua::ReadRequest rr;
+		std::vector<uint8_t> pending;
+		std::vector<std::vector<uint8_t>> frames;
+		int iterations = 0;
+
+		rr.request_header.authentication_token = open_raw_session(ev, fds[1], c);
+		rr.nodes_to_read.resize(100);
+		for (auto& n : rr.nodes_to_read)
+		{
+			n.node_id = opc_ua::NodeId("Long", 1);
+			n.attribute_id = static_cast<opc_ua::UInt32>(opc_ua::AttributeId::VALUE);
+		}
+
+		// the response is continued from the run queue, a chunk
+		// per event loop iteration
+		write_all(fds[1], request_frame(c, 4, rr));
+		run_until(ev, [&] {
+			++iterations;
+			recv_frames(fds[1], pending, frames);
+			return !frames.empty() && !memcmp(frames.back().data(), "MSGF", 4);
+		});
+		if (frames.size() < 12 || iterations < static_cast<int>(frames.size()))
+			throw std::logic_error("Response not split over scheduler turns");
+
+		// the client goes away after the first chunk, the rest
+		// of the response is dropped
+		size_t full_size = frames.size();
+		frames.clear();
+		write_all(fds[1], request_frame(c, 5, rr));
+		run_until(ev, [&] {
+			recv_frames(fds[1], pending, frames);
+			return !frames.empty();
+		});
+		shutdown(fds[1], SHUT_WR);
+		for (int i = 0; i < 50; ++i)
+		{
+			event_base_loop(ev, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+			recv_frames(fds[1], pending, frames);
+		}
+		if (frames.size() >= full_size || !memcmp(frames.back().data(), "MSGF", 4))
+			throw std::logic_error("Response continued after the connection was closed");
+	}
+
+	close(fds[1]);
+	event_base_free(ev);
+}
+
+void test_chunk_writer()
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+		throw std::runtime_error("socketpair() failed");
+
+	event_base* ev = event_base_new();
+	opc_ua::AddressSpace as;
+	opc_ua::tcp::ServerConfig config;
+	config.listen_addresses.clear();
+	// send every chunk out right away
+	config.flush_threshold = 1;
+
+	{
+		opc_ua::tcp::Server server(ev, as, config);
+		opc_ua::tcp::ServerTransportStream ts(server, ev, fds[0]);
+		opc_ua::tcp::ServerChunkWriter out(ts);
+		std::vector<opc_ua::Byte> sech{1, 0, 0, 0};
+		std::vector<uint8_t> data(250);
+		opc_ua::UInt32 seq = 10;
+
+		for (size_t i = 0; i < data.size(); ++i)
+			data[i] = i;
+
+		// 24 bytes of headers + 104 bytes of body per chunk
+		ts.remote_limits.receive_buffer_size = 128;
+		ts.remote_limits.max_message_size = 0;
+		ts.remote_limits.max_chunk_count = 0;
+
+		out.begin(opc_ua::tcp::MessageType::MSG, 5, sech, seq, 7);
+		out.write(data.data(), data.size());
+		out.finish();
+
+		std::vector<chunk> chunks = read_chunks(fds[1]);
+		std::vector<uint8_t> body;
+		if (chunks.size() != 3 || out.chunks_sent() != 3 || seq != 13)
+			throw std::logic_error("Message not split into 3 chunks");
+		for (size_t i = 0; i < chunks.size(); ++i)
+		{
+			if (chunks[i].size != (i < 2 ? 128 : 66))
+				throw std::logic_error("Wrong chunk size patched in");
+			if (chunks[i].is_final != (i < 2 ? 'C' : 'F'))
+				throw std::logic_error("Wrong IsFinal patched in");
+			if (chunks[i].sequence_number != 10 + i || chunks[i].request_id != 7)
+				throw std::logic_error("Wrong sequence header in chunk");
+			body.insert(body.end(), chunks[i].body.begin(), chunks[i].body.end());
+		}
+		if (body != data)
+			throw std::logic_error("Chunk bodies do not match the message");
+
+		// the second chunk hits the limit, it is replaced by the abort
+		// chunk (with the same sequence number)
+		ts.remote_limits.max_chunk_count = 2;
+		out.begin(opc_ua::tcp::MessageType::MSG, 5, sech, seq, 8);
+		try
+		{
+			out.write(data.data(), data.size());
+			out.finish();
+			throw std::logic_error("Chunk count limit not enforced");
+		}
+		catch (opc_ua::tcp::TransportError& e)
+		{
+			out.abort(e.status, e.what());
+		}
+
+		chunks = read_chunks(fds[1]);
+		if (chunks.size() != 2 || seq != 15)
+			throw std::logic_error("Aborted message has wrong chunks");
+		if (chunks[0].is_final != 'C' || chunks[0].sequence_number != 13)
+			throw std::logic_error("Wrong chunk before the abort");
+		if (chunks[1].is_final != 'A' || chunks[1].sequence_number != 14
+				|| chunks[1].request_id != 8)
+			throw std::logic_error("Wrong abort chunk");
+
+		opc_ua::MemorySerializationBuffer buf;
+		opc_ua::tcp::BinarySerializer srl;
+		opc_ua::StatusCode status;
+		opc_ua::String reason;
+		buf.write(chunks[1].body.data(), chunks[1].body.size());
+		srl.unserialize(buf, status);
+		srl.unserialize(buf, reason);
+		if (status != opc_ua::status::Bad_ResponseTooLarge || buf.size() != 0)
+			throw std::logic_error("Wrong abort chunk body");
+	}
+
+	close(fds[1]);
+	event_base_free(ev);
+}
+
+void test_channel_counters()
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+		throw std::runtime_error("socketpair() failed");
+
+	event_base* ev = event_base_new();
+	opc_ua::AddressSpace as;
+	opc_ua::tcp::ServerConfig config;
+	config.listen_addresses.clear();
+	const std::string endpoint("opc.tcp://localhost/test");
+
+	{
+		opc_ua::tcp::Server server(ev, as, config);
+		opc_ua::tcp::ServerTransportStream sts(server, ev, fds[0]);
+		// two channels with a session each over one connection
+		opc_ua::tcp::TransportStream ts(ev);
+		opc_ua::tcp::MessageStream ms1(ts), ms2(ts);
+		opc_ua::tcp::SessionStream s1("one"), s2("two");
+		int established = 0;
+
+		auto on_established = [&established, ev] (std::unique_ptr<opc_ua::Response> resp, void*) {
+			if (resp && resp->response_header.service_result == 0 && ++established == 2)
+				event_base_loopexit(ev, nullptr);
+		};
+		s1.attach(ms1, endpoint, on_established);
+		s2.attach(ms2, endpoint, on_established);
+		ts.connect_socket(fds[1], endpoint);
+
+		timeval tv = {5, 0};
+		event_base_loopexit(ev, &tv);
+		event_base_dispatch(ev);
+		if (established != 2)
+			throw std::logic_error("Sessions not established over both channels");
+
+		// both channels sent CreateSession and ActivateSession only
+		opc_ua::ReadRequest rr;
+		if (ms1.write_message(rr) != 2 || ms2.write_message(rr) != 2)
+			throw std::logic_error("Request ids not counted per channel");
+	}
+
+	event_base_free(ev);
+}
+
+// OPN response frame as sent by a server
+std::vector<uint8_t> open_response_frame(opc_ua::UInt32 request_id, opc_ua::UInt32 channel_id, opc_ua::UInt32 token_id)
+{
+	opc_ua::MemorySerializationBuffer body;
+	opc_ua::tcp::BinarySerializer srl;
+	opc_ua::tcp::AsymmetricAlgorithmSecurityHeader sech = {
+		.security_policy_uri = "http://opcfoundation.org/UA/SecurityPolicy#None",
+		.sender_certificate = "",
+		.receiver_certificate_thumbprint = "",
+	};
+	opc_ua::tcp::SequenceHeader seqh = {
+		.sequence_number = request_id,
+		.request_id = request_id,
+	};
+	opc_ua::OpenSecureChannelResponse resp;
+
+	resp.security_token.channel_id = channel_id;
+	resp.security_token.token_id = token_id;
+	srl.serialize(body, channel_id);
+	srl.serialize(body, sech);
+	srl.serialize(body, seqh);
+	srl.serialize(body, opc_ua::NodeId(opc_ua::tcp::id_mapping.at(resp.get_node_id())));
+	srl.serialize(body, static_cast<const opc_ua::Struct&>(resp));
+	return raw_frame(opc_ua::tcp::MessageType::OPN, body);
+}
+
+// run the client loop until count frames arrive on fd (there is
+// no server timer to wake the loop, hence no run_until())
+void recv_client_frames(event_base* ev, int fd, std::vector<uint8_t>& pending,
+		std::vector<std::vector<uint8_t>>& frames, size_t count)
+{
+	for (int i = 0; i < 100; ++i)
+	{
+		event_base_loop(ev, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+		recv_frames(fd, pending, frames);
+		if (frames.size() >= count)
+			return;
+	}
+
+	throw std::logic_error("No data received from the client");
+}
+
+void test_channel_open_race()
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+		throw std::runtime_error("socketpair() failed");
+
+	event_base* ev = event_base_new();
+	std::vector<uint8_t> pending;
+	std::vector<std::vector<uint8_t>> frames;
+
+	{
+		// the server side is played by hand, so that the responses
+		// can come in any order
+		opc_ua::tcp::TransportStream ts(ev);
+		opc_ua::tcp::MessageStream ms1(ts), ms2(ts);
+		std::unique_ptr<opc_ua::tcp::MessageStream> ms3(new opc_ua::tcp::MessageStream(ts));
+
+		ts.connect_socket(fds[1], "opc.tcp://localhost/test");
+		recv_client_frames(ev, fds[0], pending, frames, 1);
+		if (memcmp(frames[0].data(), "HELF", 4))
+			throw std::logic_error("HEL not sent");
+
+		// all three OPN requests go out on ACK
+		opc_ua::MemorySerializationBuffer body;
+		opc_ua::tcp::BinarySerializer srl;
+		opc_ua::tcp::AcknowledgeMessage ack = {
+			.protocol_info = opc_ua::tcp::libevent_protocol_info,
+		};
+		srl.serialize(body, ack);
+		write_all(fds[0], raw_frame(opc_ua::tcp::MessageType::ACK, body));
+		recv_client_frames(ev, fds[0], pending, frames, 4);
+
+		opc_ua::UInt32 request_ids[3];
+		for (int i = 0; i < 3; ++i)
+		{
+			opc_ua::MemorySerializationBuffer buf;
+			opc_ua::tcp::AsymmetricAlgorithmSecurityHeader sech;
+			opc_ua::tcp::SequenceHeader seqh;
+
+			if (memcmp(frames[i + 1].data(), "OPNF", 4))
+				throw std::logic_error("OPN not sent");
+			buf.write(frames[i + 1].data() + 12, frames[i + 1].size() - 12);
+			srl.unserialize(buf, sech);
+			srl.unserialize(buf, seqh);
+			request_ids[i] = seqh.request_id;
+		}
+		if (request_ids[0] == request_ids[1] || request_ids[1] == request_ids[2]
+				|| request_ids[0] == request_ids[2])
+			throw std::logic_error("OPN requests in flight share a request id");
+
+		// the third channel goes away before its response comes,
+		// the rest are answered in reverse order in a single write
+		ms3.reset();
+		std::vector<uint8_t> data = open_response_frame(request_ids[2], 9, 90);
+		for (int i = 1; i >= 0; --i)
+		{
+			std::vector<uint8_t> opn = open_response_frame(request_ids[i], 7 + i, 70 + i);
+			data.insert(data.end(), opn.begin(), opn.end());
+		}
+		write_all(fds[0], data);
+		for (int i = 0; i < 10; ++i)
+			event_base_loop(ev, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+
+		// each channel got its own id and token
+		opc_ua::ReadRequest rr;
+		ms1.write_message(rr);
+		ms2.write_message(rr);
+		recv_client_frames(ev, fds[0], pending, frames, 6);
+		for (int i = 0; i < 2; ++i)
+		{
+			if (get_u32(frames[i + 4], 8) != opc_ua::UInt32(7 + i)
+					|| get_u32(frames[i + 4], 12) != opc_ua::UInt32(70 + i))
+				throw std::logic_error("Channel not matched with its OPN response");
+		}
+	}
+
+	close(fds[0]);
+	event_base_free(ev);
+}
+
+// run body with an active client session over a socketpair
+// to an in-process server
+template <class F>
+void with_session(opc_ua::tcp::ServerConfig config, F body)
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+		throw std::runtime_error("socketpair() failed");
+
+	event_base* ev = event_base_new();
+	opc_ua::AddressSpace as;
+	const std::string endpoint("opc.tcp://localhost/test");
+	config.listen_addresses.clear();
+
+	{
+		opc_ua::tcp::Server server(ev, as, config);
+		opc_ua::tcp::ServerTransportStream sts(server, ev, fds[0]);
+		opc_ua::tcp::TransportStream ts(ev);
+		opc_ua::tcp::MessageStream ms(ts);
+		opc_ua::tcp::SessionStream session("test");
+		bool established = false;
+
+		session.attach(ms, endpoint, [&established] (std::unique_ptr<opc_ua::Response> resp, void*) {
+			established = resp && resp->response_header.service_result == 0;
+		});
+		ts.connect_socket(fds[1], endpoint);
+		run_until(ev, [&established] { return established; });
+
+		body(ev, session);
+	}
+
+	event_base_free(ev);
+}
+
+// send a request and wait for its response status
+template <class Req>
+opc_ua::StatusCode request_status(event_base* ev, opc_ua::tcp::SessionStream& session, Req& req)
+{
+	opc_ua::tcp::Future<typename Req::response_type> f;
+
+	session.write_message(req, f);
+	run_until(ev, [&f] { return f.is_ready(); });
+	return f.status();
+}
+
+void test_session_lifecycle()
+{
+	opc_ua::tcp::ServerConfig config;
+
+	// created and activated by with_session()
+	with_session(config, [] (event_base* ev, opc_ua::tcp::SessionStream& session) {
+		opc_ua::ReadRequest rr;
+		opc_ua::CloseSessionRequest csr;
+
+		if (request_status(ev, session, rr) != opc_ua::status::Good)
+			throw std::logic_error("Request in an active session failed");
+		if (request_status(ev, session, csr) != opc_ua::status::Good)
+			throw std::logic_error("CloseSession failed");
+		if (request_status(ev, session, rr) != opc_ua::status::Bad_SessionIdInvalid)
+			throw std::logic_error("Closed session still accepts requests");
+	});
+
+	// expired by the session timer (ticking every second)
+	config.min_session_timeout = config.max_session_timeout = 1;
+	with_session(config, [] (event_base* ev, opc_ua::tcp::SessionStream& session) {
+		opc_ua::ReadRequest rr;
+		uint64_t until = opc_ua::clock_ms() + 2100;
+
+		run_until(ev, [until] { return opc_ua::clock_ms() >= until; });
+		if (request_status(ev, session, rr) != opc_ua::status::Bad_SessionIdInvalid)
+			throw std::logic_error("Idle session not expired");
+	});
+}
+
+void test_session_setup_fault()
+{
+	event_base* ev = event_base_new();
+
+	{
+		// (never connected, the responses are passed in directly)
+		opc_ua::tcp::TransportStream ts(ev);
+		opc_ua::tcp::MessageStream ms(ts);
+		opc_ua::tcp::SessionStream session("test");
+		opc_ua::StatusCode result = opc_ua::status::Good;
+
+		session.attach(ms, "opc.tcp://localhost/test", [&result] (std::unique_ptr<opc_ua::Response> resp, void*) {
+			result = resp->response_header.service_result;
+		});
+		session.open_session();
+
+		std::unique_ptr<opc_ua::CreateSessionResponse> csr(new opc_ua::CreateSessionResponse);
+		csr->response_header.request_handle = 1;
+		csr->authentication_token = opc_ua::NodeId(5, 1);
+		session.on_message(std::move(csr));
+
+		// ActivateSession timed out
+		std::unique_ptr<opc_ua::Response> fault(new opc_ua::ServiceFault);
+		fault->response_header.request_handle = 2;
+		fault->response_header.service_result = opc_ua::status::Bad_Timeout;
+		session.on_message(std::move(fault));
+
+		if (result != opc_ua::status::Bad_Timeout)
+			throw std::logic_error("ActivateSession fault not passed to the callback");
+	}
+
+	event_base_free(ev);
+}
+
+void test_request_cache()
+{
+	opc_ua::tcp::RequestCache cache(1000);
+	const opc_ua::UInt32 read_id = opc_ua::ReadRequest::NODE_ID;
+
+	// small requests are decoded over the same object
+	opc_ua::Struct* small = &cache.get(read_id, 1000);
+	dynamic_cast<opc_ua::ReadRequest&>(*small).nodes_to_read.resize(10);
+	cache.release();
+	if (&cache.get(read_id, 10) != small || cache.size() != 1)
+		throw std::logic_error("Small request not decoded over the cached one");
+	cache.release();
+
+	// a large one gets its own object, not kept
+	opc_ua::Struct& large = cache.get(read_id, 1001);
+	if (&large == small || !dynamic_cast<opc_ua::ReadRequest*>(&large))
+		throw std::logic_error("Large request decoded over the cached one");
+	cache.release();
+	if (cache.size() != 1 || &cache.get(read_id, 0) != small
+			|| dynamic_cast<opc_ua::ReadRequest&>(*small).nodes_to_read.size() != 10)
+		throw std::logic_error("Cached request lost after a large one");
+	cache.release();
+
+	// of a different type
+	if (!dynamic_cast<opc_ua::WriteRequest*>(&cache.get(opc_ua::WriteRequest::NODE_ID, 1001))
+			|| !dynamic_cast<opc_ua::WriteRequest*>(&cache.get(opc_ua::WriteRequest::NODE_ID, 1)))
+		throw std::logic_error("Cached request of a wrong type");
+	cache.release();
+	if (cache.size() != 2)
+		throw std::logic_error("Wrong number of cached requests");
+}
+
+void test_slab()
+{
+	std::shared_ptr<int> obj(new int(1));
+	opc_ua::Slab<std::shared_ptr<int>, 4> slab;
+	std::vector<size_t> ids;
+
+	// spanning two blocks
+	for (int i = 0; i < 6; ++i)
+		ids.push_back(slab.emplace(obj));
+	if (ids != std::vector<size_t>{0, 1, 2, 3, 4, 5})
+		throw std::logic_error("Slab ids not allocated in order");
+
+	slab.erase(1);
+	slab.erase(4);
+	if (slab.contains(1) || slab.contains(4) || !slab.contains(5)
+			|| slab.contains(8) || slab.size() != 4)
+		throw std::logic_error("Erased slab objects still present");
+	if (obj.use_count() != 5)
+		throw std::logic_error("Erased slab objects not destroyed");
+
+	// freed ids are reused, most recent first
+	if (slab.emplace(obj) != 4 || slab.emplace(obj) != 1
+			|| slab.emplace(obj) != 6)
+		throw std::logic_error("Freed slab ids not reused");
+	if (*slab[6] != 1)
+		throw std::logic_error("Slab object differs from the original");
+
+	slab.clear();
+	if (slab.size() != 0 || slab.contains(0) || slab.contains(6))
+		throw std::logic_error("Cleared slab not empty");
+	if (obj.use_count() != 1)
+		throw std::logic_error("Cleared slab objects not destroyed");
+
+	size_t id = slab.emplace(obj);
+	if (id >= 8 || !slab.contains(id) || slab.size() != 1)
+		throw std::logic_error("Slab unusable after clear");
+}
+
+void test_timer_wheel()
+{
+	opc_ua::TimerWheel<int> wheel(8, 0);
+	std::vector<int> fired;
+	auto expired = [&fired] (int v) { fired.push_back(v); };
+
+	// beyond one revolution, sharing the slot with an earlier timer
+	wheel.add(3, 1);
+	wheel.add(3 + 8, 2);
+	wheel.add(3 + 16, 3);
+	wheel.advance(3, expired);
+	if (fired != std::vector<int>{1} || wheel.size() != 2)
+		throw std::logic_error("Timer expired before its round");
+	wheel.advance(10, expired);
+	if (fired != std::vector<int>{1})
+		throw std::logic_error("Timer expired before its round");
+	wheel.advance(11, expired);
+	if (fired != std::vector<int>{1, 2} || wheel.size() != 1)
+		throw std::logic_error("Timer not expired in its round");
+
+	// a long pause expires everything due, in any slot
+	fired.clear();
+	wheel.add(12, 4);
+	wheel.add(40, 5);
+	wheel.add(1001, 6);
+	wheel.advance(1000, expired);
+	std::sort(fired.begin(), fired.end());
+	if (fired != std::vector<int>{3, 4, 5} || wheel.size() != 1)
+		throw std::logic_error("Timers not expired after a long pause");
+
+	// re-added from the callback, with an expiry that has passed
+	fired.clear();
+	wheel.advance(1001, [&wheel, &fired] (int v) {
+		fired.push_back(v);
+		wheel.add(1001, v + 1);
+	});
+	if (fired != std::vector<int>{6} || wheel.size() != 1)
+		throw std::logic_error("Re-added timer expired in the same advance");
+	wheel.advance(1002, expired);
+	wheel.advance(1003, expired);
+	if (fired != std::vector<int>{6, 7} || !wheel.empty())
+		throw std::logic_error("Re-added timer not expired on the next tick");
+
+	// cancelled, by the tick returned for a passed expiry
+	fired.clear();
+	uint64_t tick = wheel.add(10, 8);
+	wheel.add(tick, 9);
+	if (tick != 1004 || !wheel.cancel(tick, 8) || wheel.cancel(tick, 8)
+			|| wheel.size() != 1)
+		throw std::logic_error("Timer not cancelled");
+	wheel.advance(1004, expired);
+	if (fired != std::vector<int>{9} || !wheel.empty())
+		throw std::logic_error("Cancelled timer expired");
+}
+
+void test_chacha20()
+{
+	// RFC 7539, 2.3.2
+	uint32_t key[8], nonce[3] = {0x09000000, 0x4a000000, 0x00000000};
+	for (uint32_t i = 0; i < 8; ++i)
+		key[i] = (4*i) | (4*i + 1) << 8 | (4*i + 2) << 16 | (4*i + 3) << 24;
+
+	static const unsigned char expected[64] = {
+		0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15,
+		0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4,
+		0xc7, 0xd1, 0xf4, 0xc7, 0x33, 0xc0, 0x68, 0x03,
+		0x04, 0x22, 0xaa, 0x9a, 0xc3, 0xd4, 0x6c, 0x4e,
+		0xd2, 0x82, 0x64, 0x46, 0x07, 0x9f, 0xaa, 0x09,
+		0x14, 0xc2, 0xd7, 0x05, 0xd9, 0x8b, 0x02, 0xa2,
+		0xb5, 0x12, 0x9c, 0xd1, 0xde, 0x16, 0x4e, 0xb9,
+		0xcb, 0xd0, 0x83, 0xe8, 0xa2, 0x50, 0x3c, 0x4e,
+	};
+	unsigned char out[64];
+
+	opc_ua::chacha20_block(key, 1, nonce, out);
+	if (memcmp(out, expected, sizeof(out)))
+		throw std::logic_error("ChaCha20 block differs from the test vector");
+}
+
+void test_session_destroyed()
+{
+	opc_ua::tcp::Future<opc_ua::ReadResponse> f;
+	opc_ua::ReadRequest req;
+
+	{
+		opc_ua::tcp::SessionStream s("test");
+
+		// no timeout to complete it, queued for the session
+		s.default_timeout = 0;
+		s.write_message(req, f);
+		if (f.is_ready())
+			throw std::logic_error("Queued request completed early");
+	}
+
+	if (!f.is_ready() || f.status() != opc_ua::status::Bad_CommunicationError)
+		throw std::logic_error("Pending request not failed with the session");
+
+	// a callback retrying the failed request
+	int failures = 0;
+	{
+		// (declared first, as the session calls it when destroyed)
+		std::function<void(std::unique_ptr<opc_ua::Response>, void*)> retry;
+		opc_ua::tcp::SessionStream s("test");
+
+		s.default_timeout = 0;
+		retry = [&s, &retry, &failures] (std::unique_ptr<opc_ua::Response> resp, void*) {
+			opc_ua::ReadRequest again;
+
+			if (resp->response_header.service_result != opc_ua::status::Bad_CommunicationError)
+				throw std::logic_error("Wrong status for the request failed with the session");
+			if (++failures < 3)
+			{
+				int before = failures;
+				s.write_message(again, retry, nullptr);
+				if (failures == before)
+					throw std::logic_error("Request sent during the session destruction not failed right away");
+			}
+		};
+		s.write_message(req, retry, nullptr);
+	}
+
+	if (failures != 3)
+		throw std::logic_error("Requests re-sent from the callback not failed");
+}
+
 int main()
 {
 	// Spec-provided examples
@@ -66,11 +1519,65 @@ int main()
 			{0x03, 0x01, 0x00, 0x06, 0x00, 0x00, 0x00, 0x48, 0x6F, 0x74, 0xE6, 0xB0, 0xB4});
 	test_serialize<opc_ua::NodeId>(opc_ua::NodeId(0x72), {0x00, 0x72});
 	test_serialize<opc_ua::NodeId>(opc_ua::NodeId(1025, 5), {0x01, 0x05, 0x01, 0x04});
+	test_serialize<opc_ua::NodeId>(opc_ua::NodeId(0x72, 1), {0x01, 0x01, 0x72, 0x00});
+	test_node_id();
+
+	// DateTime, Unix Epoch is 116444736000000000 ticks
+	test_serialize<opc_ua::DateTime>(opc_ua::DateTime({0, 0}),
+			{0x00, 0x80, 0x3E, 0xD5, 0xDE, 0xB1, 0x9D, 0x01});
+	test_serialize<opc_ua::DateTime>(opc_ua::DateTime({1, 999999900}),
+			{0xFF, 0xAC, 0x6F, 0xD6, 0xDE, 0xB1, 0x9D, 0x01});
+	test_unserialize<opc_ua::DateTime>({0, 0, 0, 0, 0, 0, 0, 0},
+			opc_ua::DateTime({-11644473600, 0}));
 
 	// Test variants
 	test_serialize<opc_ua::Variant>(opc_ua::Variant(true), {0x01, 0x01});
 	test_serialize<opc_ua::Variant>(opc_ua::Variant(opc_ua::String("ABCD")),
 			{0x0C, 0x04, 0x00, 0x00, 0x00, 0x41, 0x42, 0x43, 0x44});
 
+	test_variant_copy();
+	test_reuse();
+	test_array_limits();
+	test_copy_skip();
+
+	// Data larger than the write slab, mixed with buffered writes
+	std::string long_str(6000, 'x');
+	std::vector<uint8_t> long_ser{0x70, 0x17, 0x00, 0x00};
+	long_ser.insert(long_ser.end(), long_str.begin(), long_str.end());
+	test_serialize<opc_ua::String>(long_str, long_ser);
+	long_ser.insert(long_ser.begin(), 0x0C);
+	test_serialize<opc_ua::Variant>(opc_ua::Variant(long_str), long_ser);
+
+	// Arrays
+	test_array<opc_ua::UInt32>({1, 0x01020304},
+			{0x02, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x04, 0x03, 0x02, 0x01});
+	test_array<opc_ua::Double>({1.0},
+			{0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xF0, 0x3F});
+	test_array<opc_ua::String>({"A", ""},
+			{0x02, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x41, 0xFF, 0xFF, 0xFF, 0xFF});
+	test_array<opc_ua::UInt32>({}, {0xFF, 0xFF, 0xFF, 0xFF});
+
+	test_extension_object();
+	test_chunk_limits();
+	test_pipelined_requests();
+	test_read_pause();
+	test_deferred_response();
+	test_chunk_writer();
+	test_write_out_error();
+	test_connection_reset();
+	test_channel_counters();
+	test_channel_open_race();
+	test_session_lifecycle();
+	test_session_setup_fault();
+
+	test_request_cache();
+	test_slab();
+	test_timer_wheel();
+	test_chacha20();
+	test_session_destroyed();
+
+	// Truncated input
+	test_short_read({0x06, 0x00, 0x00, 0x00, 0xE6, 0xB0});
+
 	return 0;
 }